@@ -0,0 +1,135 @@
+#ifndef _AUTOTUNE_H_
+#define _AUTOTUNE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Search for threads (-j), window (-w) and receive batch (-r).
+//
+// Threads * Window slots must fit the slots the device kernel was compiled
+// with. The candidates are enumerated in a fixed order from the command
+// line alone, so every worker runs the same sequence of calibration steps
+// without talking to the others; the timings are then agreed on through
+// the rendezvous, so every worker also picks the same one.
+namespace autotune {
+
+// Slots the device kernel has room for, 0 if unknown. The ncrt info file
+// does not list memory sizes, so look next to it: the generated P4 sizes
+// _mem_Count at two aggregators per slot, the kernel source has NUM_SLOTS.
+inline unsigned DeviceSlots(const std::string &info) {
+  auto base = info;
+  auto pos = base.rfind(".ncrt.info.json");
+  if (pos != std::string::npos)
+    base.erase(pos);
+
+  std::ifstream p4(base + ".p4");
+  std::string line;
+  std::smatch m;
+  static const std::regex count(R"(Register<.*>\((\d+)\)\s+_mem_Count;)");
+  while (std::getline(p4, line))
+    if (std::regex_search(line, m, count))
+      return std::stoul(m[1]) / 2;
+
+  pos = base.find(".device.");
+  std::ifstream ncl(pos == std::string::npos ? base : base.substr(0, pos));
+  static const std::regex slots(R"(#define\s+NUM_SLOTS\s+(\d+))");
+  while (std::getline(ncl, line))
+    if (std::regex_search(line, m, slots))
+      return std::stoul(m[1]);
+  return 0;
+}
+
+struct Config {
+  unsigned threads = 0;
+  unsigned window = 0;
+  unsigned rx = 0;
+};
+
+struct Result {
+  Config config;
+  uint64_t medianUs = 0;
+  uint64_t tailUs = 0;
+  double gbps = 0;
+};
+
+// Powers of two up to `maxThreads` threads and 1024 slots per thread, that
+// fit `capacity` and split `values` evenly. Receive batches of 1, 16 and
+// a full window.
+inline std::vector<Config> Candidates(unsigned capacity, unsigned maxThreads,
+                                      size_t values, unsigned perPacket) {
+  std::vector<Config> out;
+  for (unsigned j = 1; j <= maxThreads; j *= 2)
+    for (unsigned w = 8; w <= 1024 && j * w <= capacity; w *= 2) {
+      if (values % (static_cast<size_t>(j) * w * perPacket))
+        continue;
+      for (unsigned r : {1u, 16u, w})
+        if (r <= w && (out.empty() || out.back().threads != j ||
+                       out.back().window != w || out.back().rx != r))
+          out.push_back({j, w, r});
+    }
+  return out;
+}
+
+// Best goodput among the configurations whose slowest step is within twice
+// the median, fewer slots on a tie. Falls back to the best goodput if none
+// is that steady.
+inline const Result *Pick(const std::vector<Result> &results) {
+  const Result *best = nullptr;
+  for (int steady = 1; steady >= 0 && !best; --steady)
+    for (auto &r : results) {
+      if (!r.medianUs || (steady && r.tailUs > 2 * r.medianUs))
+        continue;
+      if (!best || r.gbps > best->gbps ||
+          (r.gbps == best->gbps && r.config.threads * r.config.window <
+                                       best->config.threads * best->config.window))
+        best = &r;
+    }
+  return best;
+}
+
+// key=value lines, '#' comments
+inline bool Save(const std::string &path, const Result &r, unsigned capacity,
+                 unsigned world) {
+  std::ofstream o(path);
+  o << "# worker3 --autotune profile\n"
+    << "threads=" << r.config.threads << '\n'
+    << "window=" << r.config.window << '\n'
+    << "rx=" << r.config.rx << '\n'
+    << "# measured with " << world << " workers, " << capacity
+    << " device slots: median " << r.medianUs << "us, tail " << r.tailUs
+    << "us, " << std::fixed << std::setprecision(2) << r.gbps << " Gbps\n";
+  return static_cast<bool>(o);
+}
+
+inline bool Load(const std::string &path, Config &c) {
+  std::ifstream in(path);
+  if (!in)
+    return false;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    auto eq = line.find('=');
+    if (eq == std::string::npos)
+      continue;
+    auto key = line.substr(0, eq);
+    auto value = std::stoul(line.substr(eq + 1));
+    if (key == "threads")
+      c.threads = value;
+    else if (key == "window")
+      c.window = value;
+    else if (key == "rx")
+      c.rx = value;
+  }
+  return c.threads && c.window;
+}
+
+} // namespace autotune
+
+#endif
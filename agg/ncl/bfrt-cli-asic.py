@@ -22,12 +22,16 @@ if bfrt.pre.mgid.info(return_info=True, print_info=False)['usage']:
     for e in bfrt.pre.mgid.get(regex=True, return_ents=True, print_ents=False):
         e.remove()
 
+# "program": "allreduce" selects the single program (allreduce.ncl), whose
+# workers per job are set by the hosts at start instead of compiled in
+PROGRAM = C.get('program', f"allreduce_{C['active-workers']}")
+
 print("configuration")
-print(f" p4_allreduce_{C['active-workers']}_ncl_device_1")
+print(f" p4_{PROGRAM}_ncl_device_1")
 
-NCRT = eval(f'bfrt.p4_allreduce_{C["active-workers"]}_ncl_device_1.pipe.ncrt')
-NCVM = eval(f'bfrt.p4_allreduce_{C["active-workers"]}_ncl_device_1.pipe.ncvm')
-NET = eval(f'bfrt.p4_allreduce_{C["active-workers"]}_ncl_device_1.pipe.MainIngress.net')
+NCRT = eval(f'bfrt.p4_{PROGRAM}_ncl_device_1.pipe.ncrt')
+NCVM = eval(f'bfrt.p4_{PROGRAM}_ncl_device_1.pipe.ncvm')
+NET = eval(f'bfrt.p4_{PROGRAM}_ncl_device_1.pipe.MainIngress.net')
 
 # NCRT tables
 NCRT.ingress.tbl.forward.multicast.clear()
@@ -41,6 +45,9 @@ for i in range(32):
     exec(f"NCVM.mem.net.Agg_fragment_{i}_.clear()")
 NCVM.mem.net.Expo.clear()
 NCVM.mem.net.Count.clear()
+if PROGRAM == 'allreduce':
+    NCVM.mem.net.World.clear()
+    NCVM.mem.net.Overflow.clear()
 NCVM.mem.net.Bitmap_fragment_0_.clear()
 NCVM.mem.net.Bitmap_fragment_1_.clear()
 
@@ -0,0 +1,200 @@
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "popl.h" // https://github.com/badaix/popl
+#include "reduce.h"
+
+// Software stand-in for the device, for testing workers without a switch.
+//
+// Runs the allreduce.ncl kernels over plain UDP: allreduce() with the same
+// registers, bitmaps and versions as the device, and configure() to set the
+// workers of a range of slots. World starts at 0 like on the device, and a
+// range nobody configured uses -W, the kernel's DEFAULT_WORLD. Reflects go
+// back to the sender, multicasts to the last address every rank used for
+// the slot.
+//
+// The upper bits of `ver` select the reduction (reduce.h), bit 0 is the
+// slot version. Saturated sums are flagged in `ver` like the device does.
+
+#define NUM_SLOTS  16384
+#define SLOT_SIZE  32
+#define RANGE_BITS 8
+#define NUM_RANGES (NUM_SLOTS >> RANGE_BITS)
+
+struct __attribute__((packed)) ncp_h {
+  uint8_t h_src, h_dst, d_src, d_dst, cid, act;
+  uint16_t act_arg;
+};
+
+struct __attribute__((packed)) allreduce_h {
+  ncp_h ncp;
+  uint8_t ver;
+  uint16_t bmp_idx;
+  uint16_t agg_idx;
+  uint32_t mask;
+  uint32_t offset;
+  uint32_t expo;
+  uint32_t values[SLOT_SIZE];
+};
+
+struct __attribute__((packed)) configure_h {
+  ncp_h ncp;
+  uint16_t range;
+  uint32_t world;
+};
+
+static uint32_t Expo[NUM_SLOTS * 2], Count[NUM_SLOTS * 2];
+static uint32_t Overflow[NUM_SLOTS * 2];
+static uint32_t Bitmap[2][NUM_SLOTS], Agg[SLOT_SIZE][NUM_SLOTS * 2];
+static uint32_t World[NUM_RANGES];
+
+int main(int argc, char **argv) {
+  bool help;
+  unsigned world, drop;
+  uint16_t port;
+  std::string ip, ignore;
+
+  popl::OptionParser parser;
+  parser.add<popl::Switch>("h", "help", "print this help message", &help);
+  parser.add<popl::Value<unsigned>>(
+      "W", "world",
+      "workers of slot ranges that were not configured (DEFAULT_WORLD)", 2,
+      &world);
+  parser.add<popl::Value<std::string>>("I", "ip", "address to listen on",
+                                       "127.0.0.1", &ip);
+  parser.add<popl::Value<uint16_t>>("P", "port", "udp port to listen on",
+                                    4242, &port);
+  parser.add<popl::Value<unsigned>>("", "drop",
+                                    "drop every n-th packet (0: none)", 0,
+                                    &drop);
+  parser.add<popl::Value<std::string>>(
+      "", "ignore", "drop everything from this address, a failed link", "",
+      &ignore);
+  parser.parse(argc, argv);
+
+  if (help) {
+    std::cout << parser;
+    return 0;
+  }
+  if (world < 1 || world > 32) {
+    std::cout << "error: -W/--world must be within 1-32\n";
+    return 1;
+  }
+  int soc = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(ip.c_str());
+  addr.sin_port = htons(port);
+  int bufsize = 64 << 20;
+  setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+  if (bind(soc, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    std::cout << "error: cannot bind to " << ip << ':' << port << '\n';
+    return 1;
+  }
+  std::cout << "[emulator] listening on " << ip << ':' << port << ", "
+            << NUM_SLOTS << " slots, " << world << " workers by default\n";
+
+  in_addr_t ignored = ignore.empty() ? INADDR_NONE : inet_addr(ignore.c_str());
+  std::map<uint32_t, sockaddr_in> hosts; // rank << 16 | slot -> address
+  uint64_t received = 0;
+
+  while (true) {
+    allreduce_h p;
+    sockaddr_in src;
+    socklen_t srclen = sizeof(src);
+    auto n = recvfrom(soc, &p, sizeof(p), 0, (sockaddr *)&src, &srclen);
+    if (n < (ssize_t)sizeof(ncp_h))
+      continue;
+    if (drop && ++received % drop == 0)
+      continue;
+    if (src.sin_addr.s_addr == ignored)
+      continue;
+
+    if (p.ncp.cid == 2 && n >= (ssize_t)sizeof(configure_h)) {
+      auto *c = reinterpret_cast<configure_h *>(&p);
+      auto range = ntohs(c->range);
+      if (range < NUM_RANGES) {
+        World[range] = ntohl(c->world);
+        sendto(soc, c, sizeof(*c), 0, (sockaddr *)&src, srclen);
+      }
+      continue;
+    }
+    if (p.ncp.cid != 1 || n < (ssize_t)sizeof(p))
+      continue;
+
+    uint16_t bmp = ntohs(p.bmp_idx), agg = ntohs(p.agg_idx);
+    if (bmp >= NUM_SLOTS || agg >= NUM_SLOTS * 2)
+      continue;
+    uint32_t mask = ntohl(p.mask), expo = ntohl(p.expo);
+    hosts[(p.ncp.h_src << 16) | bmp] = src;
+
+    auto op = static_cast<reduce::Op>((p.ver & reduce::OpMask) >>
+                                      reduce::OpShift);
+    uint32_t bitmap;
+    if (reduce::Version(p.ver) == 0) {
+      bitmap = Bitmap[0][bmp];
+      Bitmap[0][bmp] |= mask;
+      Bitmap[1][bmp] &= ~mask;
+    } else {
+      Bitmap[0][bmp] &= ~mask;
+      bitmap = Bitmap[1][bmp];
+      Bitmap[1][bmp] |= mask;
+    }
+
+    auto workers = World[bmp >> RANGE_BITS];
+    if (workers == 0)
+      workers = world;
+    if (bitmap == 0) {
+      Expo[agg] = expo;
+      for (int i = 0; i < SLOT_SIZE; ++i)
+        Agg[i][agg] = ntohl(p.values[i]);
+      Count[agg] = workers - 1;
+      Overflow[agg] = 0;
+      if (workers > 1)
+        continue;
+    }
+
+    // atomic_cond_dec() returns the count before the decrement: 1 for the
+    // last worker (multicast), 0 for a retransmission after that (reflect).
+    // A retransmission before that gets nothing back.
+    bool seen = bitmap & mask;
+    uint32_t cnt = Count[agg];
+    if (!seen && bitmap) {
+      Expo[agg] = std::max(Expo[agg], expo);
+      for (int i = 0; i < SLOT_SIZE; ++i)
+        Agg[i][agg] = reduce::Apply(op, Agg[i][agg], ntohl(p.values[i]));
+      Count[agg] = cnt - 1;
+    }
+    p.expo = htonl(Expo[agg]);
+    for (int i = 0; i < SLOT_SIZE; ++i)
+      p.values[i] = htonl(Agg[i][agg]);
+    if (op == reduce::SatAdd && bitmap) {
+      uint32_t sat = 0;
+      for (int i = 0; i < SLOT_SIZE; ++i)
+        sat |= Agg[i][agg] == 0x7fffffff || Agg[i][agg] == 0x80000000;
+      if (!seen)
+        Overflow[agg] |= sat;
+      if (Overflow[agg])
+        p.ver |= reduce::Overflowed;
+    }
+
+    if (bitmap && cnt == 0) {
+      sendto(soc, &p, sizeof(p), 0, (sockaddr *)&src, srclen); // reflect
+    } else if ((cnt == 1 && !seen) || workers == 1) {
+      for (unsigned w = 1; w <= 32; ++w) { // multicast
+        auto it = hosts.find((w << 16) | bmp);
+        if (it != hosts.end())
+          sendto(soc, &p, sizeof(p), 0, (sockaddr *)&it->second,
+                 sizeof(sockaddr_in));
+      }
+    }
+  }
+}
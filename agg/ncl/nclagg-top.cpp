@@ -0,0 +1,194 @@
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <dirent.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <thread>
+
+#include "popl.h" // https://github.com/badaix/popl
+#include "worker_telemetry.h"
+
+// Live view of the workers running on this host with --telemetry.
+//
+// Maps every /dev/shm/nclagg.<port>.<pid> segment read-only and prints, per worker,
+// rates over the last interval and the current in-flight slots, optionally
+// per thread. Reading never blocks or slows down the workers.
+
+using telemetry::Counters;
+
+struct Worker {
+  const telemetry::Segment *seg = nullptr;
+  std::vector<Counters> last;
+};
+
+static const telemetry::Segment *Map(const std::string &name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return nullptr;
+  void *m = mmap(nullptr, sizeof(telemetry::Segment), PROT_READ, MAP_SHARED,
+                 fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return nullptr;
+  auto *seg = static_cast<const telemetry::Segment *>(m);
+  if (seg->magic != telemetry::Magic || seg->version != telemetry::Version) {
+    munmap(m, sizeof(telemetry::Segment));
+    return nullptr;
+  }
+  return seg;
+}
+
+static void Unmap(const telemetry::Segment *seg) {
+  munmap(const_cast<telemetry::Segment *>(seg), sizeof(telemetry::Segment));
+}
+
+// Segment names under /dev/shm, by port and pid
+static std::map<std::string, bool> Scan() {
+  std::map<std::string, bool> names;
+  if (auto *d = opendir("/dev/shm")) {
+    while (auto *e = readdir(d))
+      if (!strncmp(e->d_name, "nclagg.", 7))
+        names["/" + std::string(e->d_name)] = true;
+    closedir(d);
+  }
+  return names;
+}
+
+static Counters Sum(const std::vector<Counters> &v) {
+  Counters s{};
+  for (auto &c : v) {
+    auto *a = reinterpret_cast<uint64_t *>(&s);
+    auto *b = reinterpret_cast<const uint64_t *>(&c);
+    for (unsigned i = 0; i < telemetry::Words; ++i)
+      a[i] += b[i];
+  }
+  return s;
+}
+
+static void Row(std::ostream &o, const std::string &who, const Counters &now,
+                const Counters &before, double secs) {
+  auto rate = [&](uint64_t a, uint64_t b) { return (a - b) / secs; };
+  uint64_t calls = 0, results = 0;
+  for (unsigned b = 0; b < telemetry::BatchBuckets; ++b) {
+    auto n = now.rxBatch[b] - before.rxBatch[b];
+    calls += n;
+    results += n << b; // lower bound of the bucket
+  }
+  o << std::left << std::setw(14) << who << std::right << std::fixed
+    << std::setprecision(0) << std::setw(10)
+    << rate(now.txPackets, before.txPackets) << std::setw(10)
+    << rate(now.rxPackets, before.rxPackets) << std::setprecision(3)
+    << std::setw(9) << rate(now.rxBytes, before.rxBytes) * 8 / 1e9
+    << std::setprecision(0) << std::setw(8)
+    << (now.retransmits - before.retransmits) << std::setw(10)
+    << rate(now.emptyPolls, before.emptyPolls) << std::setw(10)
+    << rate(now.syscalls, before.syscalls) << std::setprecision(1)
+    << std::setw(7) << (calls ? (double)results / calls : 0.0)
+    << std::setw(9) << now.inflight << "  ";
+  // Share of receive calls per batch size bucket, 0-9
+  for (unsigned b = 0; b < telemetry::BatchBuckets; ++b) {
+    auto n = now.rxBatch[b] - before.rxBatch[b];
+    o << (calls ? n * 9 / calls : 0) << ' ';
+  }
+  o << '\n';
+}
+
+int main(int argc, char **argv) {
+  bool help, threads;
+  unsigned interval, count;
+
+  popl::OptionParser parser;
+  parser.add<popl::Switch>("h", "help", "print this help message", &help);
+  parser.add<popl::Value<unsigned>>("i", "interval", "refresh every ms", 1000,
+                                    &interval);
+  parser.add<popl::Value<unsigned>>("n", "count",
+                                    "stop after this many updates (0: never)",
+                                    0, &count);
+  parser.add<popl::Switch>("t", "threads", "one row per thread", &threads);
+  parser.parse(argc, argv);
+
+  if (help) {
+    std::cout << parser;
+    return 0;
+  }
+  if (interval == 0) {
+    std::cout << "error: -i/--interval must be > 0\n";
+    return 1;
+  }
+
+  std::map<std::string, Worker> workers;
+  auto t0 = std::chrono::steady_clock::now();
+  for (unsigned n = 0; !count || n <= count; ++n) {
+    auto names = Scan();
+    for (auto it = workers.begin(); it != workers.end();) {
+      if (!names.count(it->first) || kill(it->second.seg->pid, 0) != 0) {
+        Unmap(it->second.seg);
+        it = workers.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    for (auto &[name, _] : names) {
+      if (workers.count(name))
+        continue;
+      if (auto *seg = Map(name)) {
+        if (kill(seg->pid, 0) == 0)
+          workers[name].seg = seg;
+        else
+          Unmap(seg);
+      }
+    }
+
+    auto t1 = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(t1 - t0).count();
+    t0 = t1;
+
+    // The first pass only takes the baseline
+    if (n) {
+      std::cout << "\n" << std::left << std::setw(14) << "worker"
+                << std::right << std::setw(10) << "tx/s" << std::setw(10)
+                << "rx/s" << std::setw(9) << "rx Gbps" << std::setw(8)
+                << "retx" << std::setw(10) << "empty/s" << std::setw(10)
+                << "sys/s" << std::setw(7) << "batch" << std::setw(9)
+                << "inflight"
+                << "  1 2 4 8 ... 128 (share 0-9)\n";
+      if (workers.empty())
+        std::cout << "(no worker with --telemetry on this host)\n";
+    }
+
+    for (auto &[name, w] : workers) {
+      auto *seg = w.seg;
+      auto nthreads = std::min(seg->threads, telemetry::MaxThreads);
+      std::vector<Counters> now(nthreads);
+      for (unsigned t = 0; t < nthreads; ++t)
+        now[t] = telemetry::Read(seg->slots[t]);
+      if (w.last.size() != now.size())
+        w.last.assign(now.size(), Counters{});
+
+      if (n) {
+        std::string who = "rank " + std::to_string(seg->rank) + '/' +
+                          std::to_string(seg->world);
+        Row(std::cout, who, Sum(now), Sum(w.last), secs);
+        if (threads)
+          for (unsigned t = 0; t < nthreads; ++t)
+            Row(std::cout, "  thread " + std::to_string(t), now[t], w.last[t],
+                secs);
+        std::cout << "  " << seg->datapath << ", -j " << seg->threads
+                  << " -w " << seg->window << ", step "
+                  << seg->step.load(std::memory_order_relaxed) << ", pid "
+                  << seg->pid << '\n';
+      }
+      w.last = now;
+    }
+    std::cout.flush();
+
+    if (!count || n < count)
+      std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+  }
+
+  for (auto &[name, w] : workers)
+    Unmap(w.seg);
+  return 0;
+}
@@ -0,0 +1,409 @@
+// Python bindings for the worker3 engine.
+//
+//   import nclagg
+//   nclagg.init(["-R", "1", "-W", "2", "-I", "42.0.0.1", "-j", "4", "-w", "64"])
+//   nclagg.allreduce(buf)              # blocks, GIL released
+//   nclagg.allreduce(buf, op="max")    # add (default), max, min, or, and, sadd
+//   h = nclagg.allreduce_async(buf)    # queued, returns a Handle
+//   h.done(); h.wait()
+//   nclagg.finalize()
+//
+// init() takes the same options as worker3. `buf` is any writable,
+// C-contiguous buffer (numpy array, array.array, memoryview ...) of 32-bit
+// integers, or of float32 when initialized with --quant. Float32 buffers
+// reduce with the --op given to init(), add or sadd, any other op is an
+// error; sadd gives each worker the int32 range only up to the quantizer's
+// 2^30 clamp (quantize.h). The buffer is reduced in place, without copies
+// except for a padded tail when its length is not a multiple of
+// info()["values"]. Collectives run on one background thread
+// in submission order, which must be the same on every worker. As with
+// worker3, options that fail validation end the process.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define NCLAGG_NO_MAIN
+#include "worker3.cpp"
+
+#include <condition_variable>
+
+namespace nclagg {
+
+struct Job {
+  Py_buffer view;
+  bool isFloat;
+  ::reduce::Op op = ::reduce::Add;
+  std::promise<uint64_t> result;
+};
+
+// The session and the thread that runs queued collectives on it
+class Engine {
+public:
+  bool start() {
+    if (!session.open()) {
+      session.close();
+      return false;
+    }
+    expo = quant.enabled() ? quant.expo() : opt.Rank;
+    stop = false;
+    runner = std::thread(&Engine::run, this);
+    return true;
+  }
+
+  void shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    cv.notify_one();
+    if (runner.joinable())
+      runner.join();
+    session.close();
+  }
+
+  std::future<uint64_t> submit(Job *job) {
+    auto f = job->result.get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(job);
+    }
+    cv.notify_one();
+    return f;
+  }
+
+private:
+  void run() {
+    while (true) {
+      Job *job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return stop || !jobs.empty(); });
+        if (jobs.empty())
+          return;
+        job = jobs.front();
+        jobs.pop_front();
+      }
+      job->result.set_value(reduce(*job));
+    }
+  }
+
+  // Integers are the caller's in host order, the device reads them in
+  // network order: swap them in place around the collective
+  uint64_t reduce(Job &job) {
+    auto *ints = static_cast<uint32_t *>(job.view.buf);
+    size_t n = job.view.len / 4;
+    if (!job.isFloat)
+      ::reduce::Swap(ints, n);
+    auto us = reduceWire(job);
+    if (!job.isFloat)
+      ::reduce::Swap(ints, n);
+    return us;
+  }
+
+  // Whole collectives straight from the caller's memory, the remainder
+  // through a zero-padded copy. Returns the time in us, 0 on failure.
+  uint64_t reduceWire(Job &job) {
+    size_t words = opt.Size;
+    size_t values = words * quant.lanes();
+    size_t n = job.view.len / 4;
+    size_t whole = n / values, tail = n % values;
+    uint64_t us = 0;
+
+    if (whole) {
+      if (job.isFloat) {
+        auto *v = static_cast<float *>(job.view.buf);
+        wire.resize(whole * words);
+        us += session.allReduce(++step, &expo, wire.data(), whole, v, v,
+                                job.op);
+      } else {
+        us += session.allReduce(++step, &expo,
+                                static_cast<uint32_t *>(job.view.buf), whole,
+                                nullptr, nullptr, job.op);
+      }
+      if (!us)
+        return 0;
+    }
+
+    if (tail) {
+      auto *src = static_cast<uint8_t *>(job.view.buf) + whole * values * 4;
+      pad.assign(values, 0);
+      memcpy(pad.data(), src, tail * 4);
+      uint64_t t;
+      if (job.isFloat) {
+        auto *v = reinterpret_cast<float *>(pad.data());
+        wire.resize(words);
+        t = session.allReduce(++step, &expo, wire.data(), 1, v, v, job.op);
+      } else {
+        t = session.allReduce(++step, &expo, pad.data(), 1, nullptr, nullptr,
+                              job.op);
+      }
+      if (!t)
+        return 0;
+      memcpy(src, pad.data(), tail * 4);
+      us += t;
+    }
+    return us;
+  }
+
+  Session session;
+  uint32_t expo = 0;
+  uint32_t step = 0;
+  std::vector<uint32_t> wire, pad;
+
+  std::thread runner;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Job *> jobs;
+  bool stop = false;
+};
+
+static Engine *engine = nullptr;
+
+struct Handle {
+  PyObject_HEAD
+  Job *job;
+  std::future<uint64_t> *future;
+  uint64_t us;
+  bool finished;
+};
+
+// Wait for the collective with the GIL released and give the buffer back.
+// Returns false if the collective failed.
+static bool finish(Handle *h) {
+  if (h->finished)
+    return h->us != 0;
+  Py_BEGIN_ALLOW_THREADS
+  h->us = h->future->get();
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&h->job->view);
+  delete h->job;
+  delete h->future;
+  h->job = nullptr;
+  h->future = nullptr;
+  h->finished = true;
+  return h->us != 0;
+}
+
+static PyObject *HandleWait(Handle *h, PyObject *) {
+  if (!finish(h)) {
+    PyErr_SetString(PyExc_RuntimeError, "allreduce failed");
+    return nullptr;
+  }
+  return PyLong_FromUnsignedLongLong(h->us);
+}
+
+static PyObject *HandleDone(Handle *h, PyObject *) {
+  bool done = h->finished || h->future->wait_for(std::chrono::seconds(0)) ==
+                                 std::future_status::ready;
+  return PyBool_FromLong(done);
+}
+
+static void HandleDealloc(Handle *h) {
+  // The collective may still be writing into the buffer
+  finish(h);
+  Py_TYPE(h)->tp_free(reinterpret_cast<PyObject *>(h));
+}
+
+static PyMethodDef HandleMethods[] = {
+    {"wait", (PyCFunction)HandleWait, METH_NOARGS,
+     "Block until the collective is done, return its duration in us"},
+    {"done", (PyCFunction)HandleDone, METH_NOARGS,
+     "True if the collective is done"},
+    {nullptr, nullptr, 0, nullptr}};
+
+static PyTypeObject HandleType = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+static PyObject *Init(PyObject *, PyObject *args) {
+  PyObject *list;
+  if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &list))
+    return nullptr;
+  if (engine) {
+    PyErr_SetString(PyExc_RuntimeError, "already initialized");
+    return nullptr;
+  }
+
+  std::vector<std::string> argv{"nclagg"};
+  for (Py_ssize_t i = 0; i < PyList_Size(list); ++i) {
+    auto *s = PyUnicode_AsUTF8(PyList_GetItem(list, i));
+    if (!s)
+      return nullptr;
+    argv.emplace_back(s);
+  }
+  std::vector<char *> cargv;
+  for (auto &a : argv)
+    cargv.push_back(a.data());
+
+  try {
+    opt.parse(cargv.size(), cargv.data());
+  } catch (const std::exception &e) {
+    PyErr_SetString(PyExc_ValueError, e.what());
+    return nullptr;
+  }
+  LoadTuning();
+  if (!opt.Rendezvous.empty()) {
+    PyErr_SetString(PyExc_ValueError, "--rendezvous is not supported here");
+    return nullptr;
+  }
+  // Reports are for the command line tool
+  opt.Perf = true;
+
+  rails.parse(opt.Rails, opt.Iface, opt.IP);
+  quant.configure(Quantizer::parse(opt.Quant), opt.World, opt.QuantClip,
+                  opt.SIMD, opt.Ops[0] == ::reduce::SatAdd);
+  if (opt.DeviceWorld && !ConfigureWorld(opt.Slots)) {
+    PyErr_SetString(PyExc_OSError, "the device did not take --device-world");
+    return nullptr;
+  }
+  if (!SelectBackend(nullptr)) {
+    PyErr_SetString(PyExc_ValueError, "no usable --backend");
+    return nullptr;
+  }
+
+  engine = new Engine;
+  if (!engine->start()) {
+    delete engine;
+    engine = nullptr;
+    PyErr_SetString(PyExc_OSError, "failed to open the worker sockets");
+    return nullptr;
+  }
+  return PyLong_FromUnsignedLong(opt.Rank);
+}
+
+static PyObject *Finalize(PyObject *, PyObject *) {
+  if (engine) {
+    Py_BEGIN_ALLOW_THREADS
+    engine->shutdown();
+    Py_END_ALLOW_THREADS
+    delete engine;
+    engine = nullptr;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *Info(PyObject *, PyObject *) {
+  return Py_BuildValue("{s:I,s:I,s:I,s:I,s:I,s:I,s:s}", "rank", opt.Rank,
+                       "world", opt.World, "threads", opt.Threads, "window",
+                       opt.Window, "values", opt.Size * quant.lanes(), "lanes",
+                       quant.lanes(), "quant", opt.Quant.c_str());
+}
+
+static PyObject *AllReduceAsync(PyObject *, PyObject *args, PyObject *kwargs) {
+  static const char *kwlist[] = {"buf", "op", nullptr};
+  PyObject *obj;
+  const char *opName = nullptr; // add, or init()'s --op for float32
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|s",
+                                   const_cast<char **>(kwlist), &obj, &opName))
+    return nullptr;
+  ::reduce::Op op = ::reduce::Add;
+  if (opName && !::reduce::Parse(opName, op)) {
+    PyErr_SetString(PyExc_ValueError,
+                    "op must be one of add, max, min, or, and, sadd");
+    return nullptr;
+  }
+  if (!engine) {
+    PyErr_SetString(PyExc_RuntimeError, "call nclagg.init() first");
+    return nullptr;
+  }
+
+  auto *job = new Job;
+  if (PyObject_GetBuffer(obj, &job->view,
+                         PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) <
+      0) {
+    delete job;
+    return nullptr;
+  }
+
+  std::string fmt = job->view.format ? job->view.format : "B";
+  if (!fmt.empty() && strchr("@=<", fmt[0]))
+    fmt.erase(0, 1);
+  job->isFloat = fmt == "f";
+  bool isInt = (fmt == "I" || fmt == "i" || fmt == "L" || fmt == "l") &&
+               job->view.itemsize == 4;
+
+  const char *err = nullptr;
+  if (!job->isFloat && !isInt)
+    err = "expected a buffer of 32-bit integers or float32";
+  else if (job->isFloat && !quant.enabled())
+    err = "float32 buffers need --quant";
+  else if (isInt && quant.enabled())
+    err = "--quant expects float32 buffers";
+  if (job->isFloat && !opName)
+    op = opt.Ops[0];
+  // The quantizer was set up for init()'s --op, headroom or saturation
+  std::string mismatch;
+  if (!err && job->isFloat && op != opt.Ops[0]) {
+    mismatch = std::string("float32 buffers reduce with --op ") +
+               ::reduce::Name(opt.Ops[0]) + " given to init(), not " +
+               ::reduce::Name(op);
+    err = mismatch.c_str();
+  }
+  if (err) {
+    PyBuffer_Release(&job->view);
+    delete job;
+    PyErr_SetString(PyExc_TypeError, err);
+    return nullptr;
+  }
+  job->op = op;
+
+  auto *h = PyObject_New(Handle, &HandleType);
+  if (!h) {
+    PyBuffer_Release(&job->view);
+    delete job;
+    return nullptr;
+  }
+  h->job = job;
+  h->future = new std::future<uint64_t>(engine->submit(job));
+  h->us = 0;
+  h->finished = false;
+  return reinterpret_cast<PyObject *>(h);
+}
+
+static PyObject *AllReduceSync(PyObject *self, PyObject *args,
+                               PyObject *kwargs) {
+  auto *h = reinterpret_cast<Handle *>(AllReduceAsync(self, args, kwargs));
+  if (!h)
+    return nullptr;
+  auto *us = HandleWait(h, nullptr);
+  Py_DECREF(h);
+  return us;
+}
+
+static PyMethodDef Methods[] = {
+    {"init", Init, METH_VARARGS,
+     "init(args): set up the worker from worker3 command line options, "
+     "returns the rank"},
+    {"finalize", Finalize, METH_NOARGS, "Close the worker"},
+    {"info", Info, METH_NOARGS, "Worker configuration"},
+    {"allreduce", (PyCFunction)(void (*)())AllReduceSync,
+     METH_VARARGS | METH_KEYWORDS,
+     "allreduce(buf, op=None): reduce buf in place, returns the duration in "
+     "us. op defaults to add, for float32 to the --op of init()"},
+    {"allreduce_async", (PyCFunction)(void (*)())AllReduceAsync,
+     METH_VARARGS | METH_KEYWORDS,
+     "allreduce_async(buf, op=None): queue a reduction of buf, returns a "
+     "Handle"},
+    {nullptr, nullptr, 0, nullptr}};
+
+static PyModuleDef Module = {PyModuleDef_HEAD_INIT, "nclagg",
+                             "In-network allreduce", -1, Methods};
+
+} // namespace nclagg
+
+PyMODINIT_FUNC PyInit_nclagg(void) {
+  using namespace nclagg;
+  HandleType.tp_name = "nclagg.Handle";
+  HandleType.tp_basicsize = sizeof(Handle);
+  HandleType.tp_flags = Py_TPFLAGS_DEFAULT;
+  HandleType.tp_doc = "A queued allreduce";
+  HandleType.tp_methods = HandleMethods;
+  HandleType.tp_dealloc = (destructor)HandleDealloc;
+  if (PyType_Ready(&HandleType) < 0)
+    return nullptr;
+
+  auto *m = PyModule_Create(&Module);
+  if (!m)
+    return nullptr;
+  Py_INCREF(&HandleType);
+  PyModule_AddObject(m, "Handle", reinterpret_cast<PyObject *>(&HandleType));
+  return m;
+}
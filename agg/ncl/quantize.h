@@ -0,0 +1,283 @@
+#ifndef _QUANTIZE_H_
+#define _QUANTIZE_H_
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <string>
+
+#include "worker_utils.h"
+
+// Fixed-point quantization of float gradients into the 32-bit values the
+// device aggregates.
+//
+// A 32-bit value carries 1, 2 or 4 lanes of 32, 16 or 8 bits. The device
+// only knows how to add 32-bit values, so the lanes are laid out such that
+// a plain 32-bit add is a lane-wise add:
+//
+//  - every lane is stored big-endian, lanes in order, so that the carries of
+//    the device's (network order) add stay inside a lane
+//  - a worker contributes q + B per lane, with |q| < B = 2^(bits-1-h) and
+//    h = ceil(log2 World) bits of headroom, so the sum of World lanes
+//    never exceeds 2^bits and never carries into its neighbour
+//
+// The sum is decoded as lane - World * B. Values are scaled by a shared
+// power of two derived from --quant-clip, carried in the expo field, and
+// rounded stochastically so the quantization error is zero in expectation.
+//
+// With --op sadd (int32 only) the device adds signed and saturates, so
+// there is no bias and no headroom: every worker gets the whole range, as
+// far as the float clamp (fmax) allows: values are scaled to at most 2^30,
+// not 2^31 - 1, since larger int32 do not round-trip through float. A
+// chunk the device flags as saturated is quantized again retryBits()
+// coarser, which always fits, and sent once more.
+class Quantizer {
+public:
+  enum Mode { None, Int32, Int16, Int8 };
+
+  // expo = shift + ExpoBias, the shift may be negative
+  static constexpr int ExpoBias = 128;
+
+  static Mode parse(const std::string &s) {
+    if (s == "int32")
+      return Int32;
+    if (s == "int16")
+      return Int16;
+    if (s == "int8")
+      return Int8;
+    return None;
+  }
+
+  void configure(Mode m, unsigned world, float clip, bool simd,
+                 bool saturate = false) {
+    mode = m;
+    this->world = world;
+    this->simd = simd;
+    this->saturate = saturate && m == Int32;
+    laneBits = m == Int8 ? 8 : m == Int16 ? 16 : 32;
+    retry = 0;
+    while ((1u << retry) < world)
+      ++retry;
+    headroom = this->saturate ? 0 : retry;
+    bias = this->saturate ? 0 : 1u << (laneBits - 1 - headroom);
+    // one worker at int32 has no headroom: bias 2^31 and qmax INT32_MAX
+    qmax = this->saturate ? INT32_MAX
+                          : static_cast<int32_t>(std::min<int64_t>(
+                                static_cast<int64_t>(bias) - 1, INT32_MAX));
+    // clamp in float first, large int32 ranges do not round-trip exactly
+    fmax = static_cast<float>(std::min<int32_t>(qmax, 1 << 30));
+    // largest power of two that maps clip into [-fmax, fmax]
+    shift = static_cast<int>(std::floor(std::log2(fmax / clip)));
+  }
+
+  bool enabled() const { return mode != None; }
+  unsigned lanes() const { return 32 / laneBits; }
+  unsigned bits() const { return laneBits; }
+  unsigned headroomBits() const { return headroom; }
+  int32_t range() const { return qmax; }
+  int scaleShift() const { return shift; }
+  uint32_t expo() const { return shift + ExpoBias; }
+  bool saturating() const { return saturate; }
+  // How much coarser a saturated chunk is sent again
+  unsigned retryBits() const { return retry; }
+
+  // Largest possible error of one reduced value: one step per worker
+  float maxError(uint32_t expo) const {
+    return world * std::ldexp(1.0f, -(static_cast<int>(expo) - ExpoBias));
+  }
+
+  // Quantize `words * lanes()` values of `in` into `words` device values,
+  // `coarser` bits below the configured scale. `seed` is the caller's
+  // rounding state and is advanced.
+  void quantize(const float *in, uint32_t *out, size_t words, uint32_t &seed,
+                unsigned coarser = 0) const {
+    int s = shift - static_cast<int>(coarser);
+    size_t done = 0;
+#if defined(__AVX2__)
+    if (simd)
+      done = quantizeAVX2(in, out, words, seed, s);
+#endif
+    quantizeScalar(in + done * lanes(), out + done, words - done, seed, s);
+  }
+
+  // Decode `words` reduced device values into `words * lanes()` floats,
+  // using the scale the device returned in `expo`.
+  void dequantize(const uint32_t *in, float *out, size_t words,
+                  uint32_t expo) const {
+    float step = std::ldexp(1.0f, -(static_cast<int>(expo) - ExpoBias));
+    size_t done = 0;
+#if defined(__AVX2__)
+    if (simd)
+      done = dequantizeAVX2(in, out, words, step);
+#endif
+    dequantizeScalar(in + done, out + done * lanes(), words - done, step);
+  }
+
+private:
+  uint32_t encode(float x, uint32_t &seed, int shift) const {
+    seed = xorshift32(uint32_t(seed));
+    float u = (seed >> 8) * (1.0f / 16777216.0f);
+    float q = std::floor(std::ldexp(x, shift) + u);
+    q = std::min(std::max(q, -fmax), fmax);
+    auto i = std::min(std::max(static_cast<int32_t>(q), -qmax), qmax);
+    return static_cast<uint32_t>(i) + bias;
+  }
+
+  void quantizeScalar(const float *in, uint32_t *out, size_t words,
+                      uint32_t &seed, int shift) const {
+    auto *b = reinterpret_cast<uint8_t *>(out);
+    auto n = words * lanes();
+    for (size_t i = 0; i < n; ++i) {
+      auto v = encode(in[i], seed, shift);
+      if (laneBits == 8) {
+        b[i] = v;
+      } else if (laneBits == 16) {
+        b[2 * i] = v >> 8;
+        b[2 * i + 1] = v;
+      } else {
+        out[i] = htonl(v);
+      }
+    }
+  }
+
+  void dequantizeScalar(const uint32_t *in, float *out, size_t words,
+                        float step) const {
+    auto *b = reinterpret_cast<const uint8_t *>(in);
+    uint32_t offset = world * bias;
+    auto n = words * lanes();
+    for (size_t i = 0; i < n; ++i) {
+      int32_t q;
+      if (laneBits == 8)
+        q = static_cast<int32_t>(b[i]) - offset;
+      else if (laneBits == 16)
+        q = static_cast<int32_t>((b[2 * i] << 8) | b[2 * i + 1]) - offset;
+      else
+        q = static_cast<int32_t>(ntohl(in[i]) - offset);
+      out[i] = q * step;
+    }
+  }
+
+#if defined(__AVX2__)
+  // 8 floats to 8 biased lanes in int32
+  static inline __m256i encode8(__m256 x, __m256 scale, __m256i &rng,
+                                __m256 lo, __m256 hi, __m256i ilo,
+                                __m256i ihi, __m256i bias) {
+    rng = _mm256_xor_si256(rng, _mm256_slli_epi32(rng, 13));
+    rng = _mm256_xor_si256(rng, _mm256_srli_epi32(rng, 17));
+    rng = _mm256_xor_si256(rng, _mm256_slli_epi32(rng, 5));
+    __m256 u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(rng, 8)),
+                             _mm256_set1_ps(1.0f / 16777216.0f));
+    __m256 q = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, scale), u));
+    q = _mm256_min_ps(_mm256_max_ps(q, lo), hi);
+    __m256i i = _mm256_cvttps_epi32(q);
+    i = _mm256_min_epi32(_mm256_max_epi32(i, ilo), ihi);
+    return _mm256_add_epi32(i, bias);
+  }
+
+  size_t quantizeAVX2(const float *in, uint32_t *out, size_t words,
+                      uint32_t &seed, int shift) const {
+    __m256 scale = _mm256_set1_ps(std::ldexp(1.0f, shift));
+    __m256 lo = _mm256_set1_ps(-fmax), hi = _mm256_set1_ps(fmax);
+    __m256i ilo = _mm256_set1_epi32(-qmax), ihi = _mm256_set1_epi32(qmax);
+    __m256i bias = _mm256_set1_epi32(this->bias);
+
+    uint32_t s[8];
+    for (auto &l : s)
+      l = seed = xorshift32(uint32_t(seed));
+    __m256i rng = _mm256_loadu_si256(reinterpret_cast<__m256i *>(s));
+
+    // byte swaps to network order within 32/16 bit lanes
+    const __m256i swap32 = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6,
+        5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i swap16 = _mm256_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4,
+        7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m256i order8 = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    size_t w = 0;
+    for (; w + 8 <= words; w += 8) {
+      auto *dst = reinterpret_cast<__m256i *>(out + w);
+      auto *src = in + w * lanes();
+      auto enc = [&](int k) {
+        return encode8(_mm256_loadu_ps(src + 8 * k), scale, rng, lo, hi, ilo,
+                       ihi, bias);
+      };
+      if (laneBits == 32) {
+        _mm256_storeu_si256(dst, _mm256_shuffle_epi8(enc(0), swap32));
+      } else if (laneBits == 16) {
+        // packus interleaves the 128-bit halves, put them back in order
+        __m256i p = _mm256_packus_epi32(enc(0), enc(1));
+        p = _mm256_permute4x64_epi64(p, 0xD8);
+        _mm256_storeu_si256(dst, _mm256_shuffle_epi8(p, swap16));
+      } else {
+        __m256i ab = _mm256_packus_epi32(enc(0), enc(1));
+        __m256i cd = _mm256_packus_epi32(enc(2), enc(3));
+        __m256i p = _mm256_packus_epi16(ab, cd);
+        _mm256_storeu_si256(dst, _mm256_permutevar8x32_epi32(p, order8));
+      }
+    }
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(s), rng);
+    seed ^= s[0];
+    return w;
+  }
+
+  size_t dequantizeAVX2(const uint32_t *in, float *out, size_t words,
+                        float step) const {
+    __m256 vstep = _mm256_set1_ps(step);
+    __m256i offset = _mm256_set1_epi32(world * bias);
+    const __m256i swap32 = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6,
+        5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m128i swap16 =
+        _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+    auto decode8 = [&](__m256i v, float *dst) {
+      v = _mm256_sub_epi32(v, offset);
+      _mm256_storeu_ps(dst, _mm256_mul_ps(_mm256_cvtepi32_ps(v), vstep));
+    };
+
+    size_t w = 0;
+    for (; w + 8 <= words; w += 8) {
+      auto *src = reinterpret_cast<const uint8_t *>(in + w);
+      auto *dst = out + w * lanes();
+      if (laneBits == 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+        decode8(_mm256_shuffle_epi8(v, swap32), dst);
+      } else if (laneBits == 16) {
+        for (int k = 0; k < 2; ++k) {
+          __m128i v = _mm_loadu_si128(
+              reinterpret_cast<const __m128i *>(src + 16 * k));
+          decode8(_mm256_cvtepu16_epi32(_mm_shuffle_epi8(v, swap16)),
+                  dst + 8 * k);
+        }
+      } else {
+        for (int k = 0; k < 4; ++k) {
+          __m128i v = _mm_loadl_epi64(
+              reinterpret_cast<const __m128i *>(src + 8 * k));
+          decode8(_mm256_cvtepu8_epi32(v), dst + 8 * k);
+        }
+      }
+    }
+    return w;
+  }
+#endif
+
+  Mode mode = None;
+  unsigned world = 1;
+  bool simd = false;
+  unsigned laneBits = 32;
+  unsigned headroom = 0;
+  unsigned retry = 0;
+  bool saturate = false;
+  uint32_t bias = 0;
+  int32_t qmax = 0;
+  float fmax = 0;
+  int shift = 0;
+};
+
+#endif
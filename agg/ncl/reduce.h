@@ -0,0 +1,189 @@
+#ifndef _REDUCE_H_
+#define _REDUCE_H_
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <string>
+
+// Reduction operators of the aggregation kernel (allreduce.ncl).
+//
+// The operator of a chunk travels in the upper bits of the header's `ver`
+// byte, bit 0 stays the slot version. Add is 0, so the header of a sum is
+// unchanged and the fixed allreduce-N programs, which only add, keep
+// working. Values are 32-bit unsigned integers in network order: max and
+// min compare them unsigned, or/and are bitwise.
+//
+// SatAdd adds them as signed integers that saturate at the int32 limits
+// instead of wrapping. The device remembers that a slot saturated and
+// sets Overflowed in the `ver` byte of its result, so the hosts can send
+// the chunk again at a coarser scale.
+//
+// Apply() is the host side of the same operators, for the host backends
+// and for checking results.
+namespace reduce {
+
+enum Op : uint8_t { Add = 0, Max = 1, Min = 2, Or = 3, And = 4, SatAdd = 5 };
+
+constexpr unsigned NumOps = 6;
+constexpr uint8_t VersionMask = 1;
+constexpr unsigned OpShift = 1;
+constexpr uint8_t OpMask = 7 << OpShift;
+constexpr uint8_t Overflowed = 0x80; // set by the device in results
+
+inline const char *Name(Op op) {
+  static const char *names[] = {"add", "max", "min", "or", "and", "sadd"};
+  return op < NumOps ? names[op] : "?";
+}
+
+inline bool Parse(const std::string &s, Op &op) {
+  for (unsigned i = 0; i < NumOps; ++i)
+    if (s == Name(static_cast<Op>(i))) {
+      op = static_cast<Op>(i);
+      return true;
+    }
+  return false;
+}
+
+// `ver` byte of the header for slot version `version`
+inline uint8_t Ver(uint8_t version, Op op) { return version | op << OpShift; }
+inline uint8_t Version(uint8_t ver) { return ver & VersionMask; }
+
+inline int32_t SatAdd32(int32_t a, int32_t b) {
+  int64_t s = static_cast<int64_t>(a) + b;
+  return static_cast<int32_t>(
+      std::min<int64_t>(std::max<int64_t>(s, INT32_MIN), INT32_MAX));
+}
+
+inline uint32_t Apply(Op op, uint32_t a, uint32_t b) {
+  switch (op) {
+  case SatAdd:
+    return SatAdd32(a, b);
+  case Max:
+    return a > b ? a : b;
+  case Min:
+    return a < b ? a : b;
+  case Or:
+    return a | b;
+  case And:
+    return a & b;
+  default:
+    return a + b;
+  }
+}
+
+namespace detail {
+
+inline bool applyScalar(Op op, uint32_t *a, const uint32_t *b, size_t n) {
+  // or/and do not care about byte order
+  if (op == Or || op == And) {
+    for (size_t i = 0; i < n; ++i)
+      a[i] = op == Or ? a[i] | b[i] : a[i] & b[i];
+    return false;
+  }
+  if (op == SatAdd) {
+    bool saturated = false;
+    for (size_t i = 0; i < n; ++i) {
+      int64_t s = static_cast<int64_t>(static_cast<int32_t>(ntohl(a[i]))) +
+                  static_cast<int32_t>(ntohl(b[i]));
+      saturated |= s != static_cast<int32_t>(s);
+      a[i] = htonl(SatAdd32(ntohl(a[i]), ntohl(b[i])));
+    }
+    return saturated;
+  }
+  for (size_t i = 0; i < n; ++i)
+    a[i] = htonl(Apply(op, ntohl(a[i]), ntohl(b[i])));
+  return false;
+}
+
+#if defined(__AVX2__)
+template <Op op>
+inline size_t applyAVX2(uint32_t *a, const uint32_t *b, size_t n,
+                        bool &saturated) {
+  const __m256i swap32 = _mm256_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6,
+      5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  const __m256i max = _mm256_set1_epi32(INT32_MAX);
+  __m256i over = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    auto *pa = reinterpret_cast<__m256i *>(a + i);
+    auto *pb = reinterpret_cast<const __m256i *>(b + i);
+    __m256i x = _mm256_loadu_si256(pa), y = _mm256_loadu_si256(pb);
+    if (op == Or) {
+      x = _mm256_or_si256(x, y);
+    } else if (op == And) {
+      x = _mm256_and_si256(x, y);
+    } else {
+      x = _mm256_shuffle_epi8(x, swap32);
+      y = _mm256_shuffle_epi8(y, swap32);
+      if (op == SatAdd) {
+        // overflowed where both signs agree and the sum's differs, then
+        // the limit follows the sign of x
+        __m256i s = _mm256_add_epi32(x, y);
+        __m256i o = _mm256_andnot_si256(_mm256_xor_si256(x, y),
+                                        _mm256_xor_si256(x, s));
+        __m256i limit = _mm256_xor_si256(_mm256_srai_epi32(x, 31), max);
+        x = _mm256_blendv_epi8(s, limit, _mm256_srai_epi32(o, 31));
+        over = _mm256_or_si256(over, o);
+      } else if (op == Max)
+        x = _mm256_max_epu32(x, y);
+      else if (op == Min)
+        x = _mm256_min_epu32(x, y);
+      else
+        x = _mm256_add_epi32(x, y);
+      x = _mm256_shuffle_epi8(x, swap32);
+    }
+    _mm256_storeu_si256(pa, x);
+  }
+  saturated = _mm256_movemask_ps(_mm256_castsi256_ps(over));
+  return i;
+}
+#endif
+
+} // namespace detail
+
+// a[i] = a[i] op b[i] for `n` network order values. True if SatAdd
+// saturated any of them.
+inline bool Apply(Op op, uint32_t *a, const uint32_t *b, size_t n,
+                  bool simd = true) {
+  size_t done = 0;
+  bool saturated = false;
+#if defined(__AVX2__)
+  if (simd) {
+    switch (op) {
+    case Max:
+      done = detail::applyAVX2<Max>(a, b, n, saturated);
+      break;
+    case Min:
+      done = detail::applyAVX2<Min>(a, b, n, saturated);
+      break;
+    case Or:
+      done = detail::applyAVX2<Or>(a, b, n, saturated);
+      break;
+    case And:
+      done = detail::applyAVX2<And>(a, b, n, saturated);
+      break;
+    case SatAdd:
+      done = detail::applyAVX2<SatAdd>(a, b, n, saturated);
+      break;
+    default:
+      done = detail::applyAVX2<Add>(a, b, n, saturated);
+    }
+  }
+#endif
+  return detail::applyScalar(op, a + done, b + done, n - done) | saturated;
+}
+
+// Host order values to network order in place, and back: the same swap
+inline void Swap(uint32_t *v, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    v[i] = htonl(v[i]);
+}
+
+} // namespace reduce
+
+#endif
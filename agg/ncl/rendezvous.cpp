@@ -0,0 +1,33 @@
+#include <cstdint>
+#include <iostream>
+
+#include "popl.h" // https://github.com/badaix/popl
+#include "rendezvous.h"
+
+// Stand-in coordinator for when no worker should host it
+int main(int argc, char **argv) {
+  bool help;
+  unsigned world;
+  uint16_t port;
+
+  popl::OptionParser parser;
+  parser.add<popl::Switch>("h", "help", "print this help message", &help);
+  parser.add<popl::Value<unsigned>>("W", "world", "number of workers", 2,
+                                    &world);
+  parser.add<popl::Value<uint16_t>>("p", "port", "tcp port to listen on", 4300,
+                                    &port);
+  parser.parse(argc, argv);
+
+  if (help) {
+    std::cout << parser;
+    return 0;
+  }
+
+  if (world == 0) {
+    std::cout << "error: -W/--world must be > 0\n";
+    return 1;
+  }
+
+  rendezvous::Coordinator coordinator(port, world);
+  return coordinator.run(std::cout);
+}
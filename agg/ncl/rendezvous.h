@@ -0,0 +1,453 @@
+#ifndef _RENDEZVOUS_H_
+#define _RENDEZVOUS_H_
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Lightweight TCP rendezvous for worker hosts.
+//
+// One coordinator (a thread inside one of the workers, or the standalone
+// `rendezvous` daemon) accepts a connection per worker, assigns ranks,
+// releases all workers together at every barrier and collects the per-step
+// stats of every rank into one report. The protocol is line based:
+//
+//   worker -> HELLO <rank|0> <world>      coordinator -> RANK <rank>
+//                                         or ERROR <reason>
+//   worker -> BARRIER <id>                coordinator -> GO <id>  (to all)
+//   worker -> MAX <id> <v>...            coordinator -> MAX <id> <max v>...
+//   worker -> STATS <step> <us> <values>
+//   worker -> DONE
+//
+// MAX is a barrier that also returns the element-wise maximum of the
+// values every worker sent. A rank already taken, or one past the world,
+// is refused with ERROR.
+
+namespace rendezvous {
+
+inline bool splitHostPort(const std::string &s, std::string &host,
+                          uint16_t &port) {
+  auto colon = s.rfind(':');
+  if (colon == std::string::npos)
+    return false;
+  host = s.substr(0, colon);
+  try {
+    size_t end;
+    auto p = std::stoul(s.substr(colon + 1), &end);
+    if (end != s.size() - colon - 1 || p == 0 || p > 0xffff)
+      return false;
+    port = static_cast<uint16_t>(p);
+  } catch (const std::exception &) {
+    return false;
+  }
+  return true;
+}
+
+// Buffered line reader/writer over a connected socket
+class Line {
+public:
+  explicit Line(int fd = -1) : fd(fd) {}
+
+  int get() const { return fd; }
+
+  // How long recv() waits for a line, -1: forever
+  void timeout(int ms) { timeoutMs = ms; }
+
+  bool send(const std::string &line) {
+    std::string out = line + '\n';
+    size_t off = 0;
+    while (off < out.size()) {
+      auto n = ::send(fd, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      off += n;
+    }
+    return true;
+  }
+
+  // Complete line already buffered?
+  bool pending() const { return buf.find('\n') != std::string::npos; }
+
+  // Read whatever is available; false on EOF/error
+  bool fill() {
+    char tmp[512];
+    auto n = ::recv(fd, tmp, sizeof(tmp), 0);
+    if (n < 0 && errno == EINTR)
+      return true;
+    if (n <= 0)
+      return false;
+    buf.append(tmp, n);
+    return true;
+  }
+
+  bool next(std::string &line) {
+    auto nl = buf.find('\n');
+    if (nl == std::string::npos)
+      return false;
+    line = buf.substr(0, nl);
+    buf.erase(0, nl + 1);
+    return true;
+  }
+
+  // Blocking read of one line. False with errno ETIMEDOUT if none came
+  // within the timeout.
+  bool recv(std::string &line) {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeoutMs);
+    while (!next(line)) {
+      if (timeoutMs >= 0) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - std::chrono::steady_clock::now())
+                        .count();
+        pollfd p{fd, POLLIN, 0};
+        if (left <= 0 || poll(&p, 1, left) == 0) {
+          errno = ETIMEDOUT;
+          return false;
+        }
+      }
+      if (!fill())
+        return false;
+    }
+    return true;
+  }
+
+private:
+  int fd;
+  int timeoutMs = -1;
+  std::string buf;
+};
+
+class Coordinator {
+public:
+  Coordinator(uint16_t port, unsigned world) : port(port), world(world) {}
+
+  // Serve until every worker sent DONE (or hung up). Prints the aggregated
+  // report on `o`.
+  int run(std::ostream &o = std::cout) {
+    int lsoc = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(lsoc, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(lsoc, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lsoc, 64) < 0) {
+      log(o) << "error: cannot listen on port " << port << ": "
+             << strerror(errno) << '\n';
+      close(lsoc);
+      return 1;
+    }
+    log(o) << "waiting for " << world << " workers on port " << port << '\n';
+
+    std::vector<Line> peers;
+    std::map<int, unsigned> rankOf; // fd -> rank
+    std::map<uint32_t, std::vector<int>> barriers;
+    unsigned done = 0;
+
+    while (done < world) {
+      std::vector<pollfd> fds;
+      fds.push_back({lsoc, POLLIN, 0});
+      for (auto &p : peers)
+        fds.push_back({p.get(), POLLIN, 0});
+      if (poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+
+      if (fds[0].revents & POLLIN) {
+        int c = accept(lsoc, nullptr, nullptr);
+        if (c >= 0) {
+          setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          peers.emplace_back(c);
+        }
+      }
+
+      for (size_t i = 1; i < fds.size(); ++i) {
+        if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+          continue;
+        auto &peer = *std::find_if(peers.begin(), peers.end(), [&](Line &l) {
+          return l.get() == fds[i].fd;
+        });
+        if (!peer.fill()) {
+          if (rankOf.count(peer.get()) && !finished.count(rankOf[peer.get()])) {
+            log(o) << "rank " << rankOf[peer.get()] << " hung up\n";
+            finished.insert(rankOf[peer.get()]);
+            ++done;
+          }
+          close(peer.get());
+          rankOf.erase(peer.get());
+          peers.erase(std::find_if(peers.begin(), peers.end(), [&](Line &l) {
+            return l.get() == fds[i].fd;
+          }));
+          continue;
+        }
+
+        std::string line;
+        while (peer.next(line)) {
+          std::istringstream iss(line);
+          std::string cmd;
+          iss >> cmd;
+          if (cmd == "HELLO") {
+            unsigned rank = 0, w = 0;
+            iss >> rank >> w;
+            if (w != world)
+              log(o) << "warning: worker reports world " << w << ", expected "
+                     << world << '\n';
+            if (rankOf.count(peer.get()))
+              continue;
+            if (!rank)
+              for (rank = 1; taken.count(rank); ++rank)
+                ;
+            std::string refused;
+            if (taken.count(rank))
+              refused = "rank " + std::to_string(rank) + " is taken";
+            else if (rank > world)
+              refused = taken.size() == world
+                            ? "all " + std::to_string(world) + " ranks are taken"
+                            : "rank " + std::to_string(rank) + " is past world " +
+                                  std::to_string(world);
+            if (!refused.empty()) {
+              peer.send("ERROR " + refused);
+              log(o) << "refused a worker: " << refused << '\n';
+              continue;
+            }
+            taken.insert(rank);
+            rankOf[peer.get()] = rank;
+            peer.send("RANK " + std::to_string(rank));
+            log(o) << "rank " << rank << " joined (" << taken.size() << '/'
+                   << world << ")\n";
+          } else if (cmd == "BARRIER") {
+            uint32_t id = 0;
+            iss >> id;
+            auto &waiting = barriers[id];
+            waiting.push_back(peer.get());
+            if (waiting.size() == world) {
+              for (auto fd : waiting)
+                for (auto &p : peers)
+                  if (p.get() == fd)
+                    p.send("GO " + std::to_string(id));
+              barriers.erase(id);
+            }
+          } else if (cmd == "MAX") {
+            uint32_t id = 0;
+            iss >> id;
+            auto &r = maxima[id];
+            size_t k = 0;
+            for (uint64_t v; iss >> v; ++k)
+              if (k < r.values.size())
+                r.values[k] = std::max(r.values[k], v);
+              else
+                r.values.push_back(v);
+            r.fds.push_back(peer.get());
+            if (r.fds.size() == world) {
+              std::string reply = "MAX " + std::to_string(id);
+              for (auto v : r.values)
+                reply += ' ' + std::to_string(v);
+              for (auto fd : r.fds)
+                for (auto &p : peers)
+                  if (p.get() == fd)
+                    p.send(reply);
+              maxima.erase(id);
+            }
+          } else if (cmd == "STATS") {
+            uint32_t step = 0;
+            uint64_t us = 0, values = 0;
+            iss >> step >> us >> values;
+            auto &s = steps[step];
+            s.us.push_back(us);
+            s.values = values;
+            if (s.us.size() == world)
+              report(o, step, s);
+          } else if (cmd == "DONE") {
+            finished.insert(rankOf[peer.get()]);
+            ++done;
+          }
+        }
+      }
+    }
+
+    summary(o);
+    for (auto &p : peers)
+      close(p.get());
+    close(lsoc);
+    return 0;
+  }
+
+private:
+  struct Step {
+    std::vector<uint64_t> us;
+    uint64_t values = 0;
+  };
+
+  struct Max {
+    std::vector<int> fds;
+    std::vector<uint64_t> values;
+  };
+
+  std::ostream &log(std::ostream &o) { return o << "[rendezvous] "; }
+
+  void report(std::ostream &o, uint32_t step, Step &s) {
+    auto lo = *std::min_element(s.us.begin(), s.us.end());
+    auto hi = *std::max_element(s.us.begin(), s.us.end());
+    uint64_t sum = 0;
+    for (auto us : s.us)
+      sum += us;
+    // The collective is done when the slowest rank is
+    double gbps = ((double)s.values * 4 * 8 * world) / (((double)hi) * 1000);
+    log(o) << "step " << step << " | ranks: " << s.us.size()
+           << " | latency min/mean/max: " << lo << '/' << (sum / s.us.size())
+           << '/' << hi << "us | skew: " << (hi - lo) << "us | " << std::fixed
+           << std::setprecision(2) << gbps << " Gbps\n";
+  }
+
+  void summary(std::ostream &o) {
+    if (steps.empty())
+      return;
+    uint64_t worst = 0, skew = 0;
+    double gbps = 0;
+    for (auto &[step, s] : steps) {
+      auto lo = *std::min_element(s.us.begin(), s.us.end());
+      auto hi = *std::max_element(s.us.begin(), s.us.end());
+      worst += hi;
+      skew += hi - lo;
+      gbps += ((double)s.values * 4 * 8 * world) / (((double)hi) * 1000);
+    }
+    log(o) << "summary over " << steps.size() << " steps | latency (max rank): "
+           << (worst / steps.size()) << "us | skew: " << (skew / steps.size())
+           << "us | " << std::fixed << std::setprecision(2)
+           << (gbps / steps.size()) << " Gbps\n";
+  }
+
+  uint16_t port;
+  unsigned world;
+  std::set<unsigned> taken;
+  std::set<unsigned> finished;
+  std::map<uint32_t, Step> steps;
+  std::map<uint32_t, Max> maxima;
+};
+
+class Client {
+public:
+  // Give up on a reply (rank, barrier, max) after `timeoutSec`, 0: never.
+  // Barriers wait for the slowest rank, so it must cover a whole step.
+  explicit Client(unsigned timeoutSec = 0) : replySec(timeoutSec) {}
+
+  ~Client() {
+    if (line.get() >= 0)
+      close(line.get());
+  }
+
+  // Connect to the coordinator, retrying for up to `timeoutSec` while it
+  // is still starting up
+  bool connect(const std::string &hostport, unsigned timeoutSec = 30) {
+    std::string host;
+    uint16_t port;
+    if (!splitHostPort(hostport, host, port))
+      return false;
+
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints,
+                    &res) != 0)
+      return false;
+
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSec);
+    int fd = -1;
+    while (std::chrono::steady_clock::now() < deadline) {
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (::connect(fd, res->ai_addr, res->ai_addrlen) == 0)
+        break;
+      close(fd);
+      fd = -1;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+      return false;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    line = Line(fd);
+    line.timeout(replySec ? static_cast<int>(replySec * 1000) : -1);
+    return true;
+  }
+
+  // Join with `rank` (0: let the coordinator pick). Returns the rank, 0 on
+  // failure with the reason in `error`.
+  unsigned hello(unsigned rank, unsigned world, std::string &error) {
+    std::string reply, cmd;
+    if (!line.send("HELLO " + std::to_string(rank) + ' ' +
+                   std::to_string(world)) ||
+        !line.recv(reply)) {
+      error = errno == ETIMEDOUT ? "timed out" : "connection lost";
+      return 0;
+    }
+    std::istringstream iss(reply);
+    iss >> cmd >> rank;
+    if (cmd == "RANK" && rank)
+      return rank;
+    error = cmd == "ERROR" ? reply.substr(6) : "bad reply: " + reply;
+    return 0;
+  }
+
+  bool barrier(uint32_t id) {
+    std::string reply;
+    if (!line.send("BARRIER " + std::to_string(id)))
+      return false;
+    return line.recv(reply) && reply == "GO " + std::to_string(id);
+  }
+
+  // Replace `values` by their maximum over all workers
+  bool max(uint32_t id, std::vector<uint64_t> &values) {
+    std::string msg = "MAX " + std::to_string(id), reply, cmd;
+    for (auto v : values)
+      msg += ' ' + std::to_string(v);
+    if (!line.send(msg) || !line.recv(reply))
+      return false;
+    std::istringstream iss(reply);
+    uint32_t got = 0;
+    iss >> cmd >> got;
+    for (auto &v : values)
+      iss >> v;
+    return cmd == "MAX" && got == id && !iss.fail();
+  }
+
+  bool stats(uint32_t step, uint64_t us, uint64_t values) {
+    return line.send("STATS " + std::to_string(step) + ' ' +
+                     std::to_string(us) + ' ' + std::to_string(values));
+  }
+
+  void done() { line.send("DONE"); }
+
+private:
+  unsigned replySec;
+  Line line;
+};
+
+} // namespace rendezvous
+
+#endif
@@ -93,6 +93,8 @@ parser.add_argument("--profile", metavar="steps", type=int, default=0,
                     help="number of profile steps to perform (default=0)")
 parser.add_argument("-mt", "--multithreading", default=False, action="store_true",
                     help="Use threads instead of processes")
+parser.add_argument("--native", action="store_true",
+                    help="Use the nclagg extension (make pyext) instead of scapy/sockets")
 
 opt = parser.parse_args()
 opt.ip = get_first_ip() if opt.ip is None else opt.ip
@@ -431,7 +433,19 @@ print(worker(), "Values: %d" % opt.size, "(x%d)," % opt.multiplier, "PerPkt: %d,
 print(worker())
 
 
+def native_init(opt):
+    import nclagg
+    nclagg.init(["-R", str(opt.rank), "-W", str(opt.workers), "-I", opt.ip,
+                 "-P", str(opt.port), "-j", str(opt.threads), "-w", str(opt.window),
+                 "-m", str(opt.multiplier), "--device-mac", opt.dev_mac,
+                 "--device-ip", opt.dev_ip, "--device-port", str(opt.dev_port)])
+    return nclagg
+
+
 def AllReduce(opt, data):
+    if opt.native:
+        return NATIVE.allreduce(data) / 1e6
+
     if opt.multithreading:
         threads = [threading.Thread(name="t%d" % tid, target=socket_worker, args=(opt, tid, data,))
                    for tid in range(opt.threads)]
@@ -448,6 +462,8 @@ def AllReduce(opt, data):
 
 
 if __name__ == "__main__":
+    NATIVE = native_init(opt) if opt.native else None
+
     if opt.warmup:
         # DATA = multiprocessing.Array(ctypes.c_uint32, [random.randint(1, 50) for _ in range(
         #     opt.size)] if opt.random else ([opt.rank] * opt.size), lock=False)
@@ -489,3 +505,6 @@ if __name__ == "__main__":
     print(worker())
     print(worker(),
           f"Average aggregation throughput {avg_r:.2f} values/s")
+
+    if NATIVE:
+        NATIVE.finalize()
@@ -7,6 +7,7 @@
 #include <cpuid.h>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <future>
 #include <immintrin.h> // For AVX2
 #include <iomanip>
@@ -28,9 +29,27 @@
 #include <unistd.h> // for close()
 #include <linux/errqueue.h>
 
+#include "autotune.h"
+#include "worker_cc.h"
+#include "worker_datapath.h"
+#include "worker_host.h"
+#include "worker_packet.h"
+#ifdef NCL_DPDK
+#include "worker_dpdk.h"
+#endif
+#include "quantize.h"
+#include "reduce.h"
+#include "worker_progress.h"
+#include "worker_rails.h"
+#include "worker_telemetry.h"
+#include "rendezvous.h"
 #include "worker_utils.h"
 
 static options opt;
+static Rails rails;
+static Quantizer quant;
+static telemetry::Telemetry live;
+static host::Mesh mesh;
 
 namespace ncrt {
 // This stuff is generally handled by the compiler,
@@ -75,6 +94,16 @@ std::ostream &printNclPacket(ncl_h &h, uint32_t *data,
 
 size_t NCL_PACKET_SIZE = sizeof(ncl_h) + (32 * sizeof(uint32_t));
 
+// configure() of allreduce.ncl: the job owning slots [range * RangeSlots,
+// (range + 1) * RangeSlots) has `world` workers
+struct __attribute__((packed)) configure_h {
+  struct ncp_h ncp;
+  uint16_t range;
+  uint32_t world;
+};
+
+constexpr unsigned RangeSlots = 256; // 1 << RANGE_BITS in allreduce.ncl
+
 } // namespace ncrt
 
 inline std::ostream &worker(std::ostream &os = std::cout) {
@@ -113,23 +142,47 @@ void PrintWorkerInfo(std::ostream &O = std::cout) {
             << (opt.ValuesPerPacket * 4) << ")"
             << ", Burst: " << opt.Window << ", rx: " << opt.Rx
             << ", connect: " << opt.Connect << ", " << opt.Bind << '\n';
+  if (quant.enabled()) {
+    worker(O) << "Quant: " << opt.Quant << " | Lanes: " << quant.lanes()
+              << 'x' << quant.bits() << " bits, headroom: "
+              << quant.headroomBits() << " | Range: +-" << quant.range()
+              << " | Scale: 2^" << quant.scaleShift()
+              << " | Values: " << (opt.Size * quant.lanes()) << '\n';
+  }
+  if (rails.size() > 1) {
+    worker(O) << "Rails: " << rails.size();
+    for (auto r = 0; r < rails.size(); ++r)
+      O << (r ? ", " : " | ") << rails[r].Iface << '/' << rails[r].IP;
+    O << '\n';
+  }
 }
 
-void PrintData(uint32_t expo, uint32_t *v, size_t size, size_t n = 8,
+// Integer data[] holds values the way they travel and the device reads
+// them, in network order
+inline uint32_t HostValue(uint32_t v) { return ntohl(v); }
+inline float HostValue(float v) { return v; }
+
+template <typename T>
+void PrintData(uint32_t expo, const T *v, size_t size, size_t n = 8,
                bool printSize = true, std::ostream &O = std::cout) {
   if ((size > 0) && (n > 0))
-    O << *v;
+    O << HostValue(*v);
   for (auto i = 1; i < n; ++i) {
     if (i == size)
       break;
-    O << ',' << v[i];
+    O << ',' << HostValue(v[i]);
   }
   O << "...";
   if (printSize)
-    O << " (" << size << '/' << (size * sizeof(uint32_t)) << "B)";
+    O << " (" << size << '/' << (size * sizeof(T)) << "B)";
   O << " | expo: " << expo << '\n';
 }
 
+// Value of every element of rank `rank`'s vector, for CheckResult(). Above
+// 255 so that byte order mistakes show: they break carries and comparisons.
+inline uint32_t CheckValue(uint32_t rank) { return rank << 8 | 0xFF; }
+
+// `size` values of `value` in network order, random ones if it is 0
 bool GenerateVector(uint32_t **p, size_t size, uint32_t value) {
   if (!size)
     return false;
@@ -144,7 +197,7 @@ bool GenerateVector(uint32_t **p, size_t size, uint32_t value) {
 
     } else {
       for (auto i = 0; i < size; ++i)
-        *(*p + i) = value;
+        *(*p + i) = htonl(value);
     }
   } else {
     for (auto i = 0; i < size; ++i)
@@ -154,6 +207,39 @@ bool GenerateVector(uint32_t **p, size_t size, uint32_t value) {
   return true;
 }
 
+// Compare the result of the first collective of an --op against what the
+// device should compute from every rank's CheckValue()
+void CheckResult(reduce::Op op, const uint32_t *data, size_t n) {
+  if (opt.Perf || opt.Random || quant.enabled())
+    return;
+  uint32_t want = CheckValue(1);
+  for (uint32_t r = 2; r <= opt.World; ++r)
+    want = reduce::Apply(op, want, CheckValue(r));
+  for (size_t i = 0; i < n; ++i)
+    if (ntohl(data[i]) != want) {
+      worker() << "Check: " << reduce::Name(op) << " MISMATCH at " << i
+               << ", got " << ntohl(data[i]) << ", want " << want << '\n';
+      return;
+    }
+  worker() << "Check: " << reduce::Name(op) << " ok, " << want << '\n';
+}
+
+// Gradient `i` of worker `rank` in [-clip, clip], reproducible on every
+// worker so the reduced result can be checked
+inline float GradientValue(unsigned rank, size_t i) {
+  auto h = xorshift32((static_cast<uint32_t>(i * 2654435761u) ^ (rank * 0x9E3779B9u)) | 1);
+  return opt.QuantClip * ((h >> 8) * (2.0f / 16777216.0f) - 1.0f);
+}
+
+bool GenerateGradients(float **p, size_t size) {
+  if (!size)
+    return false;
+  *p = (float *)malloc(size * sizeof(float));
+  for (auto i = 0; i < size; ++i)
+    (*p)[i] = GradientValue(opt.Rank, i);
+  return true;
+}
+
 void getIndexRangeForThread(uint32_t tid, uint32_t &lo, uint32_t &hi) {
   lo = tid * opt.ValuesPerThread;
   hi = std::min(lo + opt.ValuesPerThread, opt.Size);
@@ -295,9 +381,11 @@ void Worker2(uint16_t tid, int soc, ncrt::ncl_h *wnd, uint8_t *startingVersion,
 
 
 
-void Worker(uint16_t tid, int soc, ncrt::ncl_h *wnd, uint8_t *startingVersion,
-            uint32_t *expo, uint32_t *data, size_t size,
-            std::shared_future<void> sigstart) {
+void Worker(uint16_t tid, int *socs, Datapath *datapath, ncrt::ncl_h *wnd,
+            uint8_t *versions, reduce::Op op,
+            uint32_t *expo, uint32_t *data, size_t size, unsigned count,
+            const float *grads, float *reduced, Progress *progress,
+            FlowStats *stats, std::shared_future<void> sigstart) {
   sigstart.wait();
 
   sockaddr_in device;
@@ -308,138 +396,557 @@ void Worker(uint16_t tid, int soc, ncrt::ncl_h *wnd, uint8_t *startingVersion,
   if (opt.Pin)
       pin_thread_to_core(tid % 16);
 
+  // Start on this thread's rail, or the next one that is up
+  auto railIdx = rails.next(tid % rails.size());
+  if (railIdx == rails.size()) {
+    thread(tid) << "error: no rail is up\n";
+    progress->fail();
+    return;
+  }
+  auto *rail = &rails[railIdx];
+
   uint32_t start, end;
   getIndexRangeForThread(tid, start, end);
 
   uint32_t mask = 1 << (opt.Rank - 1);
   uint16_t baseSlot = tid * opt.Window;
-  uint8_t version = *startingVersion;
-  uint8_t startingAggIdxOffset = version * opt.Slots;
 
-  auto *ncl = static_cast<ncrt::ncl_h *>(malloc(opt.Window * sizeof(ncrt::ncl_h)));
-  auto *iov = static_cast<iovec *>(malloc(2 * opt.Window * sizeof(iovec)));
-  auto *msg = static_cast<mmsghdr *>(malloc(opt.Window * sizeof(mmsghdr)));
+  // wnd[i] is the header of slot baseSlot + i. Results come back in any
+  // slot order so the datapath receives them into a staging area and they
+  // are copied to data[offset] of the slot they belong to.
+  auto *ncl = wnd;
   memset(ncl, 0, sizeof(ncrt::ncl_h) * opt.Window);
-  memset(iov, 0, 2 * opt.Window * sizeof(iovec));
-  memset(msg, 0, opt.Window * sizeof(mmsghdr));
 
   uint32_t offset = start;
   auto dataLen = opt.ValuesPerPacket * sizeof(uint32_t);
 
-  for (auto i = 0, v = 0; i < opt.Window; ++i, v += 2) {
+  // Datapaths that keep state across collectives come from the session,
+  // the others live as long as this call
+  Datapath *dp = datapath;
+  SocketDatapath *sock = nullptr;
+  std::unique_ptr<Datapath> owned;
+#ifdef NCL_DPDK
+  if (opt.Datapath == "dpdk") {
+    uint8_t deviceMac[6];
+    parseMac(opt.DeviceMac, deviceMac);
+    auto frame = MakeUdpFrame(dpdk::Mac, deviceMac, inet_addr(rail->IP.c_str()),
+                              device.sin_addr.s_addr, htons(opt.Port + tid),
+                              device.sin_port, sizeof(ncrt::ncl_h) + dataLen);
+    owned.reset(new DpdkDatapath(tid, frame, opt.Port,
+                                 reinterpret_cast<uint8_t *>(ncl),
+                                 sizeof(ncrt::ncl_h), dataLen, opt.Window));
+  }
+#endif
+  if (!dp && !owned) {
+    sock = new SocketDatapath(socs[railIdx], device,
+                              reinterpret_cast<uint8_t *>(ncl),
+                              sizeof(ncrt::ncl_h), dataLen, opt.Window);
+    owned.reset(sock);
+  }
+  if (!dp)
+    dp = owned.get();
+
+  // With --quant, data[] is the wire image of grads[]. A chunk is
+  // quantized when it is assigned to a slot and decoded into reduced[] as
+  // soon as its result lands.
+  auto lanes = quant.lanes();
+  uint32_t seed = xorshift32((static_cast<uint32_t>(nowNs()) ^ (opt.Rank << 16) ^ tid) | 1);
+  auto load = [&](uint32_t offset, unsigned coarser = 0) {
+    if (grads)
+      quant.quantize(&grads[offset * lanes], &data[offset],
+                     opt.ValuesPerPacket, seed, coarser);
+  };
+
+  for (auto i = 0; i < opt.Window; ++i) {
+    load(offset);
     ncl[i].ncp.h_src = opt.Rank;
     ncl[i].ncp.d_dst = 1;
     ncl[i].ncp.cid = 1;
 
-    ncl[i].agg.ver = version;
+    ncl[i].agg.ver = reduce::Ver(versions[i], op);
     ncl[i].agg.bmp_idx = htons(baseSlot + i);
-    ncl[i].agg.agg_idx = htons(baseSlot + i + startingAggIdxOffset);
+    ncl[i].agg.agg_idx = htons(baseSlot + i + versions[i] * opt.Slots);
     ncl[i].agg.mask = htonl(mask);
     ncl[i].agg.offset = htonl(offset);
     ncl[i].agg.expo = htonl(*expo);
 
-    iov[v].iov_base = &ncl[i];
-    iov[v].iov_len = sizeof(ncrt::ncl_h);
-    iov[v + 1].iov_base = &data[offset];
-    iov[v + 1].iov_len = dataLen;
-
-    msg[i].msg_hdr.msg_name = &device;
-    msg[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
-    msg[i].msg_hdr.msg_iov = &iov[v];
-    msg[i].msg_hdr.msg_iovlen = 2;
-    msg[i].msg_hdr.msg_control = nullptr;
-    msg[i].msg_hdr.msg_controllen = 0;
-    msg[i].msg_hdr.msg_flags = 0;
-    msg[i].msg_len = 0;
+    dp->payload(i, &data[offset]);
 
     offset += opt.ValuesPerPacket;
   }
 
-  // Send data using MSG_ZEROCOPY
-  int ret = sendmmsg(soc, msg, opt.Window, 0);
-  if (ret == -1) {
-    perror("sendmmsg failed");
-  }
+  TokenBucket bucket(opt.Pacing == "bucket" ? opt.PacingRateBytes() : 0,
+                     opt.PacingBurstBytes(sizeof(ncrt::ncl_h) +
+                                          opt.ValuesPerPacket *
+                                              sizeof(uint32_t)));
+  CongestionWindow cc(CongestionWindow::parse(opt.CC), opt.Window,
+                      opt.RttTarget * 1000ULL);
+  auto *sentAt = static_cast<uint64_t *>(malloc(opt.Window * sizeof(uint64_t)));
+  auto pktLen = sizeof(ncrt::ncl_h) + dataLen;
+
+  // Slots holding a chunk that has not been sent yet. Every slot starts
+  // with one; how many leave at once is up to the window and the pacer.
+  std::deque<uint16_t> ready;
+  std::vector<bool> flying(opt.Window, false);
+  for (uint16_t i = 0; i < opt.Window; ++i)
+    ready.push_back(i);
+  unsigned inflight = 0;
+
+  auto &tel = live.thread(tid);
+  auto syscalls = dp->syscalls;
+  auto publish = [&]() {
+    tel.c.syscalls += dp->syscalls - syscalls;
+    syscalls = dp->syscalls;
+    tel.c.inflight = inflight;
+    tel.publish();
+  };
+  unsigned unpublished = 0; // results since the last publish()
+
+  // Move to the next rail that is up and queue everything that was in
+  // flight on the failed one again. The device treats a chunk it has
+  // already seen from us as a retransmission, so resending is safe: a
+  // completed slot reflects its result, one still waiting for others
+  // answers with the multicast once the last worker arrives.
+  auto failover = [&]() {
+    if (!sock)
+      return false; // only sockets know about rails
+    rail->Up = false;
+    ++rail->Failovers;
+    railIdx = rails.next(railIdx + 1);
+    if (railIdx == rails.size())
+      return false;
+    thread(tid) << "rail " << rail->Iface << '/' << rail->IP
+                << " failed, moving to " << rails[railIdx].Iface << '/'
+                << rails[railIdx].IP << '\n';
+    rail = &rails[railIdx];
+    sock->socket(socs[railIdx]);
+    for (uint16_t i = opt.Window; i-- > 0;)
+      if (flying[i]) {
+        flying[i] = false;
+        ready.push_front(i);
+        ++tel.c.retransmits;
+      }
+    inflight = 0;
+    return true;
+  };
+
+  unsigned rxBurst = opt.Rx ? std::min(opt.Rx, opt.Window) : opt.Window;
+
+  // Results can also land on a rail this thread is not sending on: the
+  // device multicasts a completed slot to every rank whatever rail it last
+  // used, and a chunk queued again after failover races the original. Take
+  // them from there too; the checks below drop the duplicates.
+  auto elsewhere = [&]() {
+    int n = 0;
+    for (size_t r = 0; r < rails.size() && n <= 0; ++r)
+      if (r != railIdx) {
+        sock->socket(socs[r]);
+        n = dp->recv(false, rxBurst);
+      }
+    sock->socket(socs[railIdx]);
+    return n;
+  };
+
+  // Send whatever the window and the pacer allow. Returns false once there
+  // is no rail left to send on.
+  std::vector<uint16_t> pending(opt.Window);
+  auto flush = [&](bool batch) {
+    while (true) {
+      unsigned n = 0, sent = 0;
+      int err = 0;
+      auto now = nowNs();
+      while (!ready.empty() && inflight < cc.window() &&
+             bucket.consume(pktLen)) {
+        auto slot = ready.front();
+        ready.pop_front();
+        sentAt[slot] = now;
+        flying[slot] = true;
+        ++inflight;
+        pending[n++] = slot;
+      }
+      if (n)
+        sent = dp->send(pending.data(), n, batch, err);
+      rail->TxPackets += sent;
+      rail->TxBytes += sent * pktLen;
+      tel.c.txPackets += sent;
+      tel.c.txBytes += sent * pktLen;
+
+      // Whatever did not leave goes out again with the next flush
+      for (auto i = n; i-- > sent;) {
+        flying[pending[i]] = false;
+        --inflight;
+        ready.push_front(pending[i]);
+      }
+
+      if (!err)
+        return true;
+      if (!Rails::fatal(err)) {
+        errno = err;
+        perror(batch ? "sendmmsg failed" : "sendmsg2 failed");
+        return true;
+      }
+      if (!failover())
+        return false;
+    }
+  };
+
+  bool ok = flush(true);
 
   size_t totalReceived = 0;
+  uint64_t saturated = 0, resent = 0;
   uint32_t offsetBy = opt.Window * opt.ValuesPerPacket;
 
-  while (true) {
-      // std::cout << "recvmmsg " << totalReceived << "...\n";
-      int received = recvmmsg(soc, msg, opt.Window, 0, nullptr);
-      if (received == 0)
+#ifdef RX_BURST
+  const bool batchRefill = true;
+#else
+  const bool batchRefill = false;
+#endif
+
+  // data[] holds `count` collectives of `size` values each. A slot goes
+  // through its chunks of collective k and then straight on to the same
+  // chunks of collective k + 1, without waiting for the other slots.
+  size_t totalExpected = static_cast<size_t>(opt.PacketsPerThread) * count;
+
+  while (ok && totalReceived < totalExpected) {
+    // Only poll if there is something to send once tokens are available,
+    // otherwise block for the first result
+    bool paced = !ready.empty() && inflight < cc.window();
+    int received = dp->recv(!paced, rxBurst);
+    if (received <= 0 && sock && rails.size() > 1) {
+      // Not lost if it came back on another rail
+      int err = errno;
+      if (auto n = elsewhere(); n > 0)
+        received = n;
+      else
+        errno = err;
+    }
+    if (received <= 0) {
+      ++tel.c.emptyPolls;
+      tel.tick();
+      if (received < 0 && errno == EAGAIN && !paced && inflight) {
+        // Nothing came back within --rail-timeout on this rail
+        ok = failover() && flush(true);
+      } else {
+        if (received < 0 && errno != EINTR && errno != EAGAIN)
+          perror("recv failed");
+        // Out of tokens: sleep until the next packet may leave rather
+        // than poll for it
+        if (paced) {
+          if (auto ns = bucket.delay(pktLen))
+            std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+          ok = flush(batchRefill);
+        }
+      }
+      continue;
+    }
+    rail->RxPackets += received;
+    rail->RxBytes += received * pktLen;
+    tel.c.rxPackets += received;
+    tel.c.rxBytes += received * pktLen;
+    tel.batch(received);
+
+    auto now = nowNs();
+    for (auto i = 0; i < received; ++i) {
+      auto *rh = (const ncrt::ncl_h *)dp->packet(i);
+      auto slot = static_cast<uint16_t>(ntohs(rh->agg.bmp_idx) - baseSlot);
+      if (slot >= opt.Window || !flying[slot] ||
+          rh->agg.offset != ncl[slot].agg.offset ||
+          reduce::Version(rh->agg.ver) != reduce::Version(ncl[slot].agg.ver))
+        continue; // not in flight, e.g. a reflected duplicate
+
+      flying[slot] = false;
+      --inflight;
+      cc.onResult(now - sentAt[slot], now);
+
+      auto *ih = &ncl[slot];
+      auto next = [&](uint32_t offset, uint32_t e) {
+        uint8_t version = 1 - reduce::Version(ih->agg.ver);
+        ih->agg.ver = reduce::Ver(version, op);
+        ih->agg.agg_idx = htons(version ? ntohs(ih->agg.agg_idx) + opt.Slots
+                                        : ntohs(ih->agg.agg_idx) - opt.Slots);
+        ih->agg.offset = htonl(offset);
+        ih->agg.expo = htonl(e);
+      };
+
+      offset = ntohl(rh->agg.offset);
+      if (rh->agg.ver & reduce::Overflowed) {
+        ++saturated;
+        // Every worker got the same flag: all of them send the chunk again
+        // on the slot's other version, coarse enough not to saturate
+        if (grads && ih->agg.expo == htonl(*expo)) {
+          ++resent;
+          next(offset, *expo - quant.retryBits());
+          load(offset, quant.retryBits());
+          dp->payload(slot, &data[offset]);
+          ready.push_back(slot);
           continue;
+        }
+      }
 
-      totalReceived += received;
-      if (totalReceived >= opt.PacketsPerThread) {
-          *startingVersion = 1 - version;
-          break;
+      // Result lands in place, then the chunk is visible to consumers
+      memcpy(&data[offset], rh + 1, dataLen);
+      if (reduced)
+        quant.dequantize(&data[offset], &reduced[offset * lanes],
+                         opt.ValuesPerPacket, ntohl(rh->agg.expo));
+      progress->complete(offset / opt.ValuesPerPacket);
+      ++totalReceived;
+
+      // Refill the slot with the next chunk of this thread, if any
+      auto k = offset / size;
+      offset += offsetBy;
+      if (offset >= k * size + end) {
+        offset += size - (end - start);
+        if (offset >= count * size)
+          continue;
       }
 
-      for (auto i = 0; i < received; ++i) {
-          auto *ih = (ncrt::ncl_h *)iov[i * 2].iov_base;
+      next(offset, *expo);
+      load(offset);
+      dp->payload(slot, &data[offset]);
+      ready.push_back(slot);
+    }
 
-          ih->ncp.h_src = opt.Rank;
-          ih->ncp.h_dst = 0;
-          ih->ncp.d_src = 0;
-          ih->ncp.d_dst = 1;
+    ok = flush(batchRefill);
+    // Once per window of refills, the loop itself stays off the segment
+    if ((unpublished += received) >= opt.Window) {
+      unpublished = 0;
+      publish();
+    }
+  }
 
-          version = 1 - ih->agg.ver;
-          offset = ntohl(ih->agg.offset) + offsetBy;
+  if (!ok) {
+    thread(tid) << "error: no rail left, giving up\n";
+    progress->fail();
+  }
 
-          ih->agg.ver = version;
-          ih->agg.agg_idx = htons(version ? ntohs(ih->agg.agg_idx) + opt.Slots
-                                          : ntohs(ih->agg.agg_idx) - opt.Slots);
-          ih->agg.mask = htonl(mask);
-          ih->agg.offset = htonl(offset);
-          ih->agg.expo = htonl(*expo);
+  if (stats) {
+    stats->rttNs = cc.rtt();
+    stats->window = cc.window();
+    stats->decreases = cc.decreased();
+    stats->saturated = saturated;
+    stats->resent = resent;
+  }
 
-          iov[i * 2 + 1].iov_base = &data[offset];
+  inflight = 0;
+  publish();
 
-#ifndef RX_BURST
-      if (sendmsg(soc, &msg[i].msg_hdr, 0) == -1)
-        perror("sendmsg2 failed");
-#endif
+  // Whatever is still queued on any rail is a duplicate of a result we
+  // have; leave nothing behind for the next step to mistake for its own
+  if (sock)
+    for (size_t r = 0; r < rails.size(); ++r) {
+      sock->socket(socs[r]);
+      while (dp->recv(false, rxBurst) > 0)
+        ;
     }
-#ifdef RX_BURST
-    if (sendmmsg(soc, msg, received, 0) == -1)
-      perror("sendmmsg3 failed");
-#endif
+
+  // Every slot carried the same number of chunks so they all end on the
+  // same version, unless --op sadd sent some again; each slot starts the
+  // next step on the version it did not use last
+  for (auto i = 0; i < opt.Window; ++i)
+    versions[i] = 1 - reduce::Version(ncl[i].agg.ver);
+
+  free(sentAt);
+}
+
+// Consume reduced chunks as they complete, while the collective is still
+// running. Stands in for an optimizer/next layer; returns the number of
+// chunks that were consumed before the last one arrived.
+size_t ConsumeEarly(Progress &progress, uint32_t *data, uint64_t &checksum) {
+  std::vector<uint64_t> seen(progress.words(), 0);
+  size_t early = 0;
+  auto consume = [&](size_t c) {
+    auto *v = &data[c * opt.ValuesPerPacket];
+    for (auto i = 0; i < opt.ValuesPerPacket; ++i)
+      checksum += ntohl(v[i]);
+  };
+
+  while (!progress.done() && !progress.failed()) {
+    auto n = progress.drain(seen, consume);
+    if (!n)
+      std::this_thread::yield();
+    early += n;
   }
+
+  progress.drain(seen, consume);
+  return early;
+}
+
+// The same collectives on a host backend, one after the other over the TCP
+// mesh. Chunks complete a whole collective at a time.
+bool HostAllReduce(reduce::Op op, const uint32_t *expo, uint32_t *data,
+                   size_t size, unsigned count, const float *grads,
+                   float *reduced, Progress &progress, FlowStats &stats) {
+  // The device keeps the largest exponent
+  uint32_t e = *expo;
+  if (!mesh.max(e))
+    return false;
+
+  auto lanes = quant.lanes();
+  uint32_t seed = xorshift32((static_cast<uint32_t>(nowNs()) ^ (opt.Rank << 16)) | 1);
+  auto chunks = size / opt.ValuesPerPacket;
+  for (unsigned k = 0; k < count; ++k) {
+    auto *v = &data[k * size];
+    auto run = [&](unsigned coarser) {
+      if (grads)
+        quant.quantize(&grads[k * size * lanes], v, size, seed, coarser);
+      return opt.Backend == "ring" ? mesh.ring(v, size, op)
+                                   : mesh.doubling(v, size, op);
+    };
+    if (!run(0))
+      return false;
+
+    // Like the device, but a whole collective at a time: if any rank
+    // saturated, all of them run it again at a coarser scale
+    uint32_t ke = e, saturated = mesh.saturated();
+    if (op == reduce::SatAdd && !mesh.max(saturated))
+      return false;
+    if (saturated) {
+      stats.saturated += chunks;
+      if (grads) {
+        stats.resent += chunks;
+        ke = e - quant.retryBits();
+        if (!run(quant.retryBits()))
+          return false;
+      }
+    }
+    if (reduced)
+      quant.dequantize(v, &reduced[k * size * lanes], size, ke);
+    for (size_t c = k * chunks; c < (k + 1) * chunks; ++c)
+      progress.complete(c);
+  }
+  return true;
 }
 
-uint64_t AllReduce(uint32_t s, int *sockets, ncrt::ncl_h *windows, uint8_t *versions,
-                   uint32_t *expo, uint32_t *data, size_t size) {
+// Run `count` collectives of `size` values each, data[k * size] being the
+// k-th, back to back, reducing with `op`.
+uint64_t AllReduce(uint32_t s, int *sockets, Datapath **datapaths,
+                   ncrt::ncl_h *windows, uint8_t *versions, reduce::Op op,
+                   uint32_t *expo, uint32_t *data, size_t size, unsigned count,
+                   const float *grads, float *reduced, Progress &progress) {
   if (!opt.Perf) {
     worker() << '\n';
-    worker() << "AllReduce #" << s << " | ";
-    PrintData(*expo, data, size, 16);
+    worker() << "AllReduce #" << s << " (" << reduce::Name(op) << ") | ";
+    if (grads)
+      PrintData(*expo, grads, size * quant.lanes(), 16);
+    else
+      PrintData(*expo, data, size, 16);
     worker() << '\n';
   }
 
+  progress.reset(size / opt.ValuesPerPacket * count);
+  rails.refresh();
+  live.reserve(opt.Threads);
+  live.step(s);
+  std::vector<FlowStats> flows(opt.Threads);
+
   // Create worker threads
   std::vector<std::thread> threads;
   std::promise<void> start;
   auto sigstart = start.get_future().share();
-  for (auto tid = 0; tid < opt.Threads; ++tid)
-    threads.emplace_back(Worker, tid, sockets[tid], &windows[tid * opt.Window],
-                         &versions[tid], expo, data, size, sigstart);
+  if (opt.hostBackend())
+    threads.emplace_back([&, sigstart] {
+      sigstart.wait();
+      if (!HostAllReduce(op, expo, data, size, count, grads, reduced,
+                         progress, flows[0])) {
+        worker() << "error: " << opt.Backend << " allreduce failed\n";
+        progress.fail();
+      }
+    });
+  else
+    for (auto tid = 0; tid < opt.Threads; ++tid)
+      threads.emplace_back(Worker, tid, &sockets[tid * rails.size()],
+                           datapaths ? datapaths[tid] : nullptr,
+                           &windows[tid * opt.Window],
+                           &versions[tid * opt.Window], op, expo, data, size, count, grads,
+                           reduced, &progress, &flows[tid], sigstart);
 
   // Start the threads
-  // Normally we would reuse threads so lets not time thread creation
-  start.set_value();
+  // Normally we would reuse threads so lets not time thread creation.
+  // Read the clock first: a released thread may run to completion before
+  // this one is scheduled again.
   auto tStart = std::chrono::high_resolution_clock::now();
+  start.set_value();
+
+  uint64_t checksum = 0;
+  size_t early = opt.Consume ? ConsumeEarly(progress, data, checksum) : 0;
+
   for (auto &t : threads)
     if (t.joinable())
       t.join();
   auto tEnd = std::chrono::high_resolution_clock::now();
 
+  if (!opt.Perf) {
+    worker() << "Chunks: " << progress.count() << ", first: "
+             << progress.firstUs() << "us, last: " << progress.lastUs()
+             << "us, spread: " << (progress.lastUs() - progress.firstUs())
+             << "us";
+    if (opt.Consume)
+      std::cout << ", consumed early: " << early << " (checksum: " << checksum
+                << ")";
+    std::cout << '\n';
+
+    if (opt.CC != "none" && !opt.hostBackend()) {
+      uint64_t rtt = 0, decreases = 0;
+      unsigned lo = opt.Window, hi = 0;
+      for (auto &f : flows) {
+        rtt += f.rttNs;
+        decreases += f.decreases;
+        lo = std::min(lo, f.window);
+        hi = std::max(hi, f.window);
+      }
+      worker() << "Flow: cc: " << opt.CC << ", srtt: "
+               << (rtt / flows.size() / 1000) << "us, window: " << lo << '-'
+               << hi << '/' << opt.Window << ", decreases: " << decreases
+               << '\n';
+    }
+
+    uint64_t saturated = 0, resent = 0;
+    for (auto &f : flows) {
+      saturated += f.saturated;
+      resent += f.resent;
+    }
+    if (saturated)
+      worker() << "Overflow: " << saturated << " chunks saturated, " << resent
+               << " sent again " << quant.retryBits() << " bits coarser\n";
+
+    if (reduced && !progress.failed()) {
+      // Compare against the exact float sum of every worker's gradients,
+      // chunks that were sent again have a coarser step
+      float err = 0, bound = quant.maxError(quant.expo() -
+                                            (resent ? quant.retryBits() : 0));
+      size_t n = size * count * quant.lanes();
+      for (size_t i = 0; i < n; ++i) {
+        float exact = 0;
+        for (unsigned r = 1; r <= opt.World; ++r)
+          exact += GradientValue(r, i);
+        err = std::max(err, std::abs(reduced[i] - exact));
+      }
+      worker() << "Result: " << std::defaultfloat;
+      PrintData(*expo, reduced, n, 8, false);
+      worker() << "Quant: " << opt.Quant << ", max error: " << err
+               << " (bound: " << bound << ")" << (err > bound ? " EXCEEDED" : "")
+               << '\n';
+    }
+
+    if (rails.size() > 1 && !opt.hostBackend())
+      for (auto r = 0; r < rails.size(); ++r)
+        worker() << "Rail " << rails[r].Iface << '/' << rails[r].IP << ": "
+                 << (rails[r].Up ? "up" : "down")
+                 << " | tx: " << rails[r].TxPackets << " pkts "
+                 << rails[r].TxBytes << "B | rx: " << rails[r].RxPackets
+                 << " pkts " << rails[r].RxBytes
+                 << "B | failovers: " << rails[r].Failovers << '\n';
+  }
+
+  if (progress.failed())
+    return 0;
+
   // return 1024;
   return std::chrono::duration_cast<std::chrono::microseconds>(tEnd - tStart)
       .count();
 }
 
-int create_socket_for_worker(uint16_t tid, sockaddr_in &worker_addr,
+int create_socket_for_worker(uint16_t tid, Rail &rail, sockaddr_in &worker_addr,
                              sockaddr_in &device_addr) {
   auto soc = socket(AF_INET, SOCK_DGRAM, 0);
   if (soc < 0) {
@@ -448,18 +955,25 @@ int create_socket_for_worker(uint16_t tid, sockaddr_in &worker_addr,
   }
 
   worker_addr.sin_family = AF_INET;
-  worker_addr.sin_addr.s_addr = inet_addr(opt.IP.c_str());
+  worker_addr.sin_addr.s_addr = inet_addr(rail.IP.c_str());
   worker_addr.sin_port = htons(opt.Port + tid);
   device_addr.sin_family = AF_INET;
   device_addr.sin_addr.s_addr = inet_addr(opt.DeviceIp.c_str());
   device_addr.sin_port = htons(opt.DevicePort);
 
-  if (opt.Bind) {
-    const char *iface = "ens4f0"; // Replace with your network interface name
+  if (opt.Bind || rails.size() > 1) {
     struct ifreq ifr;
     memset(&ifr, 0, sizeof(ifr));
-    strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
-    setsockopt(soc, SOL_SOCKET, SO_BINDTODEVICE, (void *)&ifr, sizeof(ifr));
+    strncpy(ifr.ifr_name, rail.Iface.c_str(), IFNAMSIZ - 1);
+    if (setsockopt(soc, SOL_SOCKET, SO_BINDTODEVICE, (void *)&ifr, sizeof(ifr)) < 0)
+      perror("setsockopt SO_BINDTODEVICE failed");
+  }
+
+  if (rails.size() > 1) {
+    // A rail that stays silent this long while chunks are in flight is
+    // considered failed
+    timeval tv = {opt.RailTimeout / 1000, (opt.RailTimeout % 1000) * 1000};
+    setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
   }
 
 
@@ -475,8 +989,14 @@ int create_socket_for_worker(uint16_t tid, sockaddr_in &worker_addr,
   if (setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &rcvbuf_size, sizeof(rcvbuf_size)) < 0) {
       perror("setsockopt SO_SNDBUF failed");
   }
+  if (opt.Pacing == "fq" && opt.PacingRate) {
+    // Enforced by the fq qdisc, see tc-fq(8)
+    uint64_t rate = opt.PacingRateBytes(); // u64 since Linux 4.20
+    if (setsockopt(soc, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0)
+      perror("setsockopt SO_MAX_PACING_RATE failed");
+  }
   if (bind(soc, (sockaddr *)&worker_addr, sizeof(sockaddr)) < 0) {
-    worker() << "error: failed to bind socket to " << opt.IP << "."
+    worker() << "error: failed to bind socket to " << rail.IP << "."
              << ntohs(worker_addr.sin_port) << '\n';
     return 0;
   }
@@ -493,101 +1013,660 @@ int create_socket_for_worker(uint16_t tid, sockaddr_in &worker_addr,
   return soc;
 }
 
+// Sockets, slot headers and slot versions shared by consecutive
+// collectives of one worker, or the TCP mesh of the host backends
+struct Session {
+  std::vector<int> soc;
+  ncrt::ncl_h *windows = nullptr;
+  uint8_t *versions = nullptr;
+  Progress progress;
+  std::vector<Datapath *> datapaths; // per thread, --datapath packet
+  bool dpdkUp = false;
+
+  // Create sockets, one per thread per rail, or bring up the DPDK port.
+  // False if any failed.
+  bool open() {
+    versions = (uint8_t *)std::malloc(opt.Slots);
+    memset(versions, 0, opt.Slots);
+
+    // Create packet buffers, at least 2
+    windows = (ncrt::ncl_h *)std::malloc(
+        sizeof(ncrt::ncl_h) * std::max<int>(2, opt.Window * opt.Threads));
+
+    if (opt.Telemetry &&
+        !live.open(opt.Port, opt.Rank, opt.World, opt.Threads, opt.Window,
+                   opt.Datapath))
+      worker() << "warning: cannot create "
+               << telemetry::Name(opt.Port, getpid()) << ", no telemetry\n";
+
+    if (opt.hostBackend() || opt.Compare) {
+      std::vector<host::Peer> peers;
+      host::ParsePeers(opt.Peers, peers);
+      mesh.simd = opt.SIMD;
+      if (!mesh.open(opt.Rank, peers, 30000)) {
+        worker() << "error: cannot connect to the other workers\n";
+        return false;
+      }
+      // The host backends need nothing else
+      if (!opt.Compare)
+        return true;
+    }
+
+    if (opt.Datapath == "dpdk") {
+#ifdef NCL_DPDK
+      if (!(dpdkUp = dpdk::Init(opt.Dpdk, opt.Threads, opt.Window)))
+        return false;
+      auto *m = dpdk::Mac;
+      char mac[18];
+      snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x", m[0], m[1],
+               m[2], m[3], m[4], m[5]);
+      worker() << "DPDK: port " << dpdk::Port << " (" << mac << "), "
+               << opt.Threads << " queues, "
+               << (dpdk::MultiSeg ? "zero-copy" : "copying") << " tx\n";
+      return true;
+#else
+      worker() << "error: built without DPDK, use make worker3 DPDK=1\n";
+      return false;
+#endif
+    }
+
+    // --datapath packet sends and receives around these, but they keep the
+    // ports taken and the kernel from answering results with ICMP errors
+    bool ok = true;
+    soc.resize(opt.Threads * rails.size());
+    for (auto i = 0; i < opt.Threads; ++i)
+      for (auto r = 0; r < rails.size(); ++r) {
+        sockaddr_in worker_addr{}, device_addr{};
+        auto s = i * rails.size() + r;
+        soc[s] = create_socket_for_worker(i, rails[r], worker_addr, device_addr);
+        ok = ok && soc[s] > 1;
+      }
+    return ok && (opt.Datapath != "packet" || openPacketRings());
+  }
+
+  void close() {
+    for (auto s : soc)
+      if (s > 1)
+        ::close(s);
+    soc.clear();
+    for (auto *dp : datapaths)
+      delete dp;
+    datapaths.clear();
+    mesh.close();
+    live.close();
+#ifdef NCL_DPDK
+    if (dpdkUp)
+      dpdk::Close();
+#endif
+    dpdkUp = false;
+    free(versions);
+    free(windows);
+    versions = nullptr;
+    windows = nullptr;
+  }
+
+  // One raw socket and ring pair per thread, set up once: the rings are
+  // too expensive to map for every collective
+  bool openPacketRings() {
+    auto &rail = rails[0];
+    uint8_t srcMac[6], deviceMac[6];
+    parseMac(opt.DeviceMac, deviceMac);
+    if (!PacketDatapath::ifaceMac(rail.Iface, srcMac)) {
+      worker() << "error: no hardware address for " << rail.Iface << '\n';
+      return false;
+    }
+    auto payloadLen = opt.ValuesPerPacket * sizeof(uint32_t);
+    for (auto i = 0; i < opt.Threads; ++i) {
+      auto frame = MakeUdpFrame(
+          srcMac, deviceMac, inet_addr(rail.IP.c_str()),
+          inet_addr(opt.DeviceIp.c_str()), htons(opt.Port + i),
+          htons(opt.DevicePort), sizeof(ncrt::ncl_h) + payloadLen);
+      auto *dp = new PacketDatapath(
+          rail.Iface, frame, reinterpret_cast<uint8_t *>(&windows[i * opt.Window]),
+          sizeof(ncrt::ncl_h), payloadLen, opt.Window);
+      datapaths.push_back(dp);
+      if (!dp->ok())
+        return false;
+    }
+    return true;
+  }
+
+  uint64_t allReduce(uint32_t s, uint32_t *expo, uint32_t *data,
+                     unsigned count, const float *grads = nullptr,
+                     float *reduced = nullptr, reduce::Op op = reduce::Add) {
+    return AllReduce(s, soc.data(), datapaths.empty() ? nullptr : datapaths.data(),
+                     windows, versions, op, expo, data, opt.Size,
+                     count, grads, reduced, progress);
+  }
+};
+
+// Set the worker count of every range of slots below `slots` on the device
+// and wait for all of them to be acknowledged. Every worker of the job
+// does this before it sends anything, with the same values, so it does
+// not matter who is first. False if the device did not answer within
+// --probe-timeout.
+bool ConfigureWorld(unsigned slots) {
+  sockaddr_in worker_addr{}, device_addr{};
+  int soc = create_socket_for_worker(0, rails[0], worker_addr, device_addr);
+  if (soc <= 1)
+    return false;
+  timeval tv = {0, 50000};
+  setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  unsigned ranges = (slots + ncrt::RangeSlots - 1) / ncrt::RangeSlots;
+  std::vector<bool> acked(ranges, false);
+  unsigned left = ranges;
+  ncrt::configure_h c{};
+  c.ncp.h_src = opt.Rank;
+  c.ncp.d_dst = 1;
+  c.ncp.cid = 2;
+  c.world = htonl(opt.World);
+
+  auto deadline = nowNs() + opt.ProbeTimeout * 1000000ULL;
+  uint64_t sent = 0;
+  while (left && nowNs() < deadline) {
+    if (nowNs() - sent > 100000000ULL) {
+      for (uint16_t r = 0; r < ranges; ++r)
+        if (!acked[r]) {
+          c.range = htons(r);
+          sendto(soc, &c, sizeof(c), 0, (sockaddr *)&device_addr,
+                 sizeof(device_addr));
+        }
+      sent = nowNs();
+    }
+    ncrt::configure_h ack;
+    auto n = recv(soc, &ack, sizeof(ack), 0);
+    if (n != sizeof(ack) || ack.ncp.cid != 2 || ack.world != c.world)
+      continue;
+    auto r = ntohs(ack.range);
+    if (r < ranges && !acked[r]) {
+      acked[r] = true;
+      --left;
+    }
+  }
+  close(soc);
+  return !left;
+}
+
+// Send one chunk of ones through slot 0 of the device and wait for the
+// sum, the world size. Done twice, once per version, so the slot is back
+// where a fresh session expects it. Returns the round trip of the first
+// exchange in us, 0 if the device did not answer within --probe-timeout.
+uint64_t ProbeSwitch() {
+  sockaddr_in worker_addr{}, device_addr{};
+  int soc = create_socket_for_worker(0, rails[0], worker_addr, device_addr);
+  if (soc <= 1)
+    return 0;
+  timeval tv = {0, 50000};
+  setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  std::vector<uint8_t> out(ncrt::NCL_PACKET_SIZE), in(ncrt::NCL_PACKET_SIZE);
+  auto *h = reinterpret_cast<ncrt::ncl_h *>(out.data());
+  auto *values = reinterpret_cast<uint32_t *>(h + 1);
+  h->ncp.h_src = opt.Rank;
+  h->ncp.d_dst = 1;
+  h->ncp.cid = 1;
+  h->agg.mask = htonl(1 << (opt.Rank - 1));
+  for (auto i = 0; i < opt.ValuesPerPacket; ++i)
+    values[i] = htonl(1);
+
+  auto deadline = nowNs() + opt.ProbeTimeout * 1000000ULL;
+  uint64_t rtt = 0;
+  for (uint8_t ver = 0; ver < 2; ++ver) {
+    h->agg.ver = ver;
+    h->agg.agg_idx = htons(ver * opt.Slots);
+    // Early retransmissions may come back with a partial sum, wait for
+    // the complete one
+    bool done = false;
+    uint64_t sent = 0, first = nowNs();
+    while (!done && nowNs() < deadline) {
+      if (nowNs() - sent > 250000000ULL) {
+        sendto(soc, out.data(), out.size(), 0, (sockaddr *)&device_addr,
+               sizeof(device_addr));
+        sent = nowNs();
+      }
+      auto n = recv(soc, in.data(), in.size(), 0);
+      auto *rh = reinterpret_cast<const ncrt::ncl_h *>(in.data());
+      done = n == (ssize_t)in.size() && rh->agg.ver == ver &&
+             rh->agg.bmp_idx == 0 &&
+             ntohl(reinterpret_cast<const uint32_t *>(rh + 1)[0]) == opt.World;
+    }
+    if (!done) {
+      rtt = 0;
+      break;
+    }
+    if (!ver)
+      rtt = std::max<uint64_t>(1, (nowNs() - first) / 1000);
+  }
+  close(soc);
+  return rtt;
+}
+
+// Why a rendezvous call failed, for exitWithErrorMessage
+static std::string RendezvousLost() {
+  return errno == ETIMEDOUT
+             ? "no reply from the rendezvous within --rendezvous-timeout, "
+               "a rank is gone or stuck"
+             : "lost the rendezvous coordinator";
+}
+
+// Resolve --backend auto the same way on every worker: the switch if the
+// slots fit and it answers the probe, otherwise recursive doubling up to
+// 64KiB per worker and the ring above. Gathers the addresses of the other
+// workers from the rendezvous, if there is one. False if the backend
+// cannot run.
+bool SelectBackend(rendezvous::Client *rdv) {
+  const size_t DoublingBytes = 64 * 1024;
+
+  if (opt.Peers.empty() && opt.World == 1)
+    opt.Peers = rails[0].IP + ':' + std::to_string(opt.Port);
+  std::vector<host::Peer> peers;
+  if (!host::ParsePeers(opt.Peers, peers) ||
+      (!peers.empty() && peers.size() != opt.World)) {
+    worker() << "error: --peers must list ip:port of all " << opt.World
+             << " workers\n";
+    return false;
+  }
+  bool known = rdv || peers.size() == opt.World;
+
+  // Without peers there is nothing to fall back to, so do not bother
+  std::string why;
+  uint64_t rtt = 0;
+  bool vote = false;
+  if (opt.Backend == "auto" && known) {
+    if (opt.DeviceSlots && opt.Slots > opt.DeviceSlots)
+      why = std::to_string(opt.Slots) + " slots needed, the device has " +
+            std::to_string(opt.DeviceSlots);
+    else if (opt.Datapath == "dpdk")
+      rtt = 1; // the port is not up yet, trust it
+    else if (!(rtt = ProbeSwitch()))
+      why = "no answer from the switch in " + std::to_string(opt.ProbeTimeout) +
+            "ms";
+    vote = !rtt;
+  }
+
+  // One round: any vote for the host wins, and everyone's address
+  if (rdv) {
+    std::vector<uint64_t> v(opt.World + 1, 0);
+    v[0] = vote;
+    v[opt.Rank] = host::Pack({rails[0].IP, opt.Port});
+    if (!rdv->max(0, v))
+      exitWithErrorMessage(RendezvousLost());
+    if (v[0] && !vote)
+      why = "another worker cannot use the switch";
+    vote = v[0];
+    opt.Peers.clear();
+    for (unsigned r = 1; r <= opt.World; ++r) {
+      auto p = host::Unpack(v[r]);
+      opt.Peers += (r > 1 ? "," : "") + p.ip + ':' + std::to_string(p.port);
+    }
+  }
+
+  if (opt.Backend == "auto") {
+    if (!vote)
+      opt.Backend = "switch";
+    else
+      opt.Backend = opt.Size * sizeof(uint32_t) <= DoublingBytes ? "rd" : "ring";
+    worker() << "Backend: " << opt.Backend;
+    if (rtt > 1)
+      std::cout << " (probe: " << rtt << "us)";
+    if (!why.empty())
+      std::cout << " (" << why << ")";
+    std::cout << '\n';
+  }
+
+  if ((opt.hostBackend() || opt.Compare) && !known) {
+    worker() << "error: --backend " << opt.Backend
+             << (opt.Compare ? " --compare" : "")
+             << " needs --peers or --rendezvous\n";
+    return false;
+  }
+  if (opt.Compare && opt.hostBackend()) {
+    worker() << "error: --compare needs the switch\n";
+    return false;
+  }
+  return true;
+}
+
+// Calibrate every autotune candidate on the tensor size given by -j/-w/-m
+// and save the best one to --autotune. Every candidate runs an even number
+// of collectives so each slot is back on version 0 for the next one.
+int Autotune(rendezvous::Client *rdv) {
+  const unsigned Warmup = 2, Steps = 8;
+  size_t values = opt.Size;
+  auto candidates = autotune::Candidates(opt.DeviceSlots, opt.Threads, values,
+                                         opt.ValuesPerPacket);
+  if (candidates.empty()) {
+    worker() << "error: nothing to try with " << opt.DeviceSlots
+             << " slots and " << values << " values\n";
+    return 1;
+  }
+  worker() << "Autotune: " << candidates.size() << " candidates, "
+           << opt.DeviceSlots << " device slots, " << values << " values\n";
+
+  bool perf = opt.Perf;
+  opt.Perf = true;
+  std::vector<autotune::Result> results;
+  for (uint32_t c = 0; c < candidates.size(); ++c) {
+    auto &cfg = candidates[c];
+    opt.Threads = cfg.threads;
+    opt.Window = cfg.window;
+    opt.Rx = cfg.rx;
+    opt.Multiplier = values / (cfg.threads * cfg.window * opt.ValuesPerPacket);
+    opt.derive();
+
+    autotune::Result r{cfg};
+    uint32_t expo = opt.Rank;
+    uint32_t *data = nullptr;
+    Session session;
+    if (!session.open() || !GenerateVector(&data, opt.Size, opt.Rank)) {
+      worker() << "error: cannot set up -j " << cfg.threads << " -w "
+               << cfg.window << '\n';
+      return 1;
+    }
+    if (rdv && !rdv->barrier(c + 1))
+      exitWithErrorMessage(RendezvousLost());
+
+    std::vector<uint64_t> us;
+    for (unsigned s = 0; s < Warmup + Steps; ++s) {
+      auto t = session.allReduce(s + 1, &expo, data, 1);
+      if (!t)
+        break;
+      if (s >= Warmup)
+        us.push_back(t);
+    }
+    session.close();
+    free(data);
+
+    // Failed candidates report 0 and are never picked
+    std::vector<uint64_t> agreed{0, 0};
+    if (us.size() == Steps) {
+      std::sort(us.begin(), us.end());
+      agreed = {us[Steps / 2], us.back()};
+    }
+    // The collective took as long as on the slowest worker
+    if (rdv && !rdv->max(c + 1, agreed))
+      exitWithErrorMessage(RendezvousLost());
+    if (us.size() == Steps) {
+      r.medianUs = agreed[0];
+      r.tailUs = agreed[1];
+      r.gbps = ((double)values * 4 * 8 * opt.World) / (r.medianUs * 1000.0);
+    }
+    results.push_back(r);
+
+    worker() << "  -j " << cfg.threads << " -w " << cfg.window << " -r "
+             << cfg.rx << " | median " << r.medianUs << "us, tail "
+             << r.tailUs << "us | " << std::fixed << std::setprecision(2)
+             << r.gbps << " Gbps\n";
+  }
+  opt.Perf = perf;
+
+  auto *best = autotune::Pick(results);
+  if (!best) {
+    worker() << "error: no candidate completed\n";
+    return 1;
+  }
+  worker() << "Autotune: picked -j " << best->config.threads << " -w "
+           << best->config.window << " -r " << best->config.rx << ", "
+           << std::fixed << std::setprecision(2) << best->gbps << " Gbps\n";
+  if (!autotune::Save(opt.Autotune, *best, opt.DeviceSlots, opt.World)) {
+    worker() << "error: cannot write " << opt.Autotune << '\n';
+    return 1;
+  }
+  worker() << "Autotune: saved to " << opt.Autotune << '\n';
+  return 0;
+}
+
+// --profile and --device-info, once the options are parsed
+void LoadTuning() {
+  if (!opt.Profile.empty()) {
+    autotune::Config c;
+    if (!autotune::Load(opt.Profile, c))
+      exitWithErrorMessage("cannot read profile " + opt.Profile);
+    opt.defaults(c.threads, c.window, c.rx);
+  }
+
+  if (!opt.DeviceInfo.empty() &&
+      !(opt.DeviceSlots = autotune::DeviceSlots(opt.DeviceInfo)))
+    exitWithErrorMessage("cannot find the slot count of " + opt.DeviceInfo);
+  if (!opt.Autotune.empty() && !opt.DeviceSlots)
+    exitWithErrorMessage("--autotune requires --device-info");
+  if (!opt.Autotune.empty() && opt.World > 1 && opt.Rendezvous.empty())
+    exitWithErrorMessage("--autotune with more than one worker requires "
+                         "--rendezvous");
+  // --backend auto falls back to the host when the slots do not fit
+  if (opt.Autotune.empty() && opt.Backend == "switch" && opt.DeviceSlots &&
+      opt.Slots > opt.DeviceSlots)
+    exitWithErrorMessage("-j * -w = " + std::to_string(opt.Slots) +
+                         " slots, the device has " +
+                         std::to_string(opt.DeviceSlots));
+}
+
+#ifndef NCLAGG_NO_MAIN
 int main(int argc, char **argv) {
   opt.parse(argc, argv);
 
   if (opt.Help)
     return opt.help(std::cout);
+  LoadTuning();
+
+  rails.parse(opt.Rails, opt.Iface, opt.IP);
+  quant.configure(Quantizer::parse(opt.Quant), opt.World, opt.QuantClip,
+                  opt.SIMD, opt.Ops[0] == reduce::SatAdd);
+
+  // Join the rendezvous first, the rank may come from the coordinator
+  std::thread coordinator;
+  rendezvous::Client rdv(opt.RendezvousTimeout);
+  bool rendezvous = !opt.Rendezvous.empty();
+  if (rendezvous) {
+    std::string host;
+    uint16_t port;
+    if (!rendezvous::splitHostPort(opt.Rendezvous, host, port))
+      exitWithErrorMessage("--rendezvous must be host:port");
+    if (opt.RendezvousServe)
+      coordinator = std::thread([port] {
+        rendezvous::Coordinator(port, opt.World).run(std::cout);
+      });
+    if (!rdv.connect(opt.Rendezvous))
+      exitWithErrorMessage("cannot reach rendezvous at " + opt.Rendezvous);
+    std::string error;
+    opt.Rank = rdv.hello(opt.Rank, opt.World, error);
+    if (!opt.Rank)
+      exitWithErrorMessage("rendezvous did not assign a rank: " + error);
+  }
 
   PrintWorkerInfo(std::cout);
 
-  // Create version bookeeping
-  uint8_t *versions = (uint8_t *)std::malloc(opt.Slots);
-  memset(versions, 0, opt.Slots);
+  // Autotune tries up to every slot of the device
+  if (opt.DeviceWorld) {
+    auto slots = opt.Autotune.empty() ? opt.Slots : opt.DeviceSlots;
+    if (!ConfigureWorld(slots))
+      exitWithErrorMessage("the device did not take --device-world");
+    worker() << "Device: " << opt.World << " workers on slots 0-"
+             << (slots - 1) << '\n';
+  }
 
-  // Create sockets
-  sockaddr_in device_addr, worker_addr[opt.Threads];
-  std::memset(worker_addr, 0, sizeof(sockaddr_in) * opt.Threads);
-  int soc[opt.Threads];
-  for (auto i = 0; i < opt.Threads; ++i) {
-    soc[i] = create_socket_for_worker(i, worker_addr[i], device_addr);
+  if (!opt.Autotune.empty()) {
+    auto rc = Autotune(rendezvous ? &rdv : nullptr);
+    if (rendezvous)
+      rdv.done();
+    if (coordinator.joinable())
+      coordinator.join();
+    return rc;
   }
 
-  const char *interface_name =
-      "ens4f0"; // Replace with your network interface name
-  struct ifreq ifr;
-  memset(&ifr, 0, sizeof(ifr));
-  strncpy(ifr.ifr_name, interface_name, IFNAMSIZ - 1);
+  if (!SelectBackend(rendezvous ? &rdv : nullptr))
+    return 1;
 
-  // Create packet buffers, at least 2
-  ncrt::ncl_h *windows = (ncrt::ncl_h *)std::malloc(
-      sizeof(ncrt::ncl_h) * std::max<int>(2, opt.Window * opt.Threads));
+  Session session;
+  if (!session.open())
+    return 1;
 
   // Just use one exponent for now
   uint32_t expo = opt.Rank; // opt.Random ? xorshift32() :
   uint32_t *data = nullptr;
-  if (!GenerateVector(&data, opt.Size, opt.Random ? 0 : opt.Rank)) {
+  if (!GenerateVector(&data, opt.Size * opt.Pipeline,
+                      opt.Random ? 0 : CheckValue(opt.Rank))) {
     std::cout << "error: failed to generate data\n";
     return 1;
   }
 
-  worker() << '\n';
-
-  for (auto ws = 0; ws < opt.Warmup; ++ws) {
-    worker() << "Running warmup step " << ws << " ...\n";
-    AllReduce(ws + 1, soc, windows, versions, &expo, data, opt.Size);
+  // With --quant the input is float gradients, data[] only carries them
+  float *grads = nullptr, *reduced = nullptr;
+  if (quant.enabled()) {
+    expo = quant.expo();
+    if (!GenerateGradients(&grads, opt.Size * opt.Pipeline * quant.lanes())) {
+      std::cout << "error: failed to generate gradients\n";
+      return 1;
+    }
+    reduced = (float *)malloc(opt.Size * opt.Pipeline * quant.lanes() *
+                              sizeof(float));
   }
 
-  if (opt.Warmup)
-    worker() << '\n';
-
-  uint64_t latency = 0;
-  double throughput = 0;
-  for (auto s = 0; s < opt.Steps; ++s) {
-    auto us = AllReduce(s + 1, soc, windows, versions, &expo, data, opt.Size);
-    if (!us)
-      return 1;
+  worker() << '\n';
 
-    // Calculate throughput in values per second
-    double currentThroughput =
-        ((double)opt.Size * opt.World) / (((double)us) * 1e-6); // us to seconds
-    throughput += currentThroughput;
+  // Barrier ids: warmup steps first, then the timed ones
+  auto barrier = [&](uint32_t id) {
+    if (rendezvous && !rdv.barrier(id))
+      exitWithErrorMessage(RendezvousLost());
+  };
+
+  // Each --op gets its own warmup and steps, on a fresh vector
+  struct Averages {
+    reduce::Op op;
+    uint64_t latency = 0;
+    double throughput = 0, rate = 0;
+  };
+  std::vector<Averages> averages;
+  for (size_t k = 0; k < opt.Ops.size(); ++k) {
+    auto op = opt.Ops[k];
+    uint32_t base = k * (opt.Warmup + opt.Steps);
+    if (k) {
+      free(data);
+      GenerateVector(&data, opt.Size * opt.Pipeline,
+                     opt.Random ? 0 : CheckValue(opt.Rank));
+    }
 
-    // Accumulate total latency
-    latency += us;
+    for (auto ws = 0; ws < opt.Warmup; ++ws) {
+      barrier(base + ws + 1);
+      worker() << "Running warmup step " << ws << " ...\n";
+      session.allReduce(ws + 1, &expo, data, opt.Pipeline, grads, reduced,
+                        op);
+      if (!ws)
+        CheckResult(op, data, opt.Size * opt.Pipeline);
+    }
 
-    // Calculate goodput
-    double gbps =
-        ((double)opt.Size * 4 * 8 * opt.World) / (((double)us) * 1000);
+    if (opt.Warmup)
+      worker() << '\n';
+
+    Averages avg{op};
+    for (auto s = 0; s < opt.Steps; ++s) {
+      barrier(base + opt.Warmup + s + 1);
+      auto us = session.allReduce(s + 1, &expo, data, opt.Pipeline, grads,
+                                  reduced, op);
+      if (!us)
+        return 1;
+      if (!opt.Warmup && !s)
+        CheckResult(op, data, opt.Size * opt.Pipeline);
+
+      // Values per worker, more than one per 32-bit word with --quant, over
+      // all --pipeline collectives of the step
+      uint64_t values = (uint64_t)opt.Size * quant.lanes() * opt.Pipeline;
+
+      // Collectives per second, the figure of merit for small tensors
+      double currentRate = opt.Pipeline / (((double)us) * 1e-6);
+      avg.rate += currentRate;
+
+      // Calculate throughput in values per second
+      double currentThroughput =
+          ((double)values * opt.World) / (((double)us) * 1e-6); // us to seconds
+      avg.throughput += currentThroughput;
+
+      // Accumulate total latency
+      avg.latency += us;
+
+      // Calculate goodput, as if the values were 32 bits wide
+      double gbps =
+          ((double)values * 4 * 8 * opt.World) / (((double)us) * 1000);
+
+      // Print the results
+      worker() << "AllReduce " << (values * opt.World) << " | "
+               << "(" << values << "/" << (opt.Size * sizeof(uint32_t))
+               << "B per worker) : took " << std::setw(2) << std::setfill('0')
+               << (us / 1000000) << ":" << std::setw(3) << std::setfill('0')
+               << ((us % 1000000) / 1000) << "s, " << std::fixed
+               << std::setprecision(2) << currentThroughput << " values/sec, "
+               << gbps << " Gbps, " << currentRate << " collectives/sec"
+               << std::endl;
+
+      if (rendezvous)
+        rdv.stats(k * opt.Steps + s + 1, us, values);
+    }
+    averages.push_back(avg);
+  }
 
-    // Print the results
-    worker() << "AllReduce " << (opt.Size * opt.World) << " | "
-             << "(" << opt.Size << "/" << (opt.Size * sizeof(uint32_t))
-             << "B per worker) : took " << std::setw(2) << std::setfill('0')
-             << (us / 1000000) << ":" << std::setw(3) << std::setfill('0')
-             << ((us % 1000000) / 1000) << "s, " << std::fixed
-             << std::setprecision(2) << currentThroughput << " values/sec, "
-             << gbps << " Gbps" << std::endl;
+  // --compare: the same steps of the first --op again on each host backend
+  std::vector<std::pair<std::string, uint64_t>> compared;
+  if (opt.Compare) {
+    uint32_t id = opt.Ops.size() * (opt.Warmup + opt.Steps);
+    for (auto *backend : {"ring", "rd"}) {
+      opt.Backend = backend;
+      worker() << '\n';
+      worker() << "Running " << opt.Warmup << '+' << opt.Steps
+               << " steps on " << backend << " ...\n";
+      uint64_t total = 0;
+      for (auto s = 0; s < opt.Warmup + opt.Steps; ++s) {
+        barrier(++id);
+        auto us = session.allReduce(s + 1, &expo, data, opt.Pipeline, grads,
+                                    reduced, opt.Ops[0]);
+        if (!us)
+          return 1;
+        if (s >= opt.Warmup)
+          total += us;
+      }
+      compared.emplace_back(backend, total / opt.Steps);
+    }
+    opt.Backend = "switch";
   }
 
+  if (rendezvous)
+    rdv.done();
+  if (coordinator.joinable())
+    coordinator.join();
+
   // Cleanup
-  free(versions);
-  free(windows);
-  for (auto i = 0; i < opt.Threads; ++i)
-    close(soc[i]);
+  session.close();
+  free(grads);
+  free(reduced);
   // // Destroy the sockets
   // for (auto i = 0; i < opt.Threads; ++i)
   //   close(soc[i]);
 
-  // Compute AllReduce latency and throughput
-  latency /= opt.Steps;
-  throughput /= opt.Steps;
+  // Compute AllReduce latency and throughput, per --op
+  for (auto &avg : averages) {
+    auto latency = avg.latency / opt.Steps;
+    auto throughput = avg.throughput / opt.Steps;
+    auto rate = avg.rate / opt.Steps;
+    std::string tag = averages.size() > 1
+                          ? std::string(reduce::Name(avg.op)) + ": "
+                          : "";
 
-  worker() << '\n';
-  worker() << "Average latency over " << opt.Steps
-           << " runs: " << (latency / 1000000) << ":"
-           << ((latency % 1000000) / 1000) << ":"
-           << ((latency % 1000000) / 1000) << " (s:m)\n";
-  worker() << "Average throughput over " << opt.Steps << " runs: " << throughput
-           << " values/sec\n";
-}
\ No newline at end of file
+    worker() << '\n';
+    worker() << tag << "Average latency over " << opt.Steps
+             << " runs: " << (latency / 1000000) << ":"
+             << ((latency % 1000000) / 1000) << ":"
+             << ((latency % 1000000) / 1000) << " (s:m)\n";
+    worker() << tag << "Average throughput over " << opt.Steps
+             << " runs: " << throughput << " values/sec\n";
+    worker() << tag << "Average rate over " << opt.Steps << " runs: " << rate
+             << " collectives/sec (" << opt.Pipeline << " per step)\n";
+  }
+
+  auto latency = averages[0].latency / opt.Steps;
+  for (auto &[backend, us] : compared)
+    worker() << "Compare: " << backend << " " << us << "us, switch "
+             << latency << "us, speedup " << std::fixed
+             << std::setprecision(2) << (double)us / std::max<uint64_t>(1, latency)
+             << "x\n";
+}
+#endif
\ No newline at end of file
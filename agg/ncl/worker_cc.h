@@ -0,0 +1,146 @@
+#ifndef _WORKER_CC_H_
+#define _WORKER_CC_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Per-thread rate pacing and window control for the aggregation loop.
+//
+// Both are purely local to a worker thread: the slots a thread may use are
+// still the ones reserved by its baseSlot, the controller only decides how
+// many of them are in flight and how fast they leave the host.
+
+inline uint64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Userspace token bucket. A rate of 0 disables it.
+class TokenBucket {
+public:
+  TokenBucket(uint64_t bytesPerSec = 0, uint64_t burstBytes = 0)
+      : rate(bytesPerSec), burst(burstBytes), tokens(burstBytes),
+        stamp(nowNs()) {}
+
+  // Take `bytes` tokens if available
+  bool consume(uint64_t bytes) {
+    if (!rate)
+      return true;
+    refill();
+    if (tokens < bytes)
+      return false;
+    tokens -= bytes;
+    return true;
+  }
+
+  // Nanoseconds until `bytes` tokens are available
+  uint64_t delay(uint64_t bytes) {
+    if (!rate)
+      return 0;
+    refill();
+    return tokens >= bytes ? 0 : (bytes - tokens) * 1000000000ULL / rate;
+  }
+
+private:
+  void refill() {
+    auto now = nowNs();
+    auto elapsed = std::min<uint64_t>(now - stamp, 1000000000ULL);
+    uint64_t added = elapsed * rate / 1000000000ULL;
+    if (!added)
+      return;
+    tokens += added;
+    if (tokens >= burst) {
+      tokens = burst;
+      stamp = now;
+    } else {
+      // only advance by the time that actually produced tokens
+      stamp += added * 1000000000ULL / rate;
+    }
+  }
+
+  uint64_t rate;
+  uint64_t burst;
+  uint64_t tokens;
+  uint64_t stamp;
+};
+
+// Adaptive in-flight window, driven by the RTT of aggregation results.
+//
+//  aimd:  +1/cwnd per result, x beta once per RTT when the sample exceeds
+//         the minimum RTT by more than `tolerance`/`slack` (queue build-up)
+//  delay: same, but the threshold is an absolute target RTT
+//
+// The RTT of an aggregation result includes the wait for the slowest
+// worker, so queueing is only inferred relative to the smallest RTT seen.
+class CongestionWindow {
+public:
+  enum Mode { None, Aimd, Delay };
+
+  static Mode parse(const std::string &s) {
+    if (s == "aimd")
+      return Aimd;
+    if (s == "delay")
+      return Delay;
+    return None;
+  }
+
+  CongestionWindow(Mode mode, unsigned maxWindow, uint64_t targetNs = 0)
+      : mode(mode), max(maxWindow), target(targetNs),
+        cwnd(mode == None ? maxWindow : std::max(1u, maxWindow / 2)) {}
+
+  unsigned window() const { return static_cast<unsigned>(cwnd); }
+
+  void onResult(uint64_t rttNs, uint64_t now) {
+    if (mode == None)
+      return;
+
+    minRtt = std::min(minRtt, rttNs);
+    srtt = srtt ? (7 * srtt + rttNs) / 8 : rttNs;
+
+    uint64_t threshold =
+        mode == Delay && target
+            ? target
+            : minRtt + std::max(minRtt * tolerance / 100, slack);
+
+    if (rttNs > threshold) {
+      // at most one decrease per RTT
+      if (now - lastDecrease > srtt) {
+        cwnd = std::max(1.0, cwnd * beta);
+        lastDecrease = now;
+        ++decreases;
+      }
+    } else {
+      cwnd = std::min<double>(max, cwnd + 1.0 / cwnd);
+    }
+  }
+
+  uint64_t rtt() const { return srtt; }
+  uint64_t decreased() const { return decreases; }
+
+private:
+  Mode mode;
+  unsigned max;
+  uint64_t target;
+  double cwnd;
+  double beta = 0.7;
+  uint64_t tolerance = 50; // percent over min RTT
+  uint64_t slack = 50000;  // but at least this many ns, to absorb jitter
+  uint64_t minRtt = UINT64_MAX;
+  uint64_t srtt = 0;
+  uint64_t lastDecrease = 0;
+  uint64_t decreases = 0;
+};
+
+// What a thread's controller ended a step with
+struct FlowStats {
+  uint64_t rttNs = 0;
+  unsigned window = 0;
+  uint64_t decreases = 0;
+  uint64_t saturated = 0; // results flagged by the device, --op sadd
+  uint64_t resent = 0;    // of those, sent again at a coarser scale
+};
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef _WORKER_DATAPATH_H_
+#define _WORKER_DATAPATH_H_
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// How a worker thread moves its packets.
+//
+// A thread owns `window` slots. Slot i always sends the header at
+// headers + i * headerLen followed by the payload last set with payload(i).
+// Results are received into a staging area and handed out by packet(i)
+// until the next recv(); the aggregation loop copies what it needs.
+class Datapath {
+public:
+  virtual ~Datapath() = default;
+
+  // Point slot `slot` at its next chunk of values
+  virtual void payload(uint16_t slot, void *values) = 0;
+
+  // Send the given slots. Returns how many were sent, in order. `err` is
+  // set to an errno if sending failed rather than just stopped short.
+  virtual unsigned send(const uint16_t *slots, unsigned n, bool batch,
+                        int &err) = 0;
+
+  // Receive up to `max` results, at most a window. Returns the number
+  // received, 0 if there was nothing to receive, -1 with errno set on error
+  // or timeout.
+  virtual int recv(bool block, unsigned max) = 0;
+
+  // Start of the i-th received packet (NetCL header first)
+  virtual const uint8_t *packet(unsigned i) = 0;
+
+  // System calls made so far
+  uint64_t syscalls = 0;
+};
+
+// UDP socket per thread per rail
+class SocketDatapath : public Datapath {
+public:
+  SocketDatapath(int soc, const sockaddr_in &device, uint8_t *headers,
+                 size_t headerLen, size_t payloadLen, unsigned window)
+      : soc(soc), device(device), window(window),
+        packetLen(headerLen + payloadLen) {
+    iov = static_cast<iovec *>(calloc(2 * window, sizeof(iovec)));
+    msg = static_cast<mmsghdr *>(calloc(window, sizeof(mmsghdr)));
+    burst = static_cast<mmsghdr *>(calloc(window, sizeof(mmsghdr)));
+    rxbuf = static_cast<uint8_t *>(malloc(window * packetLen));
+    rxiov = static_cast<iovec *>(calloc(window, sizeof(iovec)));
+    rxmsg = static_cast<mmsghdr *>(calloc(window, sizeof(mmsghdr)));
+
+    for (unsigned i = 0, v = 0; i < window; ++i, v += 2) {
+      iov[v].iov_base = headers + i * headerLen;
+      iov[v].iov_len = headerLen;
+      iov[v + 1].iov_len = payloadLen;
+      msg[i].msg_hdr.msg_name = &this->device;
+      msg[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      msg[i].msg_hdr.msg_iov = &iov[v];
+      msg[i].msg_hdr.msg_iovlen = 2;
+
+      rxiov[i].iov_base = rxbuf + i * packetLen;
+      rxiov[i].iov_len = packetLen;
+      rxmsg[i].msg_hdr.msg_iov = &rxiov[i];
+      rxmsg[i].msg_hdr.msg_iovlen = 1;
+    }
+  }
+
+  ~SocketDatapath() override {
+    free(iov);
+    free(msg);
+    free(burst);
+    free(rxbuf);
+    free(rxiov);
+    free(rxmsg);
+  }
+
+  // Continue on another rail's socket
+  void socket(int s) { soc = s; }
+
+  void payload(uint16_t slot, void *values) override {
+    iov[2 * slot + 1].iov_base = values;
+  }
+
+  unsigned send(const uint16_t *slots, unsigned n, bool batch,
+                int &err) override {
+    if (!batch) {
+      for (unsigned i = 0; i < n; ++i) {
+        ++syscalls;
+        if (sendmsg(soc, &msg[slots[i]].msg_hdr, 0) == -1) {
+          err = errno;
+          return i;
+        }
+      }
+      return n;
+    }
+    for (unsigned i = 0; i < n; ++i)
+      burst[i] = msg[slots[i]];
+    ++syscalls;
+    int ret = sendmmsg(soc, burst, n, 0);
+    if (ret < 0) {
+      err = errno;
+      return 0;
+    }
+    return ret;
+  }
+
+  // Block for the first result, but never for a full window: with fewer
+  // slots in flight than the window that would never return
+  int recv(bool block, unsigned max) override {
+    ++syscalls;
+    return recvmmsg(soc, rxmsg, max, block ? MSG_WAITFORONE : MSG_DONTWAIT,
+                    nullptr);
+  }
+
+  const uint8_t *packet(unsigned i) override { return rxbuf + i * packetLen; }
+
+private:
+  int soc;
+  sockaddr_in device;
+  unsigned window;
+  size_t packetLen;
+  iovec *iov;
+  mmsghdr *msg;
+  mmsghdr *burst;
+  uint8_t *rxbuf;
+  iovec *rxiov;
+  mmsghdr *rxmsg;
+};
+
+// Ethernet/IPv4/UDP headers in front of every NetCL packet, for datapaths
+// that build frames themselves. Everything but the payload is fixed per
+// thread, so the frame is built once.
+struct __attribute__((packed)) UdpFrame {
+  ether_header eth;
+  iphdr ip;
+  udphdr udp;
+};
+
+inline bool parseMac(const std::string &s, uint8_t mac[6]) {
+  unsigned b[6];
+  if (sscanf(s.c_str(), "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3],
+             &b[4], &b[5]) != 6)
+    return false;
+  for (int i = 0; i < 6; ++i)
+    mac[i] = b[i];
+  return true;
+}
+
+// Addresses and ports in network order
+inline UdpFrame MakeUdpFrame(const uint8_t srcMac[6], const uint8_t dstMac[6],
+                             uint32_t srcIp, uint32_t dstIp, uint16_t srcPort,
+                             uint16_t dstPort, size_t payloadLen) {
+  UdpFrame f;
+  memset(&f, 0, sizeof(f));
+  memcpy(f.eth.ether_shost, srcMac, 6);
+  memcpy(f.eth.ether_dhost, dstMac, 6);
+  f.eth.ether_type = htons(ETHERTYPE_IP);
+
+  f.ip.version = 4;
+  f.ip.ihl = 5;
+  f.ip.ttl = 64;
+  f.ip.protocol = IPPROTO_UDP;
+  f.ip.tot_len = htons(sizeof(iphdr) + sizeof(udphdr) + payloadLen);
+  f.ip.saddr = srcIp;
+  f.ip.daddr = dstIp;
+  uint16_t w[sizeof(iphdr) / 2];
+  memcpy(w, &f.ip, sizeof(iphdr));
+  uint32_t sum = 0;
+  for (auto x : w)
+    sum += x;
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  f.ip.check = ~sum;
+
+  f.udp.source = srcPort;
+  f.udp.dest = dstPort;
+  f.udp.len = htons(sizeof(udphdr) + payloadLen);
+  f.udp.check = 0; // optional over IPv4
+  return f;
+}
+
+// The NetCL packet inside a received frame, or nullptr if the frame is not
+// IPv4/UDP. `dstPort` is set to the UDP destination port (network order).
+inline const uint8_t *UdpPayload(const uint8_t *frame, size_t len,
+                                 uint16_t &dstPort) {
+  if (len < sizeof(UdpFrame))
+    return nullptr;
+  auto *f = reinterpret_cast<const UdpFrame *>(frame);
+  if (f->eth.ether_type != htons(ETHERTYPE_IP) ||
+      f->ip.protocol != IPPROTO_UDP)
+    return nullptr;
+  auto *udp = reinterpret_cast<const udphdr *>(frame + sizeof(ether_header) +
+                                               f->ip.ihl * 4);
+  if (reinterpret_cast<const uint8_t *>(udp + 1) > frame + len)
+    return nullptr;
+  dstPort = udp->dest;
+  return reinterpret_cast<const uint8_t *>(udp + 1);
+}
+
+#endif
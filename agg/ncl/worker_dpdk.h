@@ -0,0 +1,253 @@
+#ifndef _WORKER_DPDK_H_
+#define _WORKER_DPDK_H_
+
+// DPDK poll-mode datapath, built with `make worker3 DPDK=1` (-DNCL_DPDK).
+//
+// One port, one RX/TX queue pair per worker thread. Headers (Ethernet, IP,
+// UDP, NetCL) go into a small mbuf, the values are not copied: a second
+// mbuf is attached to data[offset] as an external buffer and chained
+// behind the header. Ports without multi-segment TX get a single copied
+// mbuf instead.
+//
+// Results are steered to threads by UDP destination port. Virtual devices
+// spread packets over queues without looking at ports, so a thread hands
+// frames for other threads over through their rings.
+//
+// Local testing against a net_tap vdev and the emulator:
+//
+//   worker3 --datapath dpdk \
+//     --dpdk "--no-pci --iova-mode=va --vdev=net_tap0,iface=ncl0" \
+//     -I 10.0.0.2 --device-ip 10.0.0.1 --device-mac <ncl0 mac> ...
+//   ip addr add 10.0.0.1/24 dev ncl0 && ip link set ncl0 up
+//   ip neigh add 10.0.0.2 lladdr <port mac, printed at start> dev ncl0
+//
+// net_af_packet (--vdev=net_af_packet0,iface=eth0,qpairs=N) works the same
+// way on an existing interface.
+
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_ring.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "worker_datapath.h"
+
+namespace dpdk {
+
+static uint16_t Port = 0;
+static rte_mempool *Pool = nullptr;
+static bool MultiSeg = false;
+static uint8_t Mac[6];
+static std::vector<rte_ring *> Rings;
+
+// Bring up EAL and the first port with `queues` queue pairs. Returns false
+// (after printing why) on failure.
+inline bool Init(const std::string &ealArgs, unsigned queues,
+                 unsigned window) {
+  std::vector<std::string> args{"worker3"};
+  std::istringstream iss(ealArgs);
+  for (std::string a; iss >> a;)
+    args.push_back(a);
+  std::vector<char *> argv;
+  for (auto &a : args)
+    argv.push_back(a.data());
+  if (rte_eal_init(argv.size(), argv.data()) < 0) {
+    std::cerr << "error: rte_eal_init failed\n";
+    return false;
+  }
+  if (rte_eth_dev_count_avail() == 0) {
+    std::cerr << "error: no DPDK port, pass a --vdev in --dpdk\n";
+    return false;
+  }
+
+  auto socket = rte_eth_dev_socket_id(Port);
+  unsigned desc = std::max(512u, 2 * window);
+  Pool = rte_pktmbuf_pool_create("ncl", std::max(8191u, 4 * queues * desc),
+                                 256, 0, RTE_MBUF_DEFAULT_BUF_SIZE,
+                                 rte_socket_id());
+  if (!Pool) {
+    std::cerr << "error: cannot create the mbuf pool\n";
+    return false;
+  }
+
+  rte_eth_dev_info info;
+  rte_eth_dev_info_get(Port, &info);
+  if (queues > info.max_rx_queues || queues > info.max_tx_queues) {
+    std::cerr << "error: port supports " << info.max_rx_queues
+              << " queues, need one per thread\n";
+    return false;
+  }
+
+  rte_eth_conf conf;
+  memset(&conf, 0, sizeof(conf));
+  MultiSeg = info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MULTI_SEGS;
+  if (MultiSeg)
+    conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MULTI_SEGS;
+
+  if (rte_eth_dev_configure(Port, queues, queues, &conf) < 0)
+    return false;
+  for (unsigned q = 0; q < queues; ++q) {
+    if (rte_eth_rx_queue_setup(Port, q, desc, socket, nullptr, Pool) < 0 ||
+        rte_eth_tx_queue_setup(Port, q, desc, socket, nullptr) < 0) {
+      std::cerr << "error: cannot set up queue " << q << '\n';
+      return false;
+    }
+    auto name = "ncl" + std::to_string(q);
+    Rings.push_back(rte_ring_create(name.c_str(), rte_align32pow2(4 * desc),
+                                    rte_socket_id(), RING_F_SC_DEQ));
+  }
+  if (rte_eth_dev_start(Port) < 0) {
+    std::cerr << "error: cannot start port " << Port << '\n';
+    return false;
+  }
+  rte_eth_promiscuous_enable(Port);
+
+  rte_ether_addr addr;
+  rte_eth_macaddr_get(Port, &addr);
+  memcpy(Mac, addr.addr_bytes, 6);
+  return true;
+}
+
+inline void Close() {
+  rte_eth_dev_stop(Port);
+  rte_eth_dev_close(Port);
+  for (auto *r : Rings)
+    rte_ring_free(r);
+  Rings.clear();
+  rte_eal_cleanup();
+}
+
+} // namespace dpdk
+
+class DpdkDatapath : public Datapath {
+public:
+  // `frame` carries this thread's addresses; its UDP source port is where
+  // results come back to
+  DpdkDatapath(uint16_t queue, const UdpFrame &frame, uint16_t basePort,
+               uint8_t *headers, size_t headerLen, size_t payloadLen,
+               unsigned window)
+      : queue(queue), frame(frame), basePort(basePort), headers(headers),
+        headerLen(headerLen), payloadLen(payloadLen), window(window),
+        payloads(window, nullptr), tx(window), rx(window),
+        staging(window * (headerLen + payloadLen)) {
+    // worker threads are not EAL lcores, give them mempool caches
+    rte_thread_register();
+    memset(&shinfo, 0, sizeof(shinfo));
+    shinfo.free_cb = [](void *, void *) {}; // data[] is not ours to free
+    rte_mbuf_ext_refcnt_set(&shinfo, 1);
+  }
+
+  ~DpdkDatapath() override { rte_thread_unregister(); }
+
+  void payload(uint16_t slot, void *values) override {
+    payloads[slot] = values;
+  }
+
+  unsigned send(const uint16_t *slots, unsigned n, bool, int &err) override {
+    auto hlen = sizeof(UdpFrame) + headerLen;
+    unsigned built = 0;
+    for (; built < n; ++built) {
+      auto slot = slots[built];
+      auto *m = rte_pktmbuf_alloc(dpdk::Pool);
+      if (!m)
+        break;
+      auto *p = rte_pktmbuf_mtod(m, uint8_t *);
+      memcpy(p, &frame, sizeof(UdpFrame));
+      memcpy(p + sizeof(UdpFrame), headers + slot * headerLen, headerLen);
+
+      if (dpdk::MultiSeg) {
+        auto *ext = rte_pktmbuf_alloc(dpdk::Pool);
+        if (!ext) {
+          rte_pktmbuf_free(m);
+          break;
+        }
+        m->data_len = m->pkt_len = hlen;
+        rte_mbuf_ext_refcnt_update(&shinfo, 1);
+        rte_pktmbuf_attach_extbuf(ext, payloads[slot], iova(payloads[slot]),
+                                  payloadLen, &shinfo);
+        ext->data_len = ext->pkt_len = payloadLen;
+        rte_pktmbuf_chain(m, ext);
+      } else {
+        memcpy(p + hlen, payloads[slot], payloadLen);
+        m->data_len = m->pkt_len = hlen + payloadLen;
+      }
+      tx[built] = m;
+    }
+
+    auto sent = rte_eth_tx_burst(dpdk::Port, queue, tx.data(), built);
+    for (auto i = sent; i < built; ++i)
+      rte_pktmbuf_free(tx[i]);
+    if (sent < n && built < n)
+      err = ENOBUFS;
+    return sent;
+  }
+
+  // Poll mode, never blocks
+  int recv(bool, unsigned max) override {
+    unsigned count = 0;
+    auto n = rte_eth_rx_burst(dpdk::Port, queue, rx.data(), max);
+    for (unsigned i = 0; i < n; ++i) {
+      uint16_t port;
+      auto *p = UdpPayload(rte_pktmbuf_mtod(rx[i], uint8_t *),
+                           rte_pktmbuf_data_len(rx[i]), port);
+      unsigned owner = p ? ntohs(port) - basePort : ~0u;
+      if (owner == queue && count < max)
+        take(rx[i], p, count);
+      else if (owner >= dpdk::Rings.size() ||
+               rte_ring_enqueue(dpdk::Rings[owner], rx[i]) != 0)
+        rte_pktmbuf_free(rx[i]);
+    }
+
+    // Frames the other threads received for us
+    if (count < max) {
+      n = rte_ring_dequeue_burst(dpdk::Rings[queue],
+                                 reinterpret_cast<void **>(rx.data()),
+                                 max - count, nullptr);
+      for (unsigned i = 0; i < n; ++i) {
+        uint16_t port;
+        take(rx[i],
+             UdpPayload(rte_pktmbuf_mtod(rx[i], uint8_t *),
+                        rte_pktmbuf_data_len(rx[i]), port),
+             count);
+      }
+    }
+    return count;
+  }
+
+  const uint8_t *packet(unsigned i) override {
+    return staging.data() + i * (headerLen + payloadLen);
+  }
+
+private:
+  void take(rte_mbuf *m, const uint8_t *p, unsigned &count) {
+    auto len = headerLen + payloadLen;
+    if (p + len <= rte_pktmbuf_mtod(m, uint8_t *) + rte_pktmbuf_data_len(m))
+      memcpy(staging.data() + count++ * len, p, len);
+    rte_pktmbuf_free(m);
+  }
+
+  static rte_iova_t iova(void *p) {
+    return rte_eal_iova_mode() == RTE_IOVA_VA ? (rte_iova_t)p
+                                              : rte_mem_virt2iova(p);
+  }
+
+  uint16_t queue;
+  UdpFrame frame;
+  uint16_t basePort;
+  uint8_t *headers;
+  size_t headerLen;
+  size_t payloadLen;
+  unsigned window;
+  std::vector<void *> payloads;
+  std::vector<rte_mbuf *> tx;
+  std::vector<rte_mbuf *> rx;
+  std::vector<uint8_t> staging;
+  rte_mbuf_ext_shared_info shinfo;
+};
+
+#endif
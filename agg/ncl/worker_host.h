@@ -0,0 +1,339 @@
+#ifndef _WORKER_HOST_H_
+#define _WORKER_HOST_H_
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "reduce.h"
+
+// Host-only allreduce (--backend ring|rd), without the device.
+//
+// Workers connect to each other over TCP, one connection per pair: every
+// rank listens on its own address and base port and connects to the ranks
+// below it. Two algorithms over that mesh:
+//
+//   ring  reduce-scatter then allgather around the ring, 2(W-1) steps that
+//         each move 1/W of the vector; bandwidth optimal, for large tensors
+//   rd    recursive doubling, log2(W) steps that each move the whole
+//         vector; fewer round trips, for small ones
+//
+// Values are in network order, as they go on the wire, and are summed as
+// 32-bit unsigned integers that wrap like on the device, so results match
+// the switch bit for bit (and --quant lanes carry the same way).
+namespace host {
+
+struct Peer {
+  std::string ip;
+  uint16_t port = 0;
+};
+
+// "ip:port,ip:port,..." in rank order
+inline bool ParsePeers(const std::string &spec, std::vector<Peer> &peers) {
+  peers.clear();
+  std::istringstream iss(spec);
+  std::string item;
+  while (std::getline(iss, item, ',')) {
+    auto colon = item.rfind(':');
+    if (colon == std::string::npos)
+      return false;
+    peers.push_back({item.substr(0, colon),
+                     static_cast<uint16_t>(std::stoul(item.substr(colon + 1)))});
+  }
+  return true;
+}
+
+// Address and port in one word, for the rendezvous to gather
+inline uint64_t Pack(const Peer &p) {
+  return static_cast<uint64_t>(ntohl(inet_addr(p.ip.c_str()))) << 16 | p.port;
+}
+
+inline Peer Unpack(uint64_t v) {
+  in_addr a;
+  a.s_addr = htonl(static_cast<uint32_t>(v >> 16));
+  return {inet_ntoa(a), static_cast<uint16_t>(v & 0xffff)};
+}
+
+class Mesh {
+public:
+  ~Mesh() { close(); }
+
+  // Connect rank `rank` (1-based) to every other peer. Peers that are not
+  // up yet are retried for `timeoutMs`.
+  bool open(unsigned rank, const std::vector<Peer> &peers,
+            unsigned timeoutMs) {
+    close();
+    self = rank - 1;
+    world = peers.size();
+    fds.assign(world, -1);
+    if (world == 1)
+      return true;
+
+    int lsoc = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(lsoc, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(peers[self].ip.c_str());
+    addr.sin_port = htons(peers[self].port);
+    if (bind(lsoc, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lsoc, world) < 0) {
+      perror("host backend: cannot listen");
+      ::close(lsoc);
+      return false;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeoutMs);
+    bool ok = true;
+
+    // Lower ranks are listening, or will be shortly
+    for (unsigned r = 0; ok && r < self; ++r) {
+      sockaddr_in peer{};
+      peer.sin_family = AF_INET;
+      peer.sin_addr.s_addr = inet_addr(peers[r].ip.c_str());
+      peer.sin_port = htons(peers[r].port);
+      while (true) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr *)&peer, sizeof(peer)) == 0) {
+          uint32_t me = self;
+          ok = ::send(fd, &me, sizeof(me), MSG_NOSIGNAL) == sizeof(me);
+          fds[r] = fd;
+          break;
+        }
+        ::close(fd);
+        if (std::chrono::steady_clock::now() > deadline) {
+          ok = false;
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+    }
+
+    // Higher ranks connect to us and say who they are
+    for (unsigned accepted = self + 1; ok && accepted < world; ++accepted) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      deadline - std::chrono::steady_clock::now())
+                      .count();
+      pollfd pfd = {lsoc, POLLIN, 0};
+      if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+        ok = false;
+        break;
+      }
+      int fd = accept(lsoc, nullptr, nullptr);
+      uint32_t r = 0;
+      if (fd < 0 || ::recv(fd, &r, sizeof(r), MSG_WAITALL) != sizeof(r) ||
+          r <= self || r >= world || fds[r] >= 0) {
+        if (fd >= 0)
+          ::close(fd);
+        ok = false;
+        break;
+      }
+      fds[r] = fd;
+    }
+    ::close(lsoc);
+
+    if (!ok) {
+      close();
+      return false;
+    }
+
+    int buf = 4 * 1024 * 1024;
+    for (auto fd : fds) {
+      if (fd < 0)
+        continue;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    return true;
+  }
+
+  void close() {
+    for (auto &fd : fds)
+      if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+      }
+    fds.clear();
+  }
+
+  bool isOpen() const { return !fds.empty(); }
+
+  // Bytes sent since open()
+  uint64_t bytes() const { return sent; }
+
+  // AVX2 for reduce::Apply(), see --simd
+  bool simd = false;
+
+  // Whether the last ring() or doubling() saturated a partial sum on this
+  // rank, reduce::SatAdd. Other ranks may not have.
+  bool saturated() const { return sat; }
+
+  // Reduce `n` values over all ranks with `op`, in place
+  bool ring(uint32_t *data, size_t n, reduce::Op op = reduce::Add) {
+    sat = false;
+    if (world == 1)
+      return true;
+    auto lo = [&](unsigned seg) { return seg * n / world; };
+    auto len = [&](unsigned seg) { return lo(seg + 1) - lo(seg); };
+    unsigned right = (self + 1) % world, left = (self + world - 1) % world;
+    tmp.resize(n / world + 1);
+
+    // After W-1 steps this rank holds the full sum of segment self + 1
+    for (unsigned k = 0; k + 1 < world; ++k) {
+      unsigned out = (self + world - k) % world;
+      unsigned in = (self + world - k - 1) % world;
+      if (!exchange(right, data + lo(out), len(out) * 4, left, tmp.data(),
+                    len(in) * 4))
+        return false;
+      sat |= reduce::Apply(op, data + lo(in), tmp.data(), len(in), simd);
+    }
+    // Pass the summed segments around
+    for (unsigned k = 0; k + 1 < world; ++k) {
+      unsigned out = (self + 1 + world - k) % world;
+      unsigned in = (self + world - k) % world;
+      if (!exchange(right, data + lo(out), len(out) * 4, left, data + lo(in),
+                    len(in) * 4))
+        return false;
+    }
+    return true;
+  }
+
+  bool doubling(uint32_t *data, size_t n, reduce::Op op = reduce::Add) {
+    sat = false;
+    return doubling(data, n, [&](uint32_t *a, const uint32_t *b, size_t n) {
+      sat |= reduce::Apply(op, a, b, n, simd);
+    });
+  }
+
+  // Largest `v` over all ranks
+  bool max(uint32_t &v) {
+    return doubling(&v, 1, [](uint32_t *a, const uint32_t *b, size_t) {
+      *a = std::max(*a, *b);
+    });
+  }
+
+private:
+  // For a world that is not a power of two, the first 2 * extra ranks pair
+  // up first: the even one hands its vector to the odd one, sits out the
+  // exchange and gets the result back at the end.
+  template <typename Op>
+  bool doubling(uint32_t *data, size_t n, Op &&op) {
+    if (world == 1)
+      return true;
+    unsigned pow2 = 1;
+    while (pow2 * 2 <= world)
+      pow2 *= 2;
+    unsigned extra = world - pow2;
+    tmp.resize(n);
+
+    int vrank; // rank among the pow2 that exchange, -1 if sitting out
+    if (self < 2 * extra) {
+      if (self % 2 == 0) {
+        if (!exchange(self + 1, data, n * 4, -1, nullptr, 0))
+          return false;
+        vrank = -1;
+      } else {
+        if (!exchange(-1, nullptr, 0, self - 1, tmp.data(), n * 4))
+          return false;
+        op(data, tmp.data(), n);
+        vrank = self / 2;
+      }
+    } else {
+      vrank = self - extra;
+    }
+
+    if (vrank >= 0)
+      for (unsigned mask = 1; mask < pow2; mask <<= 1) {
+        unsigned vpeer = vrank ^ mask;
+        unsigned peer = vpeer < extra ? vpeer * 2 + 1 : vpeer + extra;
+        if (!exchange(peer, data, n * 4, peer, tmp.data(), n * 4))
+          return false;
+        op(data, tmp.data(), n);
+      }
+
+    if (self < 2 * extra) {
+      if (self % 2 == 0)
+        return exchange(-1, nullptr, 0, self + 1, data, n * 4);
+      return exchange(self - 1, data, n * 4, -1, nullptr, 0);
+    }
+    return true;
+  }
+
+  // Send `outLen` bytes to rank `to` while receiving `inLen` from `from`
+  // (-1: none), so that neither side blocks on a full socket buffer
+  bool exchange(int to, const void *out, size_t outLen, int from, void *in,
+                size_t inLen) {
+    size_t done = 0, got = 0;
+    if (to < 0)
+      outLen = 0;
+    if (from < 0)
+      inLen = 0;
+    while (done < outLen || got < inLen) {
+      pollfd pfd[2];
+      nfds_t n = 0;
+      if (done < outLen)
+        pfd[n++] = {fds[to], POLLOUT, 0};
+      if (got < inLen) {
+        if (n && pfd[0].fd == fds[from])
+          pfd[0].events |= POLLIN;
+        else
+          pfd[n++] = {fds[from], POLLIN, 0};
+      }
+      if (poll(pfd, n, -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      for (nfds_t i = 0; i < n; ++i) {
+        if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL) &&
+            !(pfd[i].revents & POLLIN))
+          return false;
+        if (pfd[i].revents & POLLOUT && done < outLen) {
+          auto r = ::send(fds[to], static_cast<const uint8_t *>(out) + done,
+                          outLen - done, MSG_NOSIGNAL);
+          if (r < 0 && errno != EAGAIN && errno != EINTR)
+            return false;
+          if (r > 0) {
+            done += r;
+            sent += r;
+          }
+        }
+        if (pfd[i].revents & POLLIN && got < inLen) {
+          auto r = ::recv(fds[from], static_cast<uint8_t *>(in) + got,
+                          inLen - got, 0);
+          if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+            return false;
+          if (r > 0)
+            got += r;
+        }
+      }
+    }
+    return true;
+  }
+
+  unsigned self = 0, world = 1;
+  std::vector<int> fds; // by 0-based rank, -1 for this one
+  std::vector<uint32_t> tmp;
+  uint64_t sent = 0;
+  bool sat = false;
+};
+
+} // namespace host
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef _WORKER_PACKET_H_
+#define _WORKER_PACKET_H_
+
+// AF_PACKET datapath with PACKET_MMAP rings (--datapath packet).
+//
+// Each thread opens a raw socket on its rail's interface with a TPACKET_V3
+// RX block ring and a TX frame ring, both mapped into the process. Frames
+// are built from a precomputed Ethernet/IPv4/UDP header (--device-mac,
+// --device-ip), the NetCL header and the values, written straight into the
+// TX ring and flushed with a single send(). A BPF filter passes only UDP
+// for this thread's port, so threads do not see each other's results.
+//
+// The kernel hands out a RX block once it is full or after its retire
+// timeout. Blocks are one page, a dozen or so results, so that with a
+// window in flight they fill up rather than wait for the timeout, which is
+// kept at its 1ms minimum. Needs CAP_NET_RAW.
+
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "worker_datapath.h"
+
+class PacketDatapath : public Datapath {
+public:
+  // `frame` carries this thread's addresses, its UDP source port is where
+  // results come back to. Check ok() before use.
+  PacketDatapath(const std::string &iface, const UdpFrame &frame,
+                 uint8_t *headers, size_t headerLen, size_t payloadLen,
+                 unsigned window)
+      : frame(frame), headers(headers), headerLen(headerLen),
+        payloadLen(payloadLen), window(window), payloads(window, nullptr),
+        staging(window * (headerLen + payloadLen)) {
+    fd = ::socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+    if (fd < 0) {
+      perror("AF_PACKET socket failed");
+      return;
+    }
+    int v3 = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v3, sizeof(v3)) < 0) {
+      perror("setsockopt PACKET_VERSION failed");
+      return;
+    }
+    // On loopback every frame would show up twice
+    int one = 1;
+    setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+    if (!filter(ntohs(frame.udp.source)) || !rings())
+      return;
+
+    sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_IP);
+    ll.sll_ifindex = if_nametoindex(iface.c_str());
+    if (!ll.sll_ifindex || bind(fd, (sockaddr *)&ll, sizeof(ll)) < 0) {
+      perror(("cannot bind to " + iface).c_str());
+      return;
+    }
+    good = true;
+  }
+
+  ~PacketDatapath() override {
+    if (map != MAP_FAILED)
+      munmap(map, rxLen + txLen);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool ok() const { return good; }
+
+  // Hardware address of `iface`, for the source of outgoing frames
+  static bool ifaceMac(const std::string &iface, uint8_t mac[6]) {
+    int s = ::socket(AF_INET, SOCK_DGRAM, 0);
+    ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, iface.c_str(), IFNAMSIZ - 1);
+    bool ok = s >= 0 && ioctl(s, SIOCGIFHWADDR, &ifr) == 0;
+    if (ok)
+      memcpy(mac, ifr.ifr_hwaddr.sa_data, 6);
+    if (s >= 0)
+      close(s);
+    return ok;
+  }
+
+  void payload(uint16_t slot, void *values) override {
+    payloads[slot] = values;
+  }
+
+  // Fill free TX frames, then kick the kernel once. Stops short when the
+  // ring is full; the rest goes out with the next call.
+  unsigned send(const uint16_t *slots, unsigned n, bool, int &err) override {
+    unsigned queued = 0;
+    for (; queued < n; ++queued) {
+      auto *h = reinterpret_cast<tpacket3_hdr *>(map + rxLen + txIdx * FrameSize);
+      if (h->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+        break;
+      auto *p = reinterpret_cast<uint8_t *>(h) + TxDataOffset;
+      auto slot = slots[queued];
+      memcpy(p, &frame, sizeof(UdpFrame));
+      p += sizeof(UdpFrame);
+      memcpy(p, headers + slot * headerLen, headerLen);
+      memcpy(p + headerLen, payloads[slot], payloadLen);
+      h->tp_len = sizeof(UdpFrame) + headerLen + payloadLen;
+      __atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST,
+                       __ATOMIC_RELEASE);
+      txIdx = (txIdx + 1) % txFrames;
+    }
+    ++syscalls;
+    if (::send(fd, nullptr, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN &&
+        errno != ENOBUFS)
+      err = errno;
+    return queued;
+  }
+
+  int recv(bool block, unsigned max) override {
+    unsigned count = 0;
+    while (count < max) {
+      auto *bd = rxBlock(rxIdx);
+      if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+            TP_STATUS_USER)) {
+        if (count || !block)
+          break;
+        pollfd pfd = {fd, POLLIN | POLLERR, 0};
+        ++syscalls;
+        if (poll(&pfd, 1, -1) < 0)
+          return -1;
+        continue;
+      }
+
+      // Resume where the last call stopped if the block had more results
+      // than were asked for
+      auto npkts = bd->hdr.bh1.num_pkts;
+      auto *h = reinterpret_cast<tpacket3_hdr *>(
+          reinterpret_cast<uint8_t *>(bd) +
+          (rxPkt ? rxPos : bd->hdr.bh1.offset_to_first_pkt));
+      for (; rxPkt < npkts && count < max; ++rxPkt) {
+        take(reinterpret_cast<uint8_t *>(h) + h->tp_mac, h->tp_snaplen,
+             count);
+        h = reinterpret_cast<tpacket3_hdr *>(reinterpret_cast<uint8_t *>(h) +
+                                             h->tp_next_offset);
+      }
+      if (rxPkt < npkts) {
+        rxPos = reinterpret_cast<uint8_t *>(h) - reinterpret_cast<uint8_t *>(bd);
+        break;
+      }
+      rxPkt = 0;
+      __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                       __ATOMIC_RELEASE);
+      rxIdx = (rxIdx + 1) % rxBlocks;
+    }
+    return count;
+  }
+
+  const uint8_t *packet(unsigned i) override {
+    return staging.data() + i * (headerLen + payloadLen);
+  }
+
+private:
+  static constexpr unsigned FrameSize = 512;
+  static constexpr unsigned TxDataOffset = TPACKET_ALIGN(sizeof(tpacket3_hdr));
+
+  // Accept IPv4/UDP to `port` only, no fragments
+  bool filter(uint16_t port) {
+    sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IP, 0, 8),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFF),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+      perror("setsockopt SO_ATTACH_FILTER failed");
+      return false;
+    }
+    return true;
+  }
+
+  // RX: page sized blocks for four windows of results. TX: two windows of
+  // frames, at least 64.
+  bool rings() {
+    unsigned page = sysconf(_SC_PAGESIZE);
+    unsigned perBlock = page / FrameSize;
+
+    tpacket_req3 rx;
+    memset(&rx, 0, sizeof(rx));
+    rx.tp_block_size = page;
+    rx.tp_block_nr = rxBlocks = std::max(64u, 4 * window / perBlock);
+    rx.tp_frame_size = FrameSize;
+    rx.tp_frame_nr = rx.tp_block_size / FrameSize * rx.tp_block_nr;
+    rx.tp_retire_blk_tov = 1;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx)) < 0) {
+      perror("setsockopt PACKET_RX_RING failed");
+      return false;
+    }
+
+    tpacket_req3 tx;
+    memset(&tx, 0, sizeof(tx));
+    tx.tp_block_size = page;
+    tx.tp_block_nr = (std::max(64u, 2 * window) + perBlock - 1) / perBlock;
+    tx.tp_frame_size = FrameSize;
+    tx.tp_frame_nr = txFrames = tx.tp_block_nr * perBlock;
+    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &tx, sizeof(tx)) < 0) {
+      perror("setsockopt PACKET_TX_RING failed");
+      return false;
+    }
+
+    rxBlockSize = rx.tp_block_size;
+    rxLen = static_cast<size_t>(rx.tp_block_size) * rx.tp_block_nr;
+    txLen = static_cast<size_t>(tx.tp_block_size) * tx.tp_block_nr;
+    auto *m = mmap(nullptr, rxLen + txLen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_LOCKED, fd, 0);
+    if (m == MAP_FAILED)
+      m = mmap(nullptr, rxLen + txLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+      perror("mmap of the packet rings failed");
+      return false;
+    }
+    map = static_cast<uint8_t *>(m);
+    return true;
+  }
+
+  tpacket_block_desc *rxBlock(unsigned i) {
+    return reinterpret_cast<tpacket_block_desc *>(map + i * rxBlockSize);
+  }
+
+  void take(const uint8_t *frame, size_t len, unsigned &count) {
+    uint16_t port;
+    auto *p = UdpPayload(frame, len, port);
+    auto n = headerLen + payloadLen;
+    if (p && p + n <= frame + len)
+      memcpy(staging.data() + count++ * n, p, n);
+  }
+
+  int fd = -1;
+  bool good = false;
+  uint8_t *map = static_cast<uint8_t *>(MAP_FAILED);
+  size_t rxLen = 0, txLen = 0;
+  unsigned rxBlockSize = 0, rxBlocks = 0, txFrames = 0;
+  unsigned rxIdx = 0, rxPkt = 0, rxPos = 0, txIdx = 0;
+
+  UdpFrame frame;
+  uint8_t *headers;
+  size_t headerLen;
+  size_t payloadLen;
+  unsigned window;
+  std::vector<void *> payloads;
+  std::vector<uint8_t> staging;
+};
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef _WORKER_PROGRESS_H_
+#define _WORKER_PROGRESS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Per-chunk completion tracking for a single AllReduce.
+//
+// A chunk is the ValuesPerPacket values carried by one packet. The receive
+// path of every worker thread marks a chunk complete right after its result
+// has been copied into data[offset], so a consumer (optimizer, next layer)
+// can start on finished ranges while the tail of the collective is still in
+// flight. Writers only ever set bits; readers never block writers.
+class Progress {
+public:
+  using clock = std::chrono::steady_clock;
+
+  Progress() = default;
+  Progress(const Progress &) = delete;
+  Progress &operator=(const Progress &) = delete;
+
+  ~Progress() { delete[] bits; }
+
+  // Prepare for a collective of `n` chunks. Not thread-safe; call before the
+  // worker threads are released.
+  void reset(size_t n) {
+    if (nwords < (n + 63) / 64) {
+      delete[] bits;
+      nwords = (n + 63) / 64;
+      bits = new std::atomic<uint64_t>[nwords];
+    }
+    for (size_t i = 0; i < nwords; ++i)
+      bits[i].store(0, std::memory_order_relaxed);
+    chunks = n;
+    completed.store(0, std::memory_order_relaxed);
+    first.store(0, std::memory_order_relaxed);
+    last.store(0, std::memory_order_relaxed);
+    aborted.store(false, std::memory_order_relaxed);
+    t0 = clock::now();
+  }
+
+  // Mark chunk `c` as complete. Its data must be in place before the call.
+  void complete(size_t c) {
+    auto prev = bits[c / 64].fetch_or(1ULL << (c % 64),
+                                      std::memory_order_release);
+    if (prev & (1ULL << (c % 64)))
+      return;
+
+    int64_t now = elapsed();
+    int64_t zero = 0;
+    first.compare_exchange_strong(zero, now, std::memory_order_relaxed);
+    if (completed.fetch_add(1, std::memory_order_acq_rel) + 1 == chunks)
+      last.store(now, std::memory_order_release);
+  }
+
+  bool done(size_t c) const {
+    return bits[c / 64].load(std::memory_order_acquire) & (1ULL << (c % 64));
+  }
+
+  // True if every chunk in [lo, hi) is complete.
+  bool done(size_t lo, size_t hi) const {
+    for (size_t c = lo; c < hi; ++c)
+      if (!done(c))
+        return false;
+    return true;
+  }
+
+  bool done() const { return completed.load(std::memory_order_acquire) == chunks; }
+
+  // A worker thread gave up; the remaining chunks will never complete
+  void fail() { aborted.store(true, std::memory_order_release); }
+  bool failed() const { return aborted.load(std::memory_order_acquire); }
+
+  // Block until every chunk in [lo, hi) is complete, or the step failed.
+  void wait(size_t lo, size_t hi) const {
+    while (!done(lo, hi) && !failed())
+      std::this_thread::yield();
+  }
+
+  // Invoke f(c) once for every chunk that completed since the last call.
+  // `seen` is the caller's own copy of the bitmap and must start zeroed with
+  // at least words() entries. Returns the number of new chunks.
+  template <typename F> size_t drain(std::vector<uint64_t> &seen, F &&f) const {
+    size_t n = 0;
+    for (size_t w = 0; w < nwords; ++w) {
+      uint64_t fresh = bits[w].load(std::memory_order_acquire) & ~seen[w];
+      seen[w] |= fresh;
+      while (fresh) {
+        f(w * 64 + __builtin_ctzll(fresh));
+        fresh &= fresh - 1;
+        ++n;
+      }
+    }
+    return n;
+  }
+
+  // 64-bit words of the completion bitmap
+  size_t words() const { return nwords; }
+  size_t count() const { return completed.load(std::memory_order_acquire); }
+  size_t total() const { return chunks; }
+
+  // Time (us) since reset() at which the first/last chunk completed
+  uint64_t firstUs() const { return first.load(std::memory_order_acquire) / 1000; }
+  uint64_t lastUs() const { return last.load(std::memory_order_acquire) / 1000; }
+
+private:
+  int64_t elapsed() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t0)
+        .count();
+  }
+
+  std::atomic<uint64_t> *bits = nullptr;
+  size_t nwords = 0;
+  size_t chunks = 0;
+  std::atomic<size_t> completed{0};
+  std::atomic<int64_t> first{0};
+  std::atomic<int64_t> last{0};
+  std::atomic<bool> aborted{false};
+  clock::time_point t0;
+};
+
+#endif
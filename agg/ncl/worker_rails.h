@@ -0,0 +1,106 @@
+#ifndef _WORKER_RAILS_H_
+#define _WORKER_RAILS_H_
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// A rail is one NIC port (interface + address) the worker can send on.
+// Threads, and with them their slot ranges, are striped across rails:
+// thread `tid` starts on rail tid % rails. A rail that fails is skipped and
+// its threads move their in-flight chunks to the next rail that is up.
+struct Rail {
+  std::string Iface;
+  std::string IP;
+  std::atomic<bool> Up{true};
+
+  std::atomic<uint64_t> TxPackets{0};
+  std::atomic<uint64_t> TxBytes{0};
+  std::atomic<uint64_t> RxPackets{0};
+  std::atomic<uint64_t> RxBytes{0};
+  std::atomic<uint64_t> Failovers{0};
+
+  Rail(std::string iface, std::string ip)
+      : Iface(std::move(iface)), IP(std::move(ip)) {}
+
+  void reset() {
+    TxPackets = TxBytes = RxPackets = RxBytes = Failovers = 0;
+  }
+
+  // Link state as reported by the kernel. Interfaces we know nothing about
+  // (e.g. a test setup on loopback) are assumed up.
+  bool linkUp() const {
+    std::ifstream f("/sys/class/net/" + Iface + "/operstate");
+    std::string state;
+    if (!f || !(f >> state))
+      return true;
+    return state != "down";
+  }
+};
+
+class Rails {
+public:
+  // `spec` is a comma separated list of iface[:ip]. Rails without an ip
+  // use `defaultIp`; an empty spec is a single rail on `defaultIface`.
+  void parse(const std::string &spec, const std::string &defaultIface,
+             const std::string &defaultIp) {
+    for (auto *r : rails)
+      delete r;
+    rails.clear();
+    std::istringstream iss(spec);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+      if (item.empty())
+        continue;
+      auto colon = item.find(':');
+      rails.emplace_back(new Rail(item.substr(0, colon),
+                                  colon == std::string::npos
+                                      ? defaultIp
+                                      : item.substr(colon + 1)));
+    }
+    if (rails.empty())
+      rails.emplace_back(new Rail(defaultIface, defaultIp));
+  }
+
+  ~Rails() {
+    for (auto *r : rails)
+      delete r;
+  }
+
+  size_t size() const { return rails.size(); }
+  Rail &operator[](size_t i) { return *rails[i]; }
+
+  // Reset counters and pick up link state before a step. A rail that was
+  // failed over stays down for the rest of the run.
+  void refresh() {
+    for (auto *r : rails) {
+      r->reset();
+      r->Up = r->Up && r->linkUp();
+    }
+  }
+
+  // First rail that is up, starting at `from`. Returns size() if none.
+  size_t next(size_t from) const {
+    for (size_t i = 0; i < rails.size(); ++i) {
+      auto r = (from + i) % rails.size();
+      if (rails[r]->Up)
+        return r;
+    }
+    return rails.size();
+  }
+
+  // Errors that mean the rail is gone rather than momentarily busy
+  static bool fatal(int err) {
+    return err == ENETDOWN || err == ENETUNREACH || err == EHOSTUNREACH ||
+           err == ENODEV || err == ENXIO || err == EADDRNOTAVAIL;
+  }
+
+private:
+  std::vector<Rail *> rails;
+};
+
+#endif
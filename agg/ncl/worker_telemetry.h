@@ -0,0 +1,207 @@
+#ifndef _WORKER_TELEMETRY_H_
+#define _WORKER_TELEMETRY_H_
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+// Live counters of a running worker (--telemetry), read by nclagg-top.
+//
+// The worker maps a shared memory segment /dev/shm/nclagg.<port>.<pid>
+// with one cache line aligned slot per thread. A thread counts into private
+// memory and copies its counters into its slot under a seqlock: the
+// sequence is odd while the copy is in progress, so a reader that sees it
+// change (or odd) reads again. Readers never write, so they cannot slow the
+// worker down, and a thread only ever touches its own slot.
+namespace telemetry {
+
+constexpr uint32_t Magic = 0x4e434c54; // "NCLT"
+constexpr uint32_t Version = 1;
+constexpr unsigned MaxThreads = 64;
+
+// Results per receive call: 1, 2-3, 4-7, ..., 128 and more
+constexpr unsigned BatchBuckets = 8;
+
+struct Counters {
+  uint64_t txPackets;
+  uint64_t txBytes;
+  uint64_t rxPackets;
+  uint64_t rxBytes;
+  uint64_t retransmits; // chunks sent again after a rail failed
+  uint64_t emptyPolls;  // receive calls that returned nothing
+  uint64_t syscalls;
+  uint64_t inflight; // slots waiting for their result, right now
+  uint64_t rxBatch[BatchBuckets];
+};
+
+constexpr unsigned Words = sizeof(Counters) / sizeof(uint64_t);
+
+struct alignas(64) Slot {
+  std::atomic<uint32_t> seq;
+  std::atomic<uint64_t> words[Words];
+};
+
+struct Segment {
+  uint32_t magic;
+  uint32_t version;
+  int32_t pid;
+  uint32_t rank;
+  uint32_t world;
+  uint32_t threads;
+  uint32_t window;
+  char datapath[16];
+  std::atomic<uint64_t> step;
+  Slot slots[MaxThreads];
+};
+
+// One per process: two workers on the same port (e.g. one per rank on a
+// host) must not share a segment or unlink each other's
+inline std::string Name(uint16_t port, pid_t pid) {
+  return "/nclagg." + std::to_string(port) + '.' + std::to_string(pid);
+}
+
+// Consistent copy of `slot`, retrying while its writer is busy
+inline Counters Read(const Slot &slot) {
+  Counters c;
+  uint64_t words[Words];
+  while (true) {
+    auto s = slot.seq.load(std::memory_order_acquire);
+    if (s & 1)
+      continue;
+    for (unsigned i = 0; i < Words; ++i)
+      words[i] = slot.words[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) == s)
+      break;
+  }
+  memcpy(&c, words, sizeof(c));
+  return c;
+}
+
+// One thread's counters. Counting is plain arithmetic on private memory,
+// publish() makes them visible.
+class Writer {
+public:
+  Counters c{};
+
+  void batch(unsigned n) {
+    unsigned b = 0;
+    while (n >>= 1)
+      ++b;
+    ++c.rxBatch[b < BatchBuckets ? b : BatchBuckets - 1];
+  }
+
+  void publish() {
+    if (!slot)
+      return;
+    uint64_t words[Words];
+    memcpy(words, &c, sizeof(c));
+    auto s = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (unsigned i = 0; i < Words; ++i)
+      slot->words[i].store(words[i], std::memory_order_relaxed);
+    slot->seq.store(s + 2, std::memory_order_release);
+  }
+
+  // Publish every `every` calls, for paths that spin
+  void tick(unsigned every = 1024) {
+    if (++ticks % every == 0)
+      publish();
+  }
+
+  Slot *slot = nullptr;
+
+private:
+  unsigned ticks = 0;
+};
+
+// The worker side: the segment and a writer per thread. Without open() the
+// writers still count, nothing is published.
+class Telemetry {
+public:
+  ~Telemetry() { close(); }
+
+  bool open(uint16_t port, uint32_t rank, uint32_t world, uint32_t threads,
+            uint32_t window, const std::string &datapath) {
+    close();
+    name = Name(port, getpid());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST) {
+      // Left behind by a process that had our pid before us
+      shm_unlink(name.c_str());
+      fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0)
+      return false;
+    bool ok = ftruncate(fd, sizeof(Segment)) == 0;
+    void *m = ok ? mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0)
+                 : MAP_FAILED;
+    ::close(fd);
+    if (m == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      return false;
+    }
+
+    seg = static_cast<Segment *>(m);
+    memset(static_cast<void *>(seg), 0, sizeof(Segment));
+    seg->version = Version;
+    seg->pid = getpid();
+    seg->rank = rank;
+    seg->world = world;
+    seg->threads = threads;
+    seg->window = window;
+    strncpy(seg->datapath, datapath.c_str(), sizeof(seg->datapath) - 1);
+    // Readers check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    seg->magic = Magic;
+    return true;
+  }
+
+  void close() {
+    if (!seg)
+      return;
+    munmap(seg, sizeof(Segment));
+    shm_unlink(name.c_str());
+    seg = nullptr;
+    for (auto &w : writers)
+      w.slot = nullptr;
+  }
+
+  // Threads beyond MaxThreads count but are not exported
+  Writer &thread(unsigned tid) {
+    if (writers.size() <= tid)
+      writers.resize(tid + 1);
+    auto &w = writers[tid];
+    w.slot = seg && tid < MaxThreads ? &seg->slots[tid] : nullptr;
+    return w;
+  }
+
+  // Size for `threads` before they start, thread() must not reallocate
+  // while they run
+  void reserve(unsigned threads) {
+    if (writers.size() < threads)
+      writers.resize(threads);
+  }
+
+  void step(uint64_t s) {
+    if (seg)
+      seg->step.store(s, std::memory_order_relaxed);
+  }
+
+private:
+  std::string name;
+  Segment *seg = nullptr;
+  std::vector<Writer> writers;
+};
+
+} // namespace telemetry
+
+#endif
@@ -2,10 +2,13 @@
 #define _OPTIONS_H_
 
 #include "popl.h" // https://github.com/badaix/popl
+#include "reduce.h"
 #include <cstdint>
 #include <iostream>
 #include <ostream>
+#include <sstream>
 #include <string>
+#include <vector>
 
 inline void exitWithErrorMessage(const std::string &msg) {
   std::cout << "error: " << msg << '\n';
@@ -24,17 +27,45 @@ public:
   bool Pin;
   bool Connect;
   bool Bind;
+  bool Consume;
+  bool Telemetry;
+  std::string Iface;
+  std::string Rails;
+  unsigned RailTimeout;
+  std::string Rendezvous;
+  bool RendezvousServe;
+  unsigned RendezvousTimeout;
   std::string IP;
   uint16_t Port;
   unsigned Rx;
   unsigned Steps;
   unsigned Warmup;
+  unsigned Pipeline;
   unsigned Rank;
   unsigned World;
   unsigned Threads;
   unsigned Window;
   unsigned Multiplier;
   bool SIMD = false;
+  unsigned PacingRate;
+  std::string Pacing;
+  std::string CC;
+  unsigned RttTarget;
+  std::string Quant;
+  float QuantClip;
+  std::string Op;
+  std::vector<reduce::Op> Ops; // from --op, in the order given
+  std::string Datapath;
+  std::string Dpdk;
+  std::string Backend;
+  std::string Peers;
+  unsigned ProbeTimeout;
+  bool Compare;
+  bool DeviceWorld;
+  std::string Autotune;
+  std::string Profile;
+  std::string DeviceInfo;
+  unsigned DeviceSlots = 0;
   std::string DeviceMac;
   std::string DeviceIp;
   uint16_t DevicePort;
@@ -59,6 +90,7 @@ public:
   uint32_t PacketsPerThread;
 
 private:
+  std::shared_ptr<popl::Value<unsigned>> threadsOpt, windowOpt, rxOpt;
   std::string _deviceMacStr;
   std::string _deviceIpStr;
 
@@ -74,24 +106,38 @@ public:
     parser.add<popl::Value<uint16_t>>("P", "port", "base udp port", 4242,
                                       &Port);
     parser.add<popl::Switch>("", "random", "Generate random data", &Random);
-    parser.add<popl::Value<unsigned>>("j", "threads", "number of threads", 1,
-                                      &Threads);
-    parser.add<popl::Value<unsigned>>("w", "window", "per threads burst window",
-                                      1, &Window);
+    threadsOpt = parser.add<popl::Value<unsigned>>("j", "threads",
+                                                   "number of threads", 1,
+                                                   &Threads);
+    windowOpt = parser.add<popl::Value<unsigned>>(
+        "w", "window", "per threads burst window", 1, &Window);
     parser.add<popl::Value<unsigned>>("s", "steps", "number of steps to run", 1,
                                       &Steps);
 
     parser.add<popl::Value<unsigned>>("", "warmup", "number of warmup steps", 0,
                                       &Warmup);
+    parser.add<popl::Value<unsigned>>(
+        "", "pipeline",
+        "collectives per step, queued back to back on the same slots", 1,
+        &Pipeline);
     parser.add<popl::Value<unsigned>>("", "starting-version",
                                       "override default starting version", 0,
                                       &Multiplier);
     // parser.add<popl::Switch>("", "random", "Generate random values");
     parser.add<popl::Switch>("", "connect", "connect the socket to the device addr/port", &Connect);
-    parser.add<popl::Switch>("", "bind", "Bind to ens4f0", &Bind);
-    parser.add<popl::Value<unsigned>>("r", "rx",
-                                      "number of packets to receive at a time",
-                                      1, &Rx);
+    parser.add<popl::Switch>("", "bind", "Bind to --iface", &Bind);
+    parser.add<popl::Value<std::string>>("", "iface", "interface for --bind",
+                                         "ens4f0", &Iface);
+    parser.add<popl::Value<std::string>>(
+        "", "rails",
+        "stripe threads across iface[:ip],... (ip defaults to -I/--ip)", "",
+        &Rails);
+    parser.add<popl::Value<unsigned>>(
+        "", "rail-timeout", "ms without results before a rail is failed over",
+        200, &RailTimeout);
+    rxOpt = parser.add<popl::Value<unsigned>>(
+        "r", "rx", "number of packets to receive at a time (0: a window)", 1,
+        &Rx);
     parser.add<popl::Value<unsigned>>("m", "multiplier",
                                       "multiply the vector size by this value",
                                       1, &Multiplier);
@@ -105,13 +151,92 @@ public:
                                       4242, &DevicePort);
     parser.add<popl::Switch>("", "simd", "use SIMD whenever possible", &SIMD);
     parser.add<popl::Switch>("", "pin", "ping threads to CPU cores", &Pin);
+    parser.add<popl::Value<unsigned>>("", "pacing-rate",
+                                      "per thread tx rate in Mbps (0: off)", 0,
+                                      &PacingRate);
+    parser.add<popl::Value<std::string>>(
+        "", "pacing", "how to pace: bucket (userspace) or fq (kernel)",
+        "bucket", &Pacing);
+    parser.add<popl::Value<std::string>>(
+        "", "cc", "window control: none, aimd or delay", "none", &CC);
+    parser.add<popl::Value<unsigned>>("", "rtt-target",
+                                      "target result RTT in us for --cc delay",
+                                      0, &RttTarget);
+    parser.add<popl::Value<std::string>>(
+        "", "rendezvous",
+        "host:port of the rendezvous coordinator, barriers every step", "",
+        &Rendezvous);
+    parser.add<popl::Switch>("", "rendezvous-serve",
+                             "also run the coordinator in this worker",
+                             &RendezvousServe);
+    parser.add<popl::Value<unsigned>>(
+        "", "rendezvous-timeout",
+        "seconds to wait at a barrier for the other ranks (0: forever)", 120,
+        &RendezvousTimeout);
+    parser.add<popl::Value<std::string>>(
+        "", "quant", "quantize float data: none, int32, int16 or int8",
+        "none", &Quant);
+    parser.add<popl::Value<float>>("", "quant-clip",
+                                   "largest magnitude to quantize exactly",
+                                   1.0f, &QuantClip);
+    parser.add<popl::Value<std::string>>(
+        "", "op",
+        "reduction: add, max, min, or, and, sadd (saturating); a comma list "
+        "or all runs the steps for each",
+        "add", &Op);
+    parser.add<popl::Value<std::string>>(
+        "", "datapath", "how packets are moved: socket, packet or dpdk",
+        "socket",
+        &Datapath);
+    parser.add<popl::Value<std::string>>("", "dpdk",
+                                         "EAL arguments for --datapath dpdk",
+                                         "", &Dpdk);
+    parser.add<popl::Value<std::string>>(
+        "", "backend",
+        "allreduce on: switch, ring or rd (host only), auto picks at start",
+        "auto", &Backend);
+    parser.add<popl::Value<std::string>>(
+        "", "peers",
+        "ip:port of every worker in rank order, for the host backends "
+        "without --rendezvous",
+        "", &Peers);
+    parser.add<popl::Value<unsigned>>(
+        "", "probe-timeout",
+        "ms to wait for the switch with --backend auto or --device-world",
+        2000, &ProbeTimeout);
+    parser.add<popl::Switch>(
+        "", "device-world",
+        "tell the device the worker count of our slots at start "
+        "(allreduce.ncl)",
+        &DeviceWorld);
+    parser.add<popl::Switch>(
+        "", "compare", "also run the steps on the host backends, report speedup",
+        &Compare);
+    parser.add<popl::Value<std::string>>(
+        "", "device-info",
+        "ncrt info of the device kernel, to check slots against", "",
+        &DeviceInfo);
+    parser.add<popl::Value<std::string>>(
+        "", "autotune",
+        "search -j (up to the given one), -w and -r and save them here", "",
+        &Autotune);
+    parser.add<popl::Value<std::string>>(
+        "", "profile", "take -j, -w and -r from an --autotune profile", "",
+        &Profile);
+    parser.add<popl::Switch>(
+        "", "telemetry", "export live counters for nclagg-top", &Telemetry);
+    parser.add<popl::Switch>("", "consume",
+                             "consume reduced chunks as soon as they land",
+                             &Consume);
   }
 
   void parse(int argc, char **argv) {
     parser.parse(argc, argv);
 
-    if (Rank == 0)
-      exitWithErrorMessage("-R/--rank must be > 0");
+    if (Rank == 0 && Rendezvous.empty())
+      exitWithErrorMessage("-R/--rank must be > 0 (or 0 with --rendezvous)");
+    if (RendezvousServe && Rendezvous.empty())
+      exitWithErrorMessage("--rendezvous-serve requires --rendezvous");
     if (World == 0)
       exitWithErrorMessage("-W/--world must be > 0");
     if (Threads == 0)
@@ -120,9 +245,61 @@ public:
       exitWithErrorMessage("-w/--window must be > 0");
     if (Steps == 0)
       exitWithErrorMessage("-s/--steps must be > 0");
+    if (Pipeline == 0)
+      exitWithErrorMessage("--pipeline must be > 0");
     if (Multiplier == 0)
       exitWithErrorMessage("--multiplier must be > 0");
+    if (Pacing != "bucket" && Pacing != "fq")
+      exitWithErrorMessage("--pacing must be one of bucket, fq");
+    if (CC != "none" && CC != "aimd" && CC != "delay")
+      exitWithErrorMessage("--cc must be one of none, aimd, delay");
+    if (CC == "delay" && RttTarget == 0)
+      exitWithErrorMessage("--cc delay requires --rtt-target");
+    if (Quant != "none" && Quant != "int32" && Quant != "int16" &&
+        Quant != "int8")
+      exitWithErrorMessage("--quant must be one of none, int32, int16, int8");
+    if (!(QuantClip > 0))
+      exitWithErrorMessage("--quant-clip must be > 0");
+    if (!parseOps())
+      exitWithErrorMessage(
+          "--op must be all or a list of add, max, min, or, and, sadd");
+    if (Quant != "none" &&
+        (Ops.size() > 1 || (Ops[0] != reduce::Add && Ops[0] != reduce::SatAdd)))
+      exitWithErrorMessage("--quant only adds, use --op add or sadd");
+    if (Quant != "none" && Quant != "int32" && Ops[0] == reduce::SatAdd)
+      exitWithErrorMessage("--op sadd saturates 32-bit values, use --quant "
+                           "int32");
+    if (DeviceWorld && (World < 2 || World > 32))
+      exitWithErrorMessage("--device-world supports 2 to 32 workers");
+    if (Quant == "int8" && World > 16)
+      exitWithErrorMessage("--quant int8 leaves no range for more than 16 workers");
+    if (Datapath != "socket" && Datapath != "packet" && Datapath != "dpdk")
+      exitWithErrorMessage("--datapath must be one of socket, packet, dpdk");
+    if (Datapath != "socket" && Rails.find(',') != std::string::npos)
+      exitWithErrorMessage("--rails needs --datapath socket");
+    if (Backend != "auto" && Backend != "switch" && Backend != "ring" &&
+        Backend != "rd")
+      exitWithErrorMessage("--backend must be one of auto, switch, ring, rd");
+    if (Compare && (Backend == "ring" || Backend == "rd"))
+      exitWithErrorMessage("--compare runs the switch first, use --backend "
+                           "auto or switch");
 
+    derive();
+  }
+
+  // Take -j, -w and -r from a profile, unless they were given
+  void defaults(unsigned threads, unsigned window, unsigned rx) {
+    if (!threadsOpt->is_set())
+      Threads = threads;
+    if (!windowOpt->is_set())
+      Window = window;
+    if (!rxOpt->is_set())
+      Rx = rx;
+    derive();
+  }
+
+  // Sizes that follow from threads, window and multiplier
+  void derive() {
     Reducers = 32;
     Slots = Threads * Window;
     Aggregators = Slots * 2;
@@ -132,6 +309,37 @@ public:
     PacketsPerThread = Size / Threads / ValuesPerPacket;
   }
 
+  bool parseOps() {
+    Ops.clear();
+    if (Op == "all") {
+      for (unsigned i = 0; i < reduce::NumOps; ++i)
+        Ops.push_back(static_cast<reduce::Op>(i));
+      return true;
+    }
+    std::istringstream iss(Op);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+      reduce::Op op;
+      if (!reduce::Parse(item, op))
+        return false;
+      Ops.push_back(op);
+    }
+    return !Ops.empty();
+  }
+
+  // Resolved to one of the host-only backends
+  bool hostBackend() const { return Backend == "ring" || Backend == "rd"; }
+
+  uint64_t PacingRateBytes() const {
+    return static_cast<uint64_t>(PacingRate) * 1000000 / 8;
+  }
+
+  // Allow a full window of `packetBytes` packets to leave back-to-back,
+  // but no more
+  uint64_t PacingBurstBytes(size_t packetBytes) const {
+    return static_cast<uint64_t>(Window) * packetBytes;
+  }
+
   int help(std::ostream &o = std::cout) {
     o << this->parser;
     return 0;
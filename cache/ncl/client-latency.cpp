@@ -22,8 +22,8 @@ enum cache_op : uint8_t {
   PUT_RS,
   DEL_RQ,
   DEL_RS,
-  UDP_RQ,
-  UDP_RS
+  UPD_RQ,
+  UPD_RS
 };
 
 const unsigned NCP_HEADER_SIZE = 8;
@@ -11,6 +11,7 @@
 #include <netinet/in.h>
 #include <ostream>
 #include <random>
+#include <string>
 #include <sys/socket.h>
 
 #include "client_utils.h"
@@ -22,8 +23,8 @@ enum cache_op : uint8_t {
   PUT_RS,
   DEL_RQ,
   DEL_RS,
-  UDP_RQ,
-  UDP_RS
+  UPD_RQ,
+  UPD_RS
 };
 
 const unsigned NCP_HEADER_SIZE = 8;
@@ -54,11 +55,36 @@ struct __attribute__((packed)) ncl_h {
   char __pad[CACHELINE - NCL_HEADER_SIZE];
 };
 
+// Values longer than cache_h.v go in fragments, see server.cpp
+const unsigned CACHELINE_WORDS = 4; // see cache.cpp
+const unsigned VALUE_SIZE = CACHELINE_WORDS * sizeof(uint32_t);
+const unsigned FRAGMENT_SIZE = 1024;
+const unsigned MAX_FRAGMENTS = 8;
+const unsigned MAX_VALUE_SIZE = FRAGMENT_SIZE * MAX_FRAGMENTS;
+const uint32_t VALUE_FRAGMENT = 1u << 31;
+const uint32_t STORE_FULL = 1u << 30;
+
+const unsigned VALUE_HEADER_SIZE = 12;
+struct __attribute__((packed)) value_h {
+  uint32_t len;   // of the whole value
+  uint32_t off;   // of this fragment in it
+  uint16_t bytes; // in this fragment
+  uint16_t frags; // of the whole value
+};
+
+// What follows ncl_h in a fragment
+struct __attribute__((packed)) fragment {
+  value_h value;
+  char data[FRAGMENT_SIZE];
+};
+
 struct statistics {
   uint32_t queries;
+  uint32_t lost; // no reply within --timeout
   uint64_t duration;
   std::ostream &print(std::ostream &o = std::cout) {
     o << "numqueries: " << queries << '\n';
+    o << "      lost: " << lost << '\n';
     o << "  duration: " << duration << '\n';
     return o;
   }
@@ -90,6 +116,80 @@ void createGetRequest(cache_h &c, uint64_t key) {
   createCachePacket(c, key, nullptr, cache_op::GET_RQ);
 }
 
+void createPutRequest(cache_h &c, uint64_t key, uint32_t *val) {
+  uint32_t v[4];
+  for (auto i = 0; i < 4; ++i)
+    v[i] = htonl(val[i]);
+  createCachePacket(c, key, v, cache_op::PUT_RQ);
+}
+
+void createDelRequest(cache_h &c, uint64_t key) {
+  createCachePacket(c, key, nullptr, cache_op::DEL_RQ);
+}
+
+// Sends a PUT_RQ of `value`, longer than VALUE_SIZE, one fragment at a time
+void sendLongPut(int soc, sockaddr_in const &server, ncl_h &p, uint64_t key,
+                 std::string const &value) {
+  createCachePacket(p.cache, key, nullptr, cache_op::PUT_RQ,
+                    htonl(VALUE_FRAGMENT));
+  fragment f;
+  uint32_t len = value.size();
+  uint32_t count = (len + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t off = i * FRAGMENT_SIZE;
+    uint32_t bytes = std::min(FRAGMENT_SIZE, len - off);
+    f.value = {htonl(len), htonl(off), uint16_t(htons(bytes)),
+               uint16_t(htons(count))};
+    std::memcpy(f.data, value.data() + off, bytes);
+    iovec iov[2] = {{&p, NCL_HEADER_SIZE}, {&f, VALUE_HEADER_SIZE + bytes}};
+    msghdr m = {};
+    m.msg_name = (void *)&server;
+    m.msg_namelen = sizeof(server);
+    m.msg_iov = iov;
+    m.msg_iovlen = 2;
+    sendmsg(soc, &m, 0);
+  }
+}
+
+// Waits at most `ms` for each datagram on `soc`, 0 for ever
+void setReceiveTimeout(int soc, uint32_t ms) {
+  timeval tv = {time_t(ms / 1000), suseconds_t(ms % 1000 * 1000)};
+  setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// Receives a reply into `q` and, if it is a long value, all its fragments
+// into `value`. Returns the size of the first datagram, as recvfrom(), -1
+// if none came within the socket's receive timeout or a long value did
+// not: a fragment was lost, or they do not make up a value.
+ssize_t recvReply(int soc, ncl_h &q, std::string &value) {
+  fragment f;
+  iovec iov[2] = {{&q, NCL_HEADER_SIZE}, {&f, sizeof(f)}};
+  msghdr m = {};
+  m.msg_iov = iov;
+  m.msg_iovlen = 2;
+  auto recvd = recvmsg(soc, &m, 0);
+  if (recvd < NCL_HEADER_SIZE + VALUE_HEADER_SIZE ||
+      !(ntohl(q.cache.mask) & VALUE_FRAGMENT))
+    return recvd;
+
+  uint16_t frags = ntohs(f.value.frags);
+  if (frags == 0 || frags > MAX_FRAGMENTS)
+    return -1;
+  value.assign(std::min(ntohl(f.value.len), MAX_VALUE_SIZE), 0);
+  uint32_t have = 0, all = (1u << frags) - 1;
+  for (;;) {
+    uint32_t off = ntohl(f.value.off), bytes = ntohs(f.value.bytes);
+    if (off + bytes <= value.size()) {
+      std::memcpy(&value[off], f.data, bytes);
+      have |= 1u << (off / FRAGMENT_SIZE);
+    }
+    if (have == all)
+      return recvd;
+    if (recvmsg(soc, &m, 0) < NCL_HEADER_SIZE + VALUE_HEADER_SIZE)
+      return -1;
+  }
+}
+
 static options opt;
 
 std::ostream &log(uint32_t tid, std::ostream &o = std::cout) {
@@ -125,10 +225,12 @@ void interactive_client(uint32_t tid, std::string serverAddr,
              << '\n';
     return;
   }
+  setReceiveTimeout(soc, opt.Timeout);
 
   std::string line;
   log(tid)
-      << "Enter keys (look at data.txt for inspiration) or type 'q' to quit:"
+      << "Enter keys (look at data.txt for inspiration), key=value to put, "
+         "-key to delete or type 'q' to quit:"
       << std::endl;
 
   // cache_h p = {}, q = {};
@@ -140,8 +242,7 @@ void interactive_client(uint32_t tid, std::string serverAddr,
   p.ncp.h_src = opt.NclID;
   p.ncp.h_dst = 4;
 
-  sockaddr_in incaddrr;
-  socklen_t inclen = sizeof(sockaddr_in);
+  std::string longValue;
 
   while (true) {
     // Read a line from standard input
@@ -153,7 +254,18 @@ void interactive_client(uint32_t tid, std::string serverAddr,
       break;
     }
 
-    if (line.size() > 8) {
+    auto op = cache_op::GET_RQ;
+    std::string value;
+    if (auto pos = line.find('='); pos != std::string::npos) {
+      op = cache_op::PUT_RQ;
+      value = line.substr(pos + 1);
+      line.resize(pos);
+    } else if (!line.empty() && line[0] == '-') {
+      op = cache_op::DEL_RQ;
+      line.erase(0, 1);
+    }
+
+    if (line.size() > 8 || value.size() > MAX_VALUE_SIZE) {
       std::cout << "err: input too long\n";
       continue;
     }
@@ -161,16 +273,40 @@ void interactive_client(uint32_t tid, std::string serverAddr,
     uint64_t k = 0;
     strncpy((char *)&k, line.data(), line.size());
 
-    createGetRequest(p.cache, k);
-
     auto tStart = std::chrono::high_resolution_clock::now();
-    sendto(soc, &p, NCL_HEADER_SIZE, 0, (sockaddr *)&server, sizeof(server));
-    recvfrom(soc, &q, NCL_HEADER_SIZE, 0, (sockaddr *)&incaddrr, &inclen);
+    if (op == cache_op::PUT_RQ && value.size() > VALUE_SIZE) {
+      sendLongPut(soc, server, p, k, value);
+    } else if (op == cache_op::PUT_RQ) {
+      uint32_t v[4] = {0};
+      strncpy((char *)v, value.data(), value.size());
+      createPutRequest(p.cache, k, v);
+    } else if (op == cache_op::DEL_RQ) {
+      createDelRequest(p.cache, k);
+    } else {
+      createGetRequest(p.cache, k);
+    }
+    if (op != cache_op::PUT_RQ || value.size() <= VALUE_SIZE)
+      sendto(soc, &p, NCL_HEADER_SIZE, 0, (sockaddr *)&server,
+             sizeof(server));
+    auto recvd = recvReply(soc, q, longValue);
     auto tEnd = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(tEnd - tStart).count();
 
-    if (q.cache.op == cache_op::GET_RQ)
+    if (recvd < 0)
+      std::cout << "  no reply " << "(" << duration << "us)\n";
+    else if (q.cache.op == cache_op::PUT_RS)
+      std::cout << "  key stored " << "(" << duration << "us)\n";
+    else if (q.cache.op == cache_op::DEL_RS)
+      std::cout << "  key deleted " << "(" << duration << "us)\n";
+    else if (q.cache.op == cache_op::PUT_RQ)
+      std::cout << "  put failed"
+                << (ntohl(q.cache.mask) & STORE_FULL ? ", store full " : " ")
+                << "(" << duration << "us)\n";
+    else if (q.cache.op != cache_op::GET_RS)
       std::cout << "  key not found " << "(" << duration << "us)\n";
+    else if (ntohl(q.cache.mask) & VALUE_FRAGMENT)
+      std::cout << "  key found with value (" << longValue.size()
+                << " bytes): " << longValue << "(" << duration << "us)\n";
     else {
       q.cache.v[0] = ntohl(q.cache.v[0]);
       q.cache.v[1] = ntohl(q.cache.v[1]);
@@ -213,15 +349,20 @@ void client(uint32_t tid, std::string serverAddr, uint16_t serverPort,
              << '\n';
     return;
   }
+  setReceiveTimeout(soc, opt.Timeout);
 
-  sockaddr_in incaddrr;
-  socklen_t inclen = sizeof(sockaddr_in);
+  std::string value; // long ones
   // cache_h p;
   // cache_h q;
 
   auto tStart = std::chrono::high_resolution_clock::now();
 
-  ncl_h p, q;
+  ncl_h p = {}, q = {};
+
+  p.ncp.cid = 1;
+  p.ncp.d_dst = 1;
+  p.ncp.h_src = opt.NclID;
+  p.ncp.h_dst = 4;
 
   for (auto &k : keys) {
     createGetRequest(p.cache, k);
@@ -230,18 +371,21 @@ void client(uint32_t tid, std::string serverAddr, uint16_t serverPort,
 #ifdef DEBUG
     log(tid) << "query key: " << k << '\n';
 #endif
-    int recvd =
-        recvfrom(soc, &q, NCL_HEADER_SIZE, 0, (sockaddr *)&incaddrr, &inclen);
+    int recvd = recvReply(soc, q, value);
 #ifdef DEBUG
     log(tid) << "received: " << recvd << "bytes\n";
 #endif
+    if (recvd < 0) {
+      ++stats.lost;
+      continue;
+    }
     q.cache.v[0] = ntohl(q.cache.v[0]);
     q.cache.v[1] = ntohl(q.cache.v[1]);
     q.cache.v[2] = ntohl(q.cache.v[2]);
     q.cache.v[3] = ntohl(q.cache.v[3]);
 
 #ifdef DEBUG
-    uint64_t keyin = q.cache.key;
+    uint64_t keyin = be64toh(q.cache.key);
     char key[9];
     char val[17];
     memset(key, 0, 9);
@@ -269,12 +413,12 @@ void loadKeys(const char *f, std::vector<uint64_t> &keys) {
   }
   std::string line;
   while (std::getline(file, line)) {
-    std::size_t pos = line.find_first_of('=');
-    if (pos == std::string::npos)
-      continue; // Skip lines without '='
-    std::string keyStr = line.substr(0, pos);
+    // key=value (data.txt) or a key per line (kv-gen key lists)
+    std::string keyStr = line.substr(0, line.find_first_of('='));
+    if (keyStr.empty())
+      continue;
     uint64_t key = 0;
-    std::strncpy((char *)&key, keyStr.c_str(), keyStr.size());
+    std::strncpy((char *)&key, keyStr.c_str(), std::min<size_t>(keyStr.size(), 8));
     keys.push_back(key);
   }
   file.close();
@@ -290,20 +434,34 @@ int main(int argc, char **argv) {
   } else {
 
     std::vector<uint64_t> keys;
-    std::string dataTxt = GetExecutableDir().append("/data.txt");
-    loadKeys(dataTxt.c_str(), keys);
-
     std::vector<std::vector<uint64_t>> threadKeys(opt.Threads);
 
-    for (size_t i = 0; i < opt.Threads; ++i) {
+    if (!opt.Keys.empty()) {
+      // A generated workload: played as is, each thread its share in order
+      loadKeys(opt.Keys.c_str(), keys);
+      if (keys.size() < opt.Threads)
+        exitWithErrorMessage("fewer keys than threads in " + opt.Keys);
+      auto share = keys.size() / opt.Threads;
+      for (size_t i = 0; i < opt.Threads; ++i) {
+        threadKeys[i].reserve(share * opt.Multiplier);
+        for (auto j = 0; j < opt.Multiplier; ++j)
+          threadKeys[i].insert(threadKeys[i].end(), keys.begin() + i * share,
+                               keys.begin() + (i + 1) * share);
+      }
+    } else {
+      std::string dataTxt = GetExecutableDir().append("/data.txt");
+      loadKeys(dataTxt.c_str(), keys);
+
+      for (size_t i = 0; i < opt.Threads; ++i) {
 
-      threadKeys[i].reserve(keys.size() * opt.Multiplier);
+        threadKeys[i].reserve(keys.size() * opt.Multiplier);
 
-      std::default_random_engine rng(opt.Seed + i);
+        std::default_random_engine rng(opt.Seed + i);
 
-      for (auto j = 0; j < opt.Multiplier; ++j) {
-        std::shuffle(keys.begin(), keys.end(), rng);
-        threadKeys[i].insert(threadKeys[i].end(), keys.begin(), keys.end());
+        for (auto j = 0; j < opt.Multiplier; ++j) {
+          std::shuffle(keys.begin(), keys.end(), rng);
+          threadKeys[i].insert(threadKeys[i].end(), keys.begin(), keys.end());
+        }
       }
     }
 
@@ -341,5 +499,11 @@ int main(int argc, char **argv) {
     std::cout << std::fixed << std::setprecision(3);
     std::cout << "Total throughput: " << totalThroughput
               << " queries per second\n";
+    uint64_t lost = 0;
+    for (auto &s : stats)
+      lost += s.lost;
+    if (lost > 0)
+      std::cout << "Lost: " << lost << " queries without a reply within "
+                << opt.Timeout << "ms\n";
   }
 }
\ No newline at end of file
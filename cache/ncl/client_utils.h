@@ -34,6 +34,8 @@ public:
   std::string DeviceIp;
   uint16_t DevicePort;
   uint32_t Seed;
+  std::string Keys;
+  uint32_t Timeout;
 
 #if defined(__AVX2__)
   bool AVX2Available = true;
@@ -71,6 +73,11 @@ public:
         "m", "multiplier", "multiply the number of queries per thread", 1,
         &Multiplier);
     parser.add<popl::Value<uint32_t>>("", "seed", "set a seed", 1234321, &Seed);
+    parser.add<popl::Value<std::string>>(
+        "", "keys", "key list to play instead of data.txt (see kv-gen)", "",
+        &Keys);
+    parser.add<popl::Value<uint32_t>>(
+        "", "timeout", "ms to wait for a reply, 0 for ever", 1000, &Timeout);
     parser.add<popl::Switch>("i", "interactive", "run in interactive mode",
                              &Interactive);
   }
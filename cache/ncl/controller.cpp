@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <endian.h>
+#include <iomanip>
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "popl.h" // https://github.com/badaix/popl
+#include "server_utils.h"
+#include "switch_tables.h"
+
+// Keeps the device caching the keys that are hot now.
+//
+// The device counts the GETs it misses and flags the first one of a key
+// past its threshold (`hot`, see heavy_hitter() in cache.cpp); the server
+// reports those keys to the controller (HOT_RQ). Every --interval the
+// controller reads the hits of each cache line (Stats0/Stats1), gives
+// lines that had fewer than --threshold to the keys reported since, and
+// resets the device's sketch, so keys are counted anew. A key gets a line
+// of its own, all its words (values that fit the device, see server.cpp):
+// the controller installs its Index and Bitmap entries, invalid, and asks
+// the server for its value (POP_RQ), which the server sends the device as
+// an UPD_RQ, as it does after a PUT. A PUT that comes after the entries
+// invalidates them and revalidates them with its own UPD_RQ. At most
+// --window POP_RQs are out at once, the server takes them between its
+// clients' requests.
+//
+// The tables are a SwitchTables. With --local they are a LocalTables,
+// which also stands in for the device: it listens on --device-port and
+// does what the kernel does to the packets there, requests that it does
+// not answer go on to the server, and the server's replies back.
+
+const unsigned NCL_HEADER_SIZE = 38; // ncp_h + cache_h, see server.cpp
+const unsigned MAX_PACKET_SIZE = 2048; // fragments of long values included
+const uint8_t GET_RQ = 1, GET_RS = 2, UPD_RQ = 7, HOT_RQ = 9, POP_RQ = 10,
+              POP_RS = 11;
+const uint32_t VALUE_FRAGMENT = 1u << 31;
+const uint32_t VALUE_MASK = (1 << SwitchTables::CachelineWords) - 1;
+
+// Offsets in ncl_h
+const unsigned D_DST = 3, CID = 4, KEY = 8, VALUE = 16, OP = 32, MASK = 33,
+               HOT = 37, VALUE_LEN = 38, VALUE_OFF = 42, VALUE_BYTES = 46;
+
+template <typename T> static T field(const char *p, unsigned off) {
+  T v;
+  std::memcpy(&v, p + off, sizeof(v));
+  return v;
+}
+
+template <typename T> static void setField(char *p, unsigned off, T v) {
+  std::memcpy(p + off, &v, sizeof(v));
+}
+
+// Whether a packet is a whole request or reply, or the last fragment of
+// one, see value_h in server.cpp
+static bool last(const char *p, ssize_t n) {
+  if (!(ntohl(field<uint32_t>(p, MASK)) & VALUE_FRAGMENT) ||
+      n < VALUE_BYTES + 2)
+    return true;
+  return ntohl(field<uint32_t>(p, VALUE_OFF)) +
+             ntohs(field<uint16_t>(p, VALUE_BYTES)) ==
+         ntohl(field<uint32_t>(p, VALUE_LEN));
+}
+
+static std::ostream &log() { return std::cout << "[controller] "; }
+
+// Which key has which cache line
+class HotCache {
+public:
+  using Key = SwitchTables::Key;
+
+  HotCache(SwitchTables &tables, uint32_t lines, uint32_t threshold)
+      : tables(tables), threshold(threshold), keys(lines), since(lines),
+        used(lines) {
+    for (uint32_t l = lines; l-- > 0;)
+      free.push_back(l);
+  }
+
+  void report(Key k) {
+    if (!lines.count(k))
+      reported.insert(k);
+  }
+
+  // The server has no value the device can hold for `k`
+  void drop(Key k) {
+    auto it = lines.find(k);
+    if (it == lines.end())
+      return;
+    tables.remove(k);
+    used[it->second] = false;
+    free.push_back(it->second);
+    lines.erase(it);
+  }
+
+  struct Epoch {
+    uint64_t hits = 0;
+    size_t reported = 0, evicted = 0;
+    std::vector<Key> installed; // their values are for the server to send
+  };
+
+  Epoch epoch() {
+    Epoch e;
+    tables.takeStats(stats0, stats1);
+    ++current;
+
+    // Lines that gave way would have, coldest first. Not those installed
+    // during the last interval: they did not have a whole one to count.
+    std::vector<std::pair<uint32_t, uint32_t>> cold;
+    for (uint32_t l = 0; l < keys.size(); ++l) {
+      uint32_t hits = stats0[l] + stats1[l];
+      e.hits += hits;
+      if (used[l] && since[l] < current - 1 && hits < threshold)
+        cold.push_back({hits, l});
+    }
+    std::sort(cold.begin(), cold.end());
+
+    e.reported = reported.size();
+    auto next = cold.begin();
+    for (auto k : reported) {
+      uint32_t l;
+      if (!free.empty()) {
+        l = free.back();
+        free.pop_back();
+      } else if (next != cold.end()) {
+        l = (next++)->second;
+        tables.remove(keys[l]);
+        lines.erase(keys[l]);
+        ++e.evicted;
+      } else {
+        break; // reported again if it stays hot
+      }
+      keys[l] = k;
+      since[l] = current;
+      used[l] = true;
+      lines[k] = l;
+      tables.install(k, l, VALUE_MASK);
+      e.installed.push_back(k);
+    }
+    reported.clear();
+    tables.resetSketch();
+    return e;
+  }
+
+  size_t size() const { return lines.size(); }
+  size_t capacity() const { return keys.size(); }
+
+private:
+  SwitchTables &tables;
+  uint32_t threshold;
+  uint64_t current = 1;
+  std::vector<Key> keys;
+  std::vector<uint64_t> since; // the epoch a line got its key
+  std::vector<bool> used;
+  std::vector<uint32_t> free;
+  std::unordered_map<Key, uint32_t> lines;
+  std::unordered_set<Key> reported;
+  std::vector<uint32_t> stats0, stats1;
+};
+
+static int bindUdp(std::string const &ip, uint16_t port) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(ip.c_str());
+  addr.sin_port = htons(port);
+  auto soc = socket(AF_INET, SOCK_DGRAM, 0);
+  if (soc < 0 || bind(soc, (sockaddr *)&addr, sizeof(addr)) < 0)
+    exitWithErrorMessage("bind socket to " + ip + "." + std::to_string(port));
+  int rcvbuf = 1 << 22; // the server's reports come in bursts
+  setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  return soc;
+}
+
+int main(int argc, char **argv) {
+  bool help, local;
+  std::string ip, serverIp, deviceIp;
+  uint16_t port, serverPort, devicePort;
+  uint32_t interval, threshold, hotThreshold, lines, window;
+
+  popl::OptionParser parser;
+  parser.add<popl::Switch>("h", "help", "print this help message", &help);
+  parser.add<popl::Value<std::string>>("I", "ip", "the controller's ip",
+                                       "127.0.0.1", &ip);
+  parser.add<popl::Value<uint16_t>>(
+      "P", "port", "udp port for the server's reports", 4343, &port);
+  parser.add<popl::Value<std::string>>("", "server-ip", "server IPv4 address",
+                                       "42.0.0.4", &serverIp);
+  parser.add<popl::Value<uint16_t>>("", "server-port", "server UDP port", 4242,
+                                    &serverPort);
+  parser.add<popl::Value<uint32_t>>(
+      "", "interval", "milliseconds between two rounds of changes", 1000,
+      &interval);
+  parser.add<popl::Value<uint32_t>>(
+      "", "threshold",
+      "hits per interval under which a line gives way to a hot key",
+      SwitchTables::HotThreshold, &threshold);
+  parser.add<popl::Value<uint32_t>>(
+      "", "hot-threshold", "misses that make a key hot (--local, HH_THRESH)",
+      SwitchTables::HotThreshold, &hotThreshold);
+  parser.add<popl::Value<uint32_t>>("", "lines", "cache lines to use",
+                                    SwitchTables::CacheLines, &lines);
+  parser.add<popl::Value<uint32_t>>(
+      "", "window", "POP_RQs waiting for the server at most", 32, &window);
+  parser.add<popl::Switch>("", "local", "stand in for the device", &local);
+  parser.add<popl::Value<std::string>>("", "device-ip",
+                                       "device IPv4 address (--local)",
+                                       "127.0.0.1", &deviceIp);
+  parser.add<popl::Value<uint16_t>>("", "device-port",
+                                    "device UDP port (--local)", 4242,
+                                    &devicePort);
+  parser.parse(argc, argv);
+  if (help) {
+    std::cout << parser;
+    return 0;
+  }
+  if (lines == 0 || lines > SwitchTables::CacheLines)
+    exitWithErrorMessage("--lines must be in [1, " +
+                         std::to_string(SwitchTables::CacheLines) + "]");
+  if (interval == 0 || window == 0)
+    exitWithErrorMessage("--interval and --window must be > 0");
+  if (!local)
+    // The bfrt tables of cache.cpp live on the switch's CPU, see
+    // bfrt-cli-asic.py; a SwitchTables over them (BF Runtime, from the
+    // SDE) plugs in here
+    exitWithErrorMessage("only --local tables are available");
+
+  LocalTables tables(hotThreshold);
+  HotCache cache(tables, lines, threshold);
+
+  sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = inet_addr(serverIp.c_str());
+  server.sin_port = htons(serverPort);
+
+  int ctl = bindUdp(ip, port);
+  int dev = local ? bindUdp(deviceIp, devicePort) : -1;
+  log() << "reports on " << ip << '.' << port << ", " << cache.capacity()
+        << " lines, every " << interval << "ms"
+        << (local ? " | device on " + deviceIp + '.' +
+                        std::to_string(devicePort)
+                  : "")
+        << '\n';
+
+  std::vector<char> p(MAX_PACKET_SIZE);
+
+  // Requests the device passed on to the server, by key, who to send the
+  // replies to, oldest first. One per request, a fragmented PUT counts
+  // when its last fragment goes. Those the server does not answer within
+  // an interval or two (a fragment got lost) are let go.
+  struct waiting {
+    sockaddr_in to;
+    uint64_t epoch;
+  };
+  std::unordered_map<uint64_t, std::deque<waiting>> pending;
+  uint64_t epochs = 0;
+  uint64_t gets = 0, hits = 0, pops = 0, failed = 0;
+  // Keys whose values the server is yet to send the device, and how many
+  // it was asked for and did not answer yet
+  std::deque<uint64_t> populate;
+  uint32_t out = 0;
+  auto pop = [&]() {
+    for (; out < window && !populate.empty(); ++out) {
+      std::memset(p.data(), 0, NCL_HEADER_SIZE);
+      p[CID] = 1;
+      setField(p.data(), KEY, htobe64(populate.front()));
+      p[OP] = POP_RQ;
+      populate.pop_front();
+      sendto(ctl, p.data(), NCL_HEADER_SIZE, 0, (sockaddr *)&server,
+             sizeof(server));
+    }
+  };
+
+  auto next = std::chrono::steady_clock::now() +
+              std::chrono::milliseconds(interval);
+  for (;;) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= next) {
+      auto e = cache.epoch();
+      // Those still out after an interval are lost
+      out = 0;
+      populate.insert(populate.end(), e.installed.begin(), e.installed.end());
+      pop();
+      log() << std::fixed << std::setprecision(1) << e.reported
+            << " hot, " << e.installed.size() << " in, " << e.evicted
+            << " out, " << cache.size() << '/' << cache.capacity()
+            << " lines | " << e.hits << " hits";
+      if (local)
+        std::cout << " of " << gets << " GETs ("
+                  << (gets ? 100.0 * hits / gets : 0) << "%)";
+      std::cout << " | " << pops << " values sent, " << failed
+                << " not cacheable\n";
+      gets = hits = pops = failed = 0;
+      ++epochs;
+      for (auto it = pending.begin(); it != pending.end();) {
+        auto &q = it->second;
+        while (!q.empty() && q.front().epoch + 1 < epochs)
+          q.pop_front();
+        it = q.empty() ? pending.erase(it) : std::next(it);
+      }
+      next += std::chrono::milliseconds(interval);
+      continue;
+    }
+
+    pollfd fds[2] = {{ctl, POLLIN, 0}, {dev, POLLIN, 0}};
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    next - now)
+                    .count();
+    if (poll(fds, local ? 2 : 1, int(wait) + 1) <= 0)
+      continue;
+
+    sockaddr_in from;
+    socklen_t len = sizeof(from);
+
+    // From the server: hot keys, and replies to our POP_RQs
+    if (fds[0].revents & POLLIN) {
+      auto n = recvfrom(ctl, p.data(), p.size(), MSG_DONTWAIT,
+                        (sockaddr *)&from, &len);
+      if (n >= NCL_HEADER_SIZE) {
+        if (p[OP] == HOT_RQ) {
+          cache.report(be64toh(field<uint64_t>(p.data(), KEY)));
+        } else if (p[OP] == POP_RS) {
+          ++pops;
+          out -= out > 0;
+          pop();
+        } else if (p[OP] == POP_RQ) {
+          // failed
+          cache.drop(be64toh(field<uint64_t>(p.data(), KEY)));
+          ++failed;
+          out -= out > 0;
+          pop();
+        }
+      }
+    }
+
+    if (!local || !(fds[1].revents & POLLIN))
+      continue;
+    len = sizeof(from);
+    auto n = recvfrom(dev, p.data(), p.size(), MSG_DONTWAIT,
+                      (sockaddr *)&from, &len);
+    if (n < NCL_HEADER_SIZE)
+      continue;
+
+    if (p[D_DST] == 0) {
+      // A reply of the server, to a request we passed on. A long value
+      // comes in fragments, the last one completes it.
+      auto it = pending.find(be64toh(field<uint64_t>(p.data(), KEY)));
+      if (it == pending.end() || it->second.empty())
+        continue;
+      sendto(dev, p.data(), n, 0, (sockaddr *)&it->second.front().to,
+             sizeof(sockaddr_in));
+      if (last(p.data(), n))
+        it->second.pop_front();
+      if (it->second.empty())
+        pending.erase(it);
+      continue;
+    }
+
+    // The kernel
+    uint64_t key = be64toh(field<uint64_t>(p.data(), KEY));
+    uint32_t val[SwitchTables::CachelineWords];
+    std::memcpy(val, &p[VALUE], sizeof(val));
+    uint8_t op = p[OP];
+    uint32_t mask = 0;
+    bool hot = p[HOT];
+    gets += op == GET_RQ;
+    switch (tables.query(key, val, op, mask, hot)) {
+    case LocalTables::Reflect:
+      hits += op == GET_RS;
+      std::memcpy(&p[VALUE], val, sizeof(val));
+      p[OP] = op;
+      setField(p.data(), MASK, htonl(mask));
+      sendto(dev, p.data(), n, 0, (sockaddr *)&from, sizeof(from));
+      break;
+    case LocalTables::Forward:
+      p[HOT] = hot;
+      if (op == UPD_RQ) { // for a key the device does not cache
+        sendto(dev, p.data(), n, 0, (sockaddr *)&from, sizeof(from));
+        break;
+      }
+      if (last(p.data(), n))
+        pending[key].push_back({from, epochs});
+      sendto(dev, p.data(), n, 0, (sockaddr *)&server, sizeof(server));
+      break;
+    case LocalTables::Drop:
+      break;
+    }
+  }
+}
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "kv_store.h"
+#include "kv_table.h"
+#include "popl.h" // https://github.com/badaix/popl
+#include "server_utils.h"
+
+// Lookup throughput of the server's store, KvTable against the
+// std::unordered_map it replaced, for several key counts and load factors.
+// Keys are random 64-bit values; hits look up stored keys in random
+// order, misses keys that were never stored. The table runs at the
+// capacity it would have for each key count, filled to each --load.
+//
+// Then the shared KvStore holding the same keys, hits one by one with
+// get() and in batches of --batch with multiGet(). The gain of multiGet
+// shows once the table no longer fits in the last level cache.
+
+static std::vector<double> parseList(const std::string &s) {
+  std::vector<double> v;
+  std::istringstream iss(s);
+  std::string item;
+  while (std::getline(iss, item, ','))
+    v.push_back(std::stod(item));
+  return v;
+}
+
+// Resident memory in bytes
+static size_t rss() {
+  size_t pages = 0, resident = 0;
+  std::ifstream("/proc/self/statm") >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+template <typename F> static double mops(size_t n, F &&f) {
+  auto t0 = std::chrono::steady_clock::now();
+  f();
+  auto t1 = std::chrono::steady_clock::now();
+  return n / std::chrono::duration<double, std::micro>(t1 - t0).count();
+}
+
+int main(int argc, char **argv) {
+  bool help;
+  std::string keyCounts, loads;
+  size_t lookups, batch;
+
+  popl::OptionParser parser;
+  parser.add<popl::Switch>("h", "help", "print this help message", &help);
+  parser.add<popl::Value<std::string>>("n", "keys", "key counts, comma list",
+                                       "100000,1000000,10000000", &keyCounts);
+  parser.add<popl::Value<std::string>>(
+      "", "load", "KvTable load factors, comma list", "0.25,0.5,0.75,0.85",
+      &loads);
+  parser.add<popl::Value<size_t>>("l", "lookups", "lookups per measurement",
+                                  10000000, &lookups);
+  parser.add<popl::Value<size_t>>("b", "batch", "keys per multiGet", 32,
+                                  &batch);
+  parser.parse(argc, argv);
+  if (help) {
+    std::cout << parser;
+    return 0;
+  }
+
+  uint32_t rng = 42;
+  auto next32 = [&] { return rng = xorshift32(uint32_t(rng)); };
+  auto next64 = [&] {
+    uint64_t hi = next32();
+    return hi << 32 | next32();
+  };
+
+  std::cout << std::fixed << std::setprecision(1);
+  for (auto n : parseList(keyCounts)) {
+    size_t count = n;
+    // Same capacity for every load: the one n keys would get, filled to
+    // each load factor
+    size_t cap = KvTable(0).capacity();
+    while (cap * 7 < count * 8)
+      cap *= 2;
+    std::vector<uint64_t> keys(std::max(count, cap)), hits(lookups),
+        misses(lookups);
+    for (auto &k : keys)
+      k = next64() | 1; // stored keys are odd, misses even
+    for (auto &k : hits)
+      k = keys[next32() % count];
+    for (auto &k : misses)
+      k = next64() & ~1ULL;
+
+    uint64_t sum = 0;
+    auto probe = [&](auto &store, const std::vector<uint64_t> &ks) {
+      return mops(ks.size(), [&] {
+        for (auto k : ks)
+          if (auto *v = store.find(k))
+            sum += (*v)[0];
+      });
+    };
+
+    {
+      auto before = rss();
+      std::unordered_map<uint64_t, std::array<uint32_t, 4>> map;
+      map.reserve(count);
+      for (size_t i = 0; i < count; ++i)
+        map[keys[i]] = {uint32_t(keys[i]), 0, 0, 0};
+      auto mb = (rss() - before) / 1048576.0;
+      auto find = [&](const std::vector<uint64_t> &ks) {
+        return mops(ks.size(), [&] {
+          for (auto k : ks)
+            if (auto it = map.find(k); it != map.end())
+              sum += it->second[0];
+        });
+      };
+      auto hit = find(hits), miss = find(misses);
+      std::cout << "[bench] keys " << count << " | unordered_map"
+                << " | hit " << hit << " Mops/s, miss " << miss
+                << " Mops/s | " << mb << " MB\n";
+    }
+
+    for (auto lf : parseList(loads)) {
+      size_t stored = std::min(keys.size(), static_cast<size_t>(cap * lf));
+      KvTable table(cap);
+      for (size_t i = 0; i < stored; ++i)
+        table.insert(keys[i], {uint32_t(keys[i]), 0, 0, 0});
+      std::vector<uint64_t> some(lookups);
+      for (auto &k : some)
+        k = keys[next32() % stored];
+      auto hit = probe(table, some), miss = probe(table, misses);
+      std::cout << "[bench] keys " << stored << " | KvTable load "
+                << std::setprecision(2) << table.load() << std::setprecision(1)
+                << " | hit " << hit << " Mops/s, miss " << miss << " Mops/s | "
+                << table.bytes() / 1048576.0 << " MB\n";
+    }
+
+    {
+      KvStore store(count);
+      for (size_t i = 0; i < count; ++i)
+        store.put(keys[i], {uint32_t(keys[i]), 0, 0, 0});
+      KvStore::Value v;
+      auto get = mops(hits.size(), [&] {
+        for (auto k : hits)
+          if (store.get(k, v))
+            sum += v[0];
+      });
+      std::vector<KvStore::Value> out(batch);
+      std::unique_ptr<bool[]> found(new bool[batch]);
+      auto multi = mops(hits.size(), [&] {
+        for (size_t b = 0; b < hits.size(); b += batch) {
+          auto m = std::min(batch, hits.size() - b);
+          store.multiGet(&hits[b], m, out.data(), found.get());
+          for (size_t i = 0; i < m; ++i)
+            sum += found[i] ? out[i][0] : 0;
+        }
+      });
+      std::cout << "[bench] keys " << count << " | KvStore load "
+                << std::setprecision(2) << store.load() << std::setprecision(1)
+                << " | get " << get << " Mops/s, multiGet " << multi
+                << " Mops/s (batch " << batch << ") | "
+                << store.bytes() / 1048576.0 << " MB\n";
+    }
+
+    // keeps the lookups from being optimized away
+    if (sum == 42)
+      std::cout << '\n';
+  }
+}
@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "kv_store.h"
+#include "popl.h" // https://github.com/badaix/popl
+#include "server_utils.h"
+
+// Synthetic datasets for the server and matching key lists for the
+// clients, generated by -j threads.
+//
+// Keys are 8 characters, as the store holds them: `seq` numbers them in
+// order (k0000000, k0000001, ...), `random` spreads them over [0-9A-Za-z]
+// without repeats. Values are --value-min to --value-max characters. Key
+// i and its value depend only on i and --seed, not on the thread count.
+//
+// --text writes key=value lines (as data.txt), --snapshot a store
+// snapshot (server --snapshot), which holds values of up to 16 characters
+// only: the server keeps longer ones apart, loaded from data.txt.
+//
+// --clients N writes N key lists, one key per line (client --keys), of
+// --requests keys each: a --hot-share of them from a hot subset of --hot
+// of the keys, the rest from all keys.
+
+static const unsigned MaxValue = 8192; // see server.cpp
+
+static const char Alnum[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  return x ^ (x >> 33);
+}
+
+struct generator {
+  size_t keys;
+  bool random;
+  uint32_t valueMin, valueMax;
+  uint64_t seed;
+
+  // A bijection of the 47-bit numbers (62^8 > 2^47), so random keys never
+  // repeat: odd multiplies and xor-shifts, all invertible mod 2^47
+  static uint64_t scramble(uint64_t x) {
+    constexpr uint64_t Mask = (1ULL << 47) - 1;
+    x = (x * 0x9e3779b97f4a7c15ULL) & Mask;
+    x ^= x >> 23;
+    x = (x * 0xd6e8feb86659fd93ULL) & Mask;
+    return x ^ (x >> 21);
+  }
+
+  void key(size_t i, char *k) const {
+    if (random) {
+      uint64_t x = scramble(i ^ (seed & ((1ULL << 47) - 1)));
+      for (int c = 0; c < 8; ++c, x /= 62)
+        k[c] = Alnum[x % 62];
+    } else {
+      k[0] = 'k';
+      for (int c = 7; c > 0; --c, i /= 10)
+        k[c] = '0' + i % 10;
+    }
+  }
+
+  size_t value(size_t i, char *v) const {
+    uint64_t r = mix(i + seed * 0x9e3779b97f4a7c15ULL);
+    size_t len = valueMin + r % (valueMax - valueMin + 1);
+    for (size_t c = 0; c < len; ++c) {
+      if (c % 8 == 0)
+        r = mix(r + c);
+      v[c] = Alnum[(r >> (c % 8 * 8)) % 62];
+    }
+    return len;
+  }
+};
+
+static double since(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0)
+      .count();
+}
+
+// Runs f(t) on `threads` threads
+template <typename F> static void parallel(unsigned threads, F &&f) {
+  std::vector<std::thread> ts;
+  for (unsigned t = 0; t < threads; ++t)
+    ts.emplace_back(f, t);
+  for (auto &t : ts)
+    t.join();
+}
+
+static int create(const std::string &f) {
+  int fd = open(f.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    exitWithErrorMessage(f + ": " + strerror(errno));
+  return fd;
+}
+
+static void writeAll(int fd, const std::string &s, off_t off,
+                     const std::string &f) {
+  for (size_t done = 0; done < s.size();) {
+    auto n = pwrite(fd, s.data() + done, s.size() - done, off + done);
+    if (n <= 0)
+      exitWithErrorMessage(f + ": " + strerror(errno));
+    done += n;
+  }
+}
+
+// The lines of [0, n) in chunks: each thread formats one chunk of a round
+// in memory, then all write theirs at their offset in the file
+template <typename F>
+static void writeLines(const std::string &f, size_t n, unsigned threads,
+                       F &&format) {
+  constexpr size_t Chunk = 1 << 20; // lines
+  int fd = create(f);
+  std::vector<std::string> bufs(threads);
+  off_t off = 0;
+  for (size_t round = 0; round < n; round += Chunk * threads) {
+    parallel(threads, [&](unsigned t) {
+      bufs[t].clear();
+      size_t first = std::min(n, round + t * Chunk),
+             last = std::min(n, first + Chunk);
+      for (size_t i = first; i < last; ++i)
+        format(i, bufs[t]);
+    });
+    std::vector<off_t> offs(threads);
+    for (unsigned t = 0; t < threads; ++t) {
+      offs[t] = off;
+      off += bufs[t].size();
+    }
+    parallel(threads, [&](unsigned t) { writeAll(fd, bufs[t], offs[t], f); });
+  }
+  close(fd);
+}
+
+int main(int argc, char **argv) {
+  bool help;
+  double millions, hot, hotShare;
+  std::string keyFormat, text, snapshot, clientPrefix;
+  uint32_t valueMin, valueMax, threads, clients, seed;
+  size_t requests, capacity;
+
+  popl::OptionParser parser;
+  parser.add<popl::Switch>("h", "help", "print this help message", &help);
+  parser.add<popl::Value<double>>("n", "keys", "number of keys, in millions",
+                                  1, &millions);
+  parser.add<popl::Value<std::string>>("", "key-format", "seq or random",
+                                       "random", &keyFormat);
+  parser.add<popl::Value<uint32_t>>("", "value-min", "shortest value", 4,
+                                    &valueMin);
+  parser.add<popl::Value<uint32_t>>("", "value-max", "longest value", 16,
+                                    &valueMax);
+  parser.add<popl::Value<std::string>>("", "text", "write key=value lines",
+                                       "", &text);
+  parser.add<popl::Value<std::string>>("", "snapshot", "write a snapshot", "",
+                                       &snapshot);
+  parser.add<popl::Value<size_t>>(
+      "", "capacity", "snapshot room for keys (default twice the keys)", 0,
+      &capacity);
+  parser.add<popl::Value<uint32_t>>("", "clients", "number of key lists", 0,
+                                    &clients);
+  parser.add<popl::Value<std::string>>("", "client-prefix",
+                                       "key lists are <prefix>.<i>", "keys",
+                                       &clientPrefix);
+  parser.add<popl::Value<size_t>>("", "requests", "keys per key list",
+                                  1000000, &requests);
+  parser.add<popl::Value<double>>("", "hot", "fraction of keys that are hot",
+                                  0.01, &hot);
+  parser.add<popl::Value<double>>(
+      "", "hot-share", "fraction of requests for hot keys", 0.9, &hotShare);
+  parser.add<popl::Value<uint32_t>>("j", "threads", "number of threads",
+                                    std::thread::hardware_concurrency(),
+                                    &threads);
+  parser.add<popl::Value<uint32_t>>("", "seed", "set a seed", 1234321, &seed);
+  parser.parse(argc, argv);
+  if (help) {
+    std::cout << parser;
+    return 0;
+  }
+
+  generator gen = {size_t(millions * 1e6), keyFormat == "random", valueMin,
+                   valueMax, seed};
+  if (keyFormat != "seq" && keyFormat != "random")
+    exitWithErrorMessage("--key-format must be seq or random");
+  if (gen.keys == 0 || (!gen.random && gen.keys > 10000000))
+    exitWithErrorMessage("-n/--keys must be > 0, and at most 10 for seq");
+  if (valueMin == 0 || valueMin > valueMax || valueMax > MaxValue)
+    exitWithErrorMessage("values must be 1 to " + std::to_string(MaxValue) +
+                         " characters, min <= max");
+  if (!snapshot.empty() && valueMax > sizeof(KvStore::Value))
+    exitWithErrorMessage("--snapshot takes values of up to 16 characters");
+  if (hot <= 0 || hot > 1 || hotShare < 0 || hotShare > 1)
+    exitWithErrorMessage("--hot must be in (0, 1], --hot-share in [0, 1]");
+  if (text.empty() && snapshot.empty() && clients == 0)
+    exitWithErrorMessage("nothing to write, see --text, --snapshot, --clients");
+  threads = std::max(1u, threads);
+
+  std::cout << std::fixed << std::setprecision(2);
+
+  if (!text.empty()) {
+    auto t0 = std::chrono::steady_clock::now();
+    writeLines(text, gen.keys, threads, [&](size_t i, std::string &out) {
+      char line[8 + 1 + MaxValue + 1];
+      gen.key(i, line);
+      line[8] = '=';
+      auto len = gen.value(i, line + 9);
+      line[9 + len] = '\n';
+      out.append(line, 10 + len);
+    });
+    std::cout << "info: wrote " << gen.keys << " keys to " << text << " in "
+              << since(t0) << "s\n";
+  }
+
+  if (!snapshot.empty()) {
+    auto t0 = std::chrono::steady_clock::now();
+    KvStore kvs(std::max(capacity, gen.keys * 2));
+    parallel(threads, [&](unsigned t) {
+      for (size_t i = t; i < gen.keys; i += threads) {
+        uint64_t k = 0;
+        KvStore::Value v = {0, 0, 0, 0};
+        gen.key(i, reinterpret_cast<char *>(&k));
+        gen.value(i, reinterpret_cast<char *>(v.data()));
+        kvs.put(k, v);
+      }
+    });
+    std::string error;
+    if (!kvs.save(snapshot, threads, error))
+      exitWithErrorMessage(error);
+    std::cout << "info: wrote " << kvs.size() << " keys to " << snapshot
+              << ", " << kvs.bytes() / 1048576.0 << " MB in " << since(t0)
+              << "s\n";
+  }
+
+  if (clients > 0) {
+    auto t0 = std::chrono::steady_clock::now();
+    size_t hotKeys = std::max<size_t>(1, gen.keys * hot);
+    // Hot key j is key j * stride, spread over all keys; the stride is
+    // coprime with the key count so hot keys are distinct
+    size_t stride = 2654435761ULL % gen.keys;
+    auto gcd = [](size_t a, size_t b) {
+      while (b)
+        a %= b, std::swap(a, b);
+      return a;
+    };
+    while (stride == 0 || gcd(stride, gen.keys) != 1)
+      ++stride;
+    for (uint32_t c = 0; c < clients; ++c) {
+      uint64_t state = mix(seed + c + 1);
+      auto f = clientPrefix + "." + std::to_string(c);
+      writeLines(f, requests, threads, [&](size_t r, std::string &out) {
+        uint64_t x = mix(state + r);
+        double u = (x >> 11) * 0x1.0p-53;
+        x = mix(x);
+        size_t i = u < hotShare ? (x % hotKeys) * stride % gen.keys
+                                : x % gen.keys;
+        char line[9];
+        gen.key(i, line);
+        line[8] = '\n';
+        out.append(line, 9);
+      });
+    }
+    std::cout << "info: wrote " << clients << " key lists of " << requests
+              << " keys to " << clientPrefix << ".*, " << hotKeys
+              << " hot keys with " << hotShare * 100 << "% of requests in "
+              << since(t0) << "s\n";
+  }
+}
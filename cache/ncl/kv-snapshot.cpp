@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "kv_store.h"
+#include "kv_table.h"
+#include "popl.h" // https://github.com/badaix/popl
+#include "server_utils.h"
+
+// Converts the server's text dataset (key=value lines, as data.txt) to a
+// store snapshot the server maps at startup (--snapshot). Keys are the
+// first 8 bytes of the key, as server.cpp's loadKvs() reads them. Values
+// longer than the 16 bytes of a store slot are left out: the server keeps
+// them apart, loaded from data.txt.
+
+static double since(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0)
+      .count();
+}
+
+// One pass over the whole file in memory, no per line allocation. Returns
+// the number of values too long for the store.
+static size_t parseKvs(const std::string &text, KvTable &kvs) {
+  size_t skipped = 0;
+  const char *p = text.data(), *end = p + text.size();
+  while (p < end) {
+    auto *nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    auto *eol = nl ? nl : end;
+    auto *eq = static_cast<const char *>(std::memchr(p, '=', eol - p));
+    if (eq && size_t(eol - eq - 1) > sizeof(KvTable::Value)) {
+      ++skipped;
+    } else if (eq) {
+      uint64_t key = 0;
+      KvTable::Value value = {0, 0, 0, 0};
+      std::memcpy(&key, p, std::min<size_t>(eq - p, sizeof(key)));
+      std::memcpy(value.data(), eq + 1, eol - eq - 1);
+      kvs.insert(key, value);
+    }
+    p = eol + 1;
+  }
+  return skipped;
+}
+
+int main(int argc, char **argv) {
+  bool help, verify;
+  std::string input, output;
+  size_t capacity;
+  uint32_t threads;
+
+  popl::OptionParser parser;
+  parser.add<popl::Switch>("h", "help", "print this help message", &help);
+  parser.add<popl::Value<std::string>>("i", "input", "text dataset",
+                                       "data.txt", &input);
+  parser.add<popl::Value<std::string>>("o", "output", "snapshot to write",
+                                       "data.kvs", &output);
+  parser.add<popl::Value<size_t>>(
+      "", "capacity", "keys the store has room for (default twice the loaded)",
+      0, &capacity);
+  parser.add<popl::Value<uint32_t>>("j", "threads", "writer threads", 4,
+                                    &threads);
+  parser.add<popl::Switch>("", "verify", "map the snapshot back and compare",
+                           &verify);
+  parser.parse(argc, argv);
+  if (help) {
+    std::cout << parser;
+    return 0;
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  std::ifstream file(input, std::ios::binary);
+  if (!file)
+    exitWithErrorMessage("could not open " + input);
+  std::string text((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  KvTable data;
+  auto skipped = parseKvs(text, data);
+  text = std::string();
+  std::cout << "info: parsed " << data.size() << " keys in " << std::fixed
+            << std::setprecision(2) << since(t0) << "s\n";
+  if (skipped)
+    std::cout << "info: left out " << skipped
+              << " values longer than 16 bytes\n";
+
+  t0 = std::chrono::steady_clock::now();
+  KvStore kvs(std::max<size_t>(capacity, data.size() * 2));
+  data.forEach([&](uint64_t k, const KvTable::Value &v) { kvs.put(k, v); });
+  std::string error;
+  if (!kvs.save(output, threads, error))
+    exitWithErrorMessage(error);
+  std::cout << "info: wrote " << output << ", " << kvs.size()
+            << " keys, room for " << kvs.capacity() * 7 / 8 << ", "
+            << kvs.bytes() / 1048576.0 << " MB in " << since(t0) << "s\n";
+
+  if (verify) {
+    t0 = std::chrono::steady_clock::now();
+    auto mapped = KvStore::open(output, error);
+    if (!mapped)
+      exitWithErrorMessage(error);
+    std::cout << "info: mapped in " << std::setprecision(6) << since(t0)
+              << "s\n";
+    size_t bad = mapped->size() != data.size();
+    data.forEach([&](uint64_t k, const KvTable::Value &v) {
+      KvStore::Value got;
+      bad += !mapped->get(k, got) || got != v;
+    });
+    if (bad)
+      exitWithErrorMessage(std::to_string(bad) + " keys differ");
+    std::cout << "info: verified " << data.size() << " keys\n";
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef _KV_BLOBS_H_
+#define _KV_BLOBS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include "kv_table.h"
+
+// The server's values longer than the 16 bytes a KvStore slot (and a
+// device cache line) holds, up to a few KB, by key.
+//
+// Shards of a hash map, each behind a reader/writer lock. A value is never
+// changed in place: put() replaces it, and a reader keeps the one it got
+// alive for as long as it sends it.
+//
+// A key is in the store or here, never both. A write that moves a key
+// from one to the other (its value changes length) holds writer(key)
+// and adds the new value before it removes the old one. A reader that
+// misses in the store and then here may have missed a key on its way
+// from here to the store, and looks in the store again.
+class KvBlobs {
+public:
+  using Key = KvTable::Key;
+  using Blob = std::shared_ptr<const std::string>;
+
+  KvBlobs() : shards(new Shard[Shards]), writers(new std::mutex[Shards]) {}
+
+  // The value of `k`, nullptr if it has none
+  Blob get(Key k) const {
+    auto &s = shard(k);
+    std::shared_lock<std::shared_mutex> guard(s.lock);
+    auto it = s.map.find(k);
+    return it == s.map.end() ? nullptr : it->second;
+  }
+
+  void put(Key k, std::string v) {
+    auto blob = std::make_shared<const std::string>(std::move(v));
+    auto &s = shard(k);
+    std::unique_lock<std::shared_mutex> guard(s.lock);
+    auto &slot = s.map[k];
+    count += !slot;
+    total += blob->size() - (slot ? slot->size() : 0);
+    slot = std::move(blob);
+  }
+
+  bool erase(Key k) {
+    auto &s = shard(k);
+    std::unique_lock<std::shared_mutex> guard(s.lock);
+    auto it = s.map.find(k);
+    if (it == s.map.end())
+      return false;
+    --count;
+    total -= it->second->size();
+    s.map.erase(it);
+    return true;
+  }
+
+  std::mutex &writer(Key k) {
+    return writers[swiss::hash(k) & (Shards - 1)];
+  }
+
+  size_t size() const { return count; }
+  size_t bytes() const { return total; }
+
+private:
+  static constexpr size_t Shards = 256;
+
+  struct alignas(64) Shard {
+    mutable std::shared_mutex lock;
+    std::unordered_map<Key, Blob> map;
+  };
+
+  Shard &shard(Key k) const {
+    return shards[(swiss::hash(k) >> 8) & (Shards - 1)];
+  }
+
+  std::unique_ptr<Shard[]> shards;
+  std::unique_ptr<std::mutex[]> writers;
+  std::atomic<size_t> count{0}, total{0};
+};
+
+#endif
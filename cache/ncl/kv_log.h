@@ -0,0 +1,426 @@
+#ifndef _KV_LOG_H_
+#define _KV_LOG_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "kv_store.h"
+
+// Append-only log that makes the writes to a KvStore durable.
+//
+// put() and erase() apply a write to the store and queue a record of it;
+// one thread commits the queue (group commit): all records queued since
+// its last commit in one block aligned write, then fdatasync, then the
+// completion of each write, in order. The log is opened with O_DIRECT
+// where the file system allows it. Reads never touch the log, the store
+// is the index: open() replays the log into it once, at startup.
+//
+// The log grows by one record per write, until it holds more than
+// `compact` times the live keys. Then the commit thread rewrites it as
+// one record per live key (a complete log, which replays over an empty
+// store) and goes on appending to that.
+//
+// A write or sync of the log that fails stops the commit thread: writes
+// from then on are applied to the store but never completed, and wait()
+// returns, for the owner to decide what to do.
+class KvLog {
+public:
+  using Key = KvStore::Key;
+  using Value = KvStore::Value;
+  using Done = std::function<void()>;
+
+  // Replays the log at `path` (created if missing) into `store`, then
+  // logs its writes. nullptr and `error` set on failure.
+  static std::unique_ptr<KvLog> open(const std::string &path, KvStore &store,
+                                     unsigned compact, std::string &error) {
+    std::unique_ptr<KvLog> log(new KvLog(path, store, compact));
+    if (!log->replay(error) || !log->openForAppend(path, error))
+      return nullptr;
+    log->committer = std::thread(&KvLog::commitLoop, log.get());
+    return log;
+  }
+
+  ~KvLog() {
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      stop = true;
+    }
+    ready.notify_one();
+    broken.notify_all();
+    if (committer.joinable())
+      committer.join();
+    if (fd >= 0)
+      close(fd);
+    std::free(buffer);
+  }
+
+  // KvStore::put(), `done` runs once the write is on disk. Not called if
+  // the store is full.
+  KvStore::Result put(Key k, const Value &v, Done done) {
+    std::lock_guard<std::mutex> guard(stripe(k));
+    auto r = store.put(k, v);
+    if (r != KvStore::Full)
+      append(record(k, Put, v), std::move(done));
+    return r;
+  }
+
+  // KvStore::erase(), `done` runs once the write is on disk. Not called
+  // if there was no key.
+  bool erase(Key k, Done done) {
+    std::lock_guard<std::mutex> guard(stripe(k));
+    if (!store.erase(k))
+      return false;
+    append(record(k, Del), std::move(done));
+    return true;
+  }
+
+  // Blocks until the log fails, true with `error` set then, or is closed
+  bool wait(std::string &error) {
+    std::unique_lock<std::mutex> lock(mutex);
+    broken.wait(lock, [&] { return stop || !failure.empty(); });
+    error = failure;
+    return !failure.empty();
+  }
+
+  size_t records() const { return logged; }
+  bool direct() const { return isDirect; }
+
+private:
+  static constexpr size_t Block = 4096;
+  static constexpr size_t Stripes = 1024;
+  static constexpr size_t MinCompact = 1 << 16; // records
+  static constexpr char Magic[8] = {'n', 'c', 'l', 'k', 'v', 'l', 0, 1};
+
+  enum Op : uint8_t { End = 0, Put = 1, Del = 2 };
+
+  struct Record {
+    uint64_t key;
+    uint32_t value[4];
+    uint8_t op;
+    uint8_t pad[3];
+    uint32_t check;
+  };
+  static_assert(Block % sizeof(Record) == 0, "records straddle blocks");
+
+  // First block of the file
+  struct Header {
+    char magic[8];
+    uint32_t complete; // replays over an empty store
+  };
+
+  static Record record(Key k, Op op, const Value &v = {}) {
+    Record r{};
+    r.key = k;
+    for (int i = 0; i < 4; ++i)
+      r.value[i] = v[i];
+    r.op = op;
+    return r;
+  }
+
+  static uint32_t checksum(const Record &r) {
+    // FNV-1a of everything but the checksum
+    uint32_t h = 2166136261u;
+    auto *b = reinterpret_cast<const uint8_t *>(&r);
+    for (size_t i = 0; i < offsetof(Record, check); ++i)
+      h = (h ^ b[i]) * 16777619u;
+    return h;
+  }
+
+  KvLog(const std::string &path, KvStore &store, unsigned compact)
+      : path(path), store(store), compact(compact),
+        stripes(new std::mutex[Stripes]) {}
+
+  std::mutex &stripe(Key k) {
+    return stripes[swiss::hash(k) & (Stripes - 1)];
+  }
+
+  void append(Record r, Done &&done) {
+    r.check = checksum(r);
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      if (!failure.empty())
+        return;
+      queued.push_back(r);
+      dones.push_back(std::move(done));
+    }
+    ready.notify_one();
+  }
+
+  bool replay(std::string &error) {
+    int in = ::open(path.c_str(), O_RDONLY);
+    if (in < 0) {
+      if (errno == ENOENT)
+        return true;
+      error = path + ": " + strerror(errno);
+      return false;
+    }
+    Header h = {};
+    auto n = pread(in, &h, sizeof(h), 0);
+    if (n == 0) { // created, never written
+      close(in);
+      return true;
+    }
+    if (n != sizeof(h) || std::memcmp(h.magic, Magic, sizeof(Magic)) != 0) {
+      error = path + ": not a store log";
+      close(in);
+      return false;
+    }
+    if (h.complete)
+      store.clear();
+
+    // Up to the first record that is not whole, a commit cut short
+    std::vector<Record> recs(Block * 256 / sizeof(Record));
+    off_t off = Block;
+    for (bool end = false; !end;) {
+      auto n = pread(in, recs.data(), recs.size() * sizeof(Record), off);
+      if (n <= 0)
+        break;
+      for (size_t i = 0; i < size_t(n) / sizeof(Record); ++i) {
+        auto &r = recs[i];
+        if (r.op == End || r.check != checksum(r)) {
+          end = true;
+          break;
+        }
+        if (r.op == Put && store.put(r.key, {r.value[0], r.value[1],
+                                             r.value[2], r.value[3]}) ==
+                               KvStore::Full) {
+          error = path + ": store full after " + std::to_string(logged) +
+                  " records, room for " +
+                  std::to_string(store.capacity() * 7 / 8) + " keys";
+          close(in);
+          return false;
+        }
+        if (r.op == Del)
+          store.erase(r.key);
+        off += sizeof(Record);
+        ++logged;
+      }
+      end |= size_t(n) < recs.size() * sizeof(Record);
+    }
+    close(in);
+    tail = off;
+    return true;
+  }
+
+  bool openFile(const std::string &file, int flags, std::string &error) {
+    int f = ::open(file.c_str(), flags | O_DIRECT, 0644);
+    isDirect = f >= 0;
+    if (f < 0 && errno == EINVAL) // no O_DIRECT on this file system
+      f = ::open(file.c_str(), flags, 0644);
+    if (f < 0) {
+      error = file + ": " + strerror(errno);
+      return false;
+    }
+    if (fd >= 0)
+      close(fd);
+    fd = f;
+    return true;
+  }
+
+  bool openForAppend(const std::string &file, std::string &error) {
+    if (!openFile(file, O_RDWR | O_CREAT, error))
+      return false;
+    if (posix_memalign(&buffer, Block, bufferBytes = Block * 16) != 0) {
+      error = "out of memory";
+      return false;
+    }
+    std::memset(buffer, 0, bufferBytes);
+    if (tail == 0) {
+      // new log
+      if (!writeHeader(false)) {
+        error = file + ": " + strerror(errno);
+        return false;
+      }
+      tail = Block;
+      if (fdatasync(fd) < 0 || !syncDir(error))
+        return false;
+    } else {
+      // the block the next commit starts in, without what followed the
+      // last whole record: records of a commit cut short, which a later
+      // commit that ends on a block boundary would not overwrite, and
+      // replay would take for its own
+      auto at = tail / Block * Block;
+      if (pread(fd, buffer, Block, at) < 0) {
+        error = file + ": " + strerror(errno);
+        return false;
+      }
+      std::memset(static_cast<char *>(buffer) + tail % Block, 0,
+                  Block - tail % Block);
+      off_t end = tail % Block ? at + Block : tail;
+      if ((tail % Block && pwrite(fd, buffer, Block, at) != Block) ||
+          ftruncate(fd, end) < 0 || fsync(fd) < 0) {
+        error = file + ": " + strerror(errno);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Makes a file created or renamed in the log's directory durable
+  bool syncDir(std::string &error) {
+    auto slash = path.rfind('/');
+    auto dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int d = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    bool ok = d >= 0 && fsync(d) == 0;
+    if (!ok)
+      error = dir + ": " + strerror(errno);
+    if (d >= 0)
+      close(d);
+    return ok;
+  }
+
+  bool writeHeader(bool complete) {
+    std::memset(buffer, 0, Block);
+    Header h = {};
+    std::memcpy(h.magic, Magic, sizeof(Magic));
+    h.complete = complete;
+    std::memcpy(buffer, &h, sizeof(h));
+    bool ok = pwrite(fd, buffer, Block, 0) == Block;
+    std::memset(buffer, 0, Block);
+    return ok;
+  }
+
+  // Appends `n` records at the tail: rewrites the block the tail is in,
+  // then whole blocks, the last one padded with End records
+  bool write(const Record *recs, size_t n) {
+    auto *buf = static_cast<char *>(buffer);
+    while (n > 0) {
+      size_t fill = tail % Block;
+      size_t m = std::min(n, (bufferBytes - fill) / sizeof(Record));
+      std::memcpy(buf + fill, recs, m * sizeof(Record));
+      size_t bytes = fill + m * sizeof(Record);
+      size_t blocks = (bytes + Block - 1) / Block;
+      std::memset(buf + bytes, 0, blocks * Block - bytes);
+      if (pwrite(fd, buf, blocks * Block, tail - fill) !=
+          ssize_t(blocks * Block))
+        return false;
+      tail += m * sizeof(Record);
+      // keep the block the tail is in for the next write
+      if (bytes % Block)
+        std::memmove(buf, buf + bytes / Block * Block, Block);
+      else
+        std::memset(buf, 0, Block);
+      recs += m;
+      n -= m;
+    }
+    return true;
+  }
+
+  void commitLoop() {
+    std::vector<Record> recs;
+    std::vector<Done> done;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&] { return stop || !queued.empty(); });
+        if (queued.empty())
+          return;
+        recs.swap(queued);
+        done.swap(dones);
+      }
+      if (!write(recs.data(), recs.size()))
+        return fail("write");
+      if (fdatasync(fd) < 0)
+        return fail("fdatasync");
+      for (auto &d : done)
+        if (d)
+          d();
+      logged += recs.size();
+      recs.clear();
+      done.clear();
+
+      if (compact && logged > MinCompact &&
+          logged > compact * store.size() && !rewrite())
+        return;
+    }
+  }
+
+  // Replaces the log by one Put per live key. Writes queued meanwhile are
+  // committed after it, so they still win over what it captured.
+  bool rewrite() {
+    auto tmp = path + ".tmp";
+    std::string error;
+    if (!openFile(tmp, O_RDWR | O_CREAT | O_TRUNC, error)) {
+      fail("compact", error);
+      return false;
+    }
+    if (!writeHeader(true)) {
+      fail("compact");
+      return false;
+    }
+    tail = Block;
+    logged = 0;
+    std::vector<Record> recs;
+    recs.reserve(bufferBytes / sizeof(Record));
+    bool ok = true;
+    store.forEach([&](Key k, const Value &v) {
+      Record r = record(k, Put, v);
+      r.check = checksum(r);
+      recs.push_back(r);
+      if (recs.size() == recs.capacity()) {
+        ok = ok && write(recs.data(), recs.size());
+        logged += recs.size();
+        recs.clear();
+      }
+    });
+    if (!ok || !write(recs.data(), recs.size()) || fdatasync(fd) < 0 ||
+        rename(tmp.c_str(), path.c_str()) < 0) {
+      fail("compact");
+      return false;
+    }
+    logged += recs.size();
+    if (!syncDir(error)) {
+      fail("compact", error);
+      return false;
+    }
+    return true;
+  }
+
+  // Stops logging, for wait(). Writes were acknowledged as durable up to
+  // here: nothing safe to do but tell the owner.
+  void fail(const char *what, std::string why = {}) {
+    if (why.empty())
+      why = strerror(errno);
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      failure = std::string(what) + ": " + why;
+      queued.clear();
+      dones.clear();
+    }
+    broken.notify_all();
+  }
+
+  std::string path;
+  KvStore &store;
+  unsigned compact;
+  std::unique_ptr<std::mutex[]> stripes;
+
+  int fd = -1;
+  bool isDirect = false;
+  off_t tail = 0; // end of the last whole record
+  void *buffer = nullptr;
+  size_t bufferBytes = 0;
+  std::atomic<size_t> logged{0};
+
+  std::mutex mutex;
+  std::condition_variable ready, broken;
+  std::string failure;
+  std::vector<Record> queued;
+  std::vector<Done> dones;
+  bool stop = false;
+  std::thread committer;
+};
+
+#endif
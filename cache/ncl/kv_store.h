@@ -0,0 +1,441 @@
+#ifndef _KV_STORE_H_
+#define _KV_STORE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "kv_table.h"
+
+// The server's store, one table shared by all server threads.
+//
+// Same Swiss table layout as KvTable (kv_table.h), at a fixed capacity so
+// that slots never move. Every group of 16 slots has a sequence number,
+// odd while a writer changes the group: readers do not lock, they copy
+// the slot and retry if the number changed meanwhile (seqlock). Writers
+// take a lock per key (striped by the key's home group), so two writes of
+// one key are ordered, and claim the group they change by making its
+// number odd, so writes of different keys into one group are too.
+//
+// The store does not grow: a PUT of a new key fails once it is 7/8 full.
+//
+// save() writes the store to a snapshot file, the table exactly as it is in
+// memory behind a small header, and open() maps one back: a copy-on-write
+// mapping, no parsing and no rehashing, pages load as they are touched.
+class KvStore {
+public:
+  using Key = KvTable::Key;
+  using Value = KvTable::Value;
+  static constexpr size_t Group = swiss::Group;
+
+  enum Result { Inserted, Updated, Full };
+
+  // Room for at least `keys` keys
+  explicit KvStore(size_t keys) {
+    size_t cap = Group;
+    while (cap * 7 < keys * 8)
+      cap *= 2;
+    ownHeads.reset(new Head[cap / Group]);
+    for (size_t g = 0; g < cap / Group; ++g)
+      std::memset(ownHeads[g].ctrl, swiss::Empty, Group);
+    ownSlots.resize(cap);
+    init(ownHeads.get(), ownSlots.data(), cap);
+  }
+
+  ~KvStore() {
+    if (map)
+      munmap(map, mapBytes);
+  }
+
+  KvStore(const KvStore &) = delete;
+  KvStore &operator=(const KvStore &) = delete;
+
+  // Maps the snapshot at `path`, nullptr and `error` set if it is not one
+  static std::unique_ptr<KvStore> open(const std::string &path,
+                                       std::string &error) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    FileHeader h;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      error = path + ": " + strerror(errno);
+      if (fd >= 0)
+        close(fd);
+      return nullptr;
+    }
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        std::memcmp(h.magic, Magic, sizeof(h.magic)) != 0 ||
+        h.capacity < Group || (h.capacity & (h.capacity - 1)) ||
+        size_t(st.st_size) != fileBytes(h.capacity)) {
+      error = path + ": not a store snapshot";
+      close(fd);
+      return nullptr;
+    }
+    auto *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      error = path + ": mmap: " + strerror(errno);
+      return nullptr;
+    }
+    std::unique_ptr<KvStore> store(new KvStore());
+    store->map = p;
+    store->mapBytes = st.st_size;
+    auto *base = static_cast<char *>(p) + sizeof(FileHeader);
+    store->init(reinterpret_cast<Head *>(base),
+                reinterpret_cast<Slot *>(base + h.capacity / Group *
+                                                    sizeof(Head)),
+                h.capacity);
+    store->used = h.used;
+    store->deleted = h.deleted;
+    return store;
+  }
+
+  // Writes a snapshot to `path`, `threads` groups of heads and slots at a
+  // time. Readers and writers go on meanwhile: each group is copied as
+  // seen at one point in time. The file is replaced only once complete.
+  bool save(const std::string &path, unsigned threads,
+            std::string &error) const {
+    auto tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, fileBytes(cap)) < 0) {
+      error = tmp + ": " + strerror(errno);
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+
+    threads = std::max(1u, threads);
+    size_t n = groups + 1, per = (n + threads - 1) / threads;
+    std::vector<size_t> usedBy(threads), deletedBy(threads);
+    std::atomic<bool> failed{false};
+    auto dump = [&](unsigned t) {
+      constexpr size_t Chunk = 4096; // groups per write
+      std::vector<char> hbuf(Chunk * sizeof(Head));
+      std::vector<Slot> sbuf(Chunk * Group);
+      size_t first = std::min(n, t * per), last = std::min(n, first + per);
+      for (size_t g0 = first; g0 < last; g0 += Chunk) {
+        size_t m = std::min(Chunk, last - g0);
+        std::fill(hbuf.begin(), hbuf.end(), 0);
+        for (size_t j = 0; j < m; ++j) {
+          auto *c = hbuf.data() + j * sizeof(Head) + offsetof(Head, ctrl);
+          copyGroup(g0 + j, reinterpret_cast<int8_t *>(c), &sbuf[j * Group]);
+          for (size_t i = 0; i < Group; ++i) {
+            usedBy[t] += c[i] >= 0;
+            deletedBy[t] += c[i] == swiss::Deleted;
+          }
+        }
+        off_t ho = sizeof(FileHeader) + g0 * sizeof(Head);
+        off_t so = sizeof(FileHeader) + n * sizeof(Head) +
+                   g0 * Group * sizeof(Slot);
+        if (pwrite(fd, hbuf.data(), m * sizeof(Head), ho) !=
+                ssize_t(m * sizeof(Head)) ||
+            pwrite(fd, sbuf.data(), m * Group * sizeof(Slot), so) !=
+                ssize_t(m * Group * sizeof(Slot)))
+          failed = true;
+      }
+    };
+    std::vector<std::thread> writers;
+    for (unsigned t = 0; t < threads; ++t)
+      writers.emplace_back(dump, t);
+    for (auto &w : writers)
+      w.join();
+
+    FileHeader h = {};
+    std::memcpy(h.magic, Magic, sizeof(h.magic));
+    h.capacity = cap;
+    for (unsigned t = 0; t < threads; ++t) {
+      h.used += usedBy[t];
+      h.deleted += deletedBy[t];
+    }
+    if (failed || pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        fdatasync(fd) < 0) {
+      error = tmp + ": " + strerror(errno);
+      close(fd);
+      return false;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), path.c_str()) < 0) {
+      error = path + ": " + strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  size_t size() const { return used.load(std::memory_order_relaxed); }
+  size_t capacity() const { return cap; }
+  double load() const { return static_cast<double>(size()) / capacity(); }
+  size_t bytes() const {
+    return (groups + 1) * sizeof(Head) + cap * sizeof(Slot);
+  }
+
+  // Copy of the value of `k` into `v`, false if there is none. Lock-free.
+  bool get(Key k, Value &v) const { return get(k, swiss::hash(k), v); }
+
+  // get() of `n` keys, found[i] tells if out[i] was set. Lookups of a
+  // large table miss the cache twice, on the group's head and on the
+  // slot; here they overlap (group prefetching): the heads of every key in
+  // a batch are prefetched first, then the slots whose byte matches, and
+  // only then is each key looked up.
+  void multiGet(const Key *keys, size_t n, Value *out, bool *found) const {
+    constexpr size_t Batch = 16;
+    uint64_t hs[Batch];
+    for (size_t b = 0; b < n; b += Batch) {
+      size_t m = std::min(Batch, n - b);
+      for (size_t i = 0; i < m; ++i) {
+        hs[i] = swiss::hash(keys[b + i]);
+        size_t g = (hs[i] >> 7) & groups;
+        __builtin_prefetch(&heads[g]);
+      }
+      for (size_t i = 0; i < m; ++i) {
+        size_t g = (hs[i] >> 7) & groups;
+        if (auto c = swiss::match(heads[g].ctrl, hs[i] & 0x7f))
+          __builtin_prefetch(&slots[g * Group + __builtin_ctz(c)]);
+      }
+      for (size_t i = 0; i < m; ++i)
+        found[b + i] = get(keys[b + i], hs[i], out[b + i]);
+    }
+  }
+
+  Result put(Key k, const Value &v) {
+    auto h = swiss::hash(k);
+    std::lock_guard<std::mutex> guard(stripe(h));
+    if (auto i = lookup(k, h); i != npos) {
+      Writer w(*this, i / Group);
+      slots[i].second = v;
+      return Updated;
+    }
+    // Count the key before placing it, so concurrent inserts cannot fill
+    // the table past 7/8
+    auto taken = used.fetch_add(1, std::memory_order_relaxed);
+    if ((taken + deleted.load(std::memory_order_relaxed) + 1) * 8 >
+        capacity() * 7) {
+      used.fetch_sub(1, std::memory_order_relaxed);
+      return Full;
+    }
+    size_t g = (h >> 7) & groups;
+    for (size_t step = 1;; ++step) {
+      Writer w(*this, g);
+      if (auto m = swiss::matchFree(heads[g].ctrl)) {
+        auto i = g * Group + __builtin_ctz(m);
+        if (ctrlAt(i) == swiss::Deleted)
+          deleted.fetch_sub(1, std::memory_order_relaxed);
+        ctrlAt(i) = h & 0x7f;
+        slots[i] = {k, v};
+        return Inserted;
+      }
+      g = (g + step) & groups;
+    }
+  }
+
+  bool erase(Key k) {
+    auto h = swiss::hash(k);
+    std::lock_guard<std::mutex> guard(stripe(h));
+    auto i = lookup(k, h);
+    if (i == npos)
+      return false;
+    {
+      Writer w(*this, i / Group);
+      auto *c = heads[i / Group].ctrl;
+      ctrlAt(i) = swiss::match(c, swiss::Empty) ? swiss::Empty : swiss::Deleted;
+      if (ctrlAt(i) == swiss::Deleted)
+        deleted.fetch_add(1, std::memory_order_relaxed);
+    }
+    used.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Drops every key. Not safe with concurrent readers or writers.
+  void clear() {
+    for (size_t g = 0; g <= groups; ++g)
+      std::memset(heads[g].ctrl, swiss::Empty, Group);
+    used = deleted = 0;
+  }
+
+  // Entries of each group as seen at one point in time
+  template <typename F> void forEach(F &&f) const {
+    int8_t c[Group];
+    Slot copy[Group];
+    for (size_t g = 0; g <= groups; ++g) {
+      copyGroup(g, c, copy);
+      for (size_t i = 0; i < Group; ++i)
+        if (c[i] >= 0)
+          f(copy[i].first, copy[i].second);
+    }
+  }
+
+private:
+  static constexpr size_t npos = ~size_t(0);
+  static constexpr size_t Stripes = 1024;
+  static constexpr char Magic[8] = {'n', 'c', 'l', 'k', 'v', 's', 0, 1};
+  using Slot = std::pair<Key, Value>;
+
+  // Sequence number and control bytes of a group, two to a cache line
+  struct alignas(32) Head {
+    std::atomic<uint32_t> seq{0};
+    int8_t ctrl[Group];
+  };
+
+  struct FileHeader {
+    char magic[8];
+    uint64_t capacity, used, deleted;
+    char pad[32];
+  };
+
+  static size_t fileBytes(size_t capacity) {
+    return sizeof(FileHeader) + capacity / Group * sizeof(Head) +
+           capacity * sizeof(Slot);
+  }
+
+  KvStore() = default;
+
+  void init(Head *h, Slot *s, size_t capacity) {
+    heads = h;
+    slots = s;
+    cap = capacity;
+    groups = cap / Group - 1;
+    stripes.reset(new std::mutex[Stripes]);
+  }
+
+  static void pause() {
+#if defined(__SSE2__)
+    _mm_pause();
+#endif
+  }
+
+  // Holds group `g` odd for the lifetime of the object
+  class Writer {
+  public:
+    Writer(KvStore &s, size_t g) : seq(s.heads[g].seq) {
+      auto v = seq.load(std::memory_order_relaxed);
+      while ((v & 1) || !seq.compare_exchange_weak(v, v + 1,
+                                                   std::memory_order_acquire,
+                                                   std::memory_order_relaxed)) {
+        pause();
+        v = seq.load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    ~Writer() { seq.fetch_add(1, std::memory_order_release); }
+
+  private:
+    std::atomic<uint32_t> &seq;
+  };
+
+  // Control bytes and slots of group `g` as seen at one point in time
+  void copyGroup(size_t g, int8_t *c, Slot *s) const {
+    for (;;) {
+      auto seq = heads[g].seq.load(std::memory_order_acquire);
+      if (seq & 1) {
+        pause();
+        continue;
+      }
+      std::memcpy(c, heads[g].ctrl, Group);
+      std::copy(&slots[g * Group], &slots[(g + 1) * Group], s);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (heads[g].seq.load(std::memory_order_relaxed) == seq)
+        return;
+    }
+  }
+
+  // get() with the hash of `k` already known
+  bool get(Key k, uint64_t h, Value &v) const {
+    int8_t h2 = h & 0x7f;
+    size_t g = (h >> 7) & groups;
+    for (size_t step = 1;; ++step) {
+      bool found, end;
+      for (;;) {
+        auto s = heads[g].seq.load(std::memory_order_acquire);
+        if (s & 1) {
+          pause();
+          continue;
+        }
+        found = end = false;
+        auto *c = heads[g].ctrl;
+        for (auto m = swiss::match(c, h2); m; m &= m - 1) {
+          auto &slot = slots[g * Group + __builtin_ctz(m)];
+          if (slot.first == k) {
+            v = slot.second;
+            found = true;
+            break;
+          }
+        }
+        end = !found && swiss::match(c, swiss::Empty);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (heads[g].seq.load(std::memory_order_relaxed) == s)
+          break;
+      }
+      if (found)
+        return true;
+      if (end)
+        return false;
+      g = (g + step) & groups;
+    }
+  }
+
+  std::mutex &stripe(uint64_t h) { return stripes[(h >> 7) & (Stripes - 1)]; }
+
+  // Slot of `k`. Only called with the key's stripe held, so the slot of
+  // `k` cannot change underneath; writers of other keys can change the
+  // groups on the way, each is read as get() does.
+  size_t lookup(Key k, uint64_t h) const {
+    int8_t h2 = h & 0x7f;
+    size_t g = (h >> 7) & groups;
+    for (size_t step = 1;; ++step) {
+      size_t found;
+      bool end;
+      for (;;) {
+        auto s = heads[g].seq.load(std::memory_order_acquire);
+        if (s & 1) {
+          pause();
+          continue;
+        }
+        found = npos;
+        auto *c = heads[g].ctrl;
+        for (auto m = swiss::match(c, h2); m; m &= m - 1) {
+          auto i = g * Group + __builtin_ctz(m);
+          if (slots[i].first == k) {
+            found = i;
+            break;
+          }
+        }
+        end = found == npos && swiss::match(c, swiss::Empty);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (heads[g].seq.load(std::memory_order_relaxed) == s)
+          break;
+      }
+      if (found != npos || end)
+        return found;
+      g = (g + step) & groups;
+    }
+  }
+
+  int8_t &ctrlAt(size_t i) { return heads[i / Group].ctrl[i % Group]; }
+  int8_t ctrlAt(size_t i) const { return heads[i / Group].ctrl[i % Group]; }
+
+  // Our own memory, or a mapped snapshot
+  std::unique_ptr<Head[]> ownHeads;
+  std::vector<Slot> ownSlots;
+  void *map = nullptr;
+  size_t mapBytes = 0;
+
+  Head *heads = nullptr;
+  Slot *slots = nullptr;
+  std::unique_ptr<std::mutex[]> stripes;
+  size_t cap = 0;
+  size_t groups = 0; // number of groups - 1
+  std::atomic<size_t> used{0}, deleted{0};
+};
+
+#endif
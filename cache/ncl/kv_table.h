@@ -0,0 +1,196 @@
+#ifndef _KV_TABLE_H_
+#define _KV_TABLE_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Open-addressing hash table for the server's store: 8-byte keys, 16-byte
+// values, stored inline with no allocation per entry.
+//
+// Swiss table layout: one control byte per slot, Empty, Deleted or the
+// low 7 bits of the key's hash (H2). The rest of the hash (H1) picks a
+// group of 16 slots; a lookup compares the H2 of the whole group at once
+// (SSE2) and only reads the slots whose byte matches, then moves on to the
+// next group (triangular probing) until it finds one with an empty slot.
+// Capacity is a power of two, at most 7/8 used including deleted slots.
+//
+// KvTable is for one thread; kv_store.h shares the same layout between
+// threads.
+namespace swiss {
+
+constexpr size_t Group = 16;
+constexpr int8_t Empty = -128, Deleted = -2;
+
+inline uint64_t hash(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  return k ^ (k >> 33);
+}
+
+// Bit i set if c[i] == b, for the 16 control bytes at `c`
+inline unsigned match(const int8_t *c, int8_t b) {
+#if defined(__SSE2__)
+  auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(b)));
+#else
+  unsigned m = 0;
+  for (size_t i = 0; i < Group; ++i)
+    m |= (c[i] == b) << i;
+  return m;
+#endif
+}
+
+// Bit i set if c[i] is Empty or Deleted
+inline unsigned matchFree(const int8_t *c) {
+#if defined(__SSE2__)
+  return _mm_movemask_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(c)));
+#else
+  unsigned m = 0;
+  for (size_t i = 0; i < Group; ++i)
+    m |= (c[i] < 0) << i;
+  return m;
+#endif
+}
+
+} // namespace swiss
+
+class KvTable {
+public:
+  using Key = uint64_t;
+  using Value = std::array<uint32_t, 4>;
+  static constexpr size_t Group = swiss::Group;
+
+  explicit KvTable(size_t capacity = 0) { rehash(capacity); }
+
+  size_t size() const { return used; }
+  size_t capacity() const { return ctrl.size(); }
+  double load() const { return static_cast<double>(used) / capacity(); }
+  size_t bytes() const {
+    return ctrl.size() + slots.size() * sizeof(Slot);
+  }
+
+  const Value *find(Key k) const {
+    auto i = lookup(k);
+    return i == npos ? nullptr : &slots[i].second;
+  }
+  Value *find(Key k) {
+    auto i = lookup(k);
+    return i == npos ? nullptr : &slots[i].second;
+  }
+
+  // Insert or overwrite, true if the key is new
+  bool insert(Key k, const Value &v) {
+    if (auto i = lookup(k); i != npos) {
+      slots[i].second = v;
+      return false;
+    }
+    if ((used + deleted + 1) * 8 > capacity() * 7)
+      rehash(used + 1 > capacity() / 2 ? capacity() * 2 : capacity());
+    auto h = hash(k);
+    auto i = freeSlot(h);
+    deleted -= ctrl[i] == Deleted;
+    ctrl[i] = h & 0x7f;
+    slots[i] = {k, v};
+    ++used;
+    return true;
+  }
+
+  bool erase(Key k) {
+    auto i = lookup(k);
+    if (i == npos)
+      return false;
+    // A group that was never full cannot have pushed a probe past it
+    auto g = i & ~(Group - 1);
+    ctrl[i] = match(&ctrl[g], Empty) ? Empty : Deleted;
+    deleted += ctrl[i] == Deleted;
+    --used;
+    return true;
+  }
+
+  // Room for `n` keys without growing
+  void reserve(size_t n) {
+    if (n * 8 > capacity() * 7)
+      rehash(n * 8 / 7 + 1);
+  }
+
+  // At least `n` slots, dropping deleted ones
+  void rehash(size_t n) {
+    size_t cap = Group;
+    while (cap < n)
+      cap *= 2;
+    std::vector<int8_t> oldCtrl(cap, Empty);
+    std::vector<Slot> oldSlots(cap);
+    oldCtrl.swap(ctrl);
+    oldSlots.swap(slots);
+    groups = cap / Group - 1;
+    used = deleted = 0;
+    for (size_t i = 0; i < oldCtrl.size(); ++i)
+      if (oldCtrl[i] >= 0) {
+        auto j = freeSlot(hash(oldSlots[i].first));
+        ctrl[j] = hash(oldSlots[i].first) & 0x7f;
+        slots[j] = oldSlots[i];
+        ++used;
+      }
+  }
+
+  template <typename F> void forEach(F &&f) const {
+    for (size_t i = 0; i < ctrl.size(); ++i)
+      if (ctrl[i] >= 0)
+        f(slots[i].first, slots[i].second);
+  }
+
+  static uint64_t hash(Key k) { return swiss::hash(k); }
+
+private:
+  static constexpr int8_t Empty = swiss::Empty, Deleted = swiss::Deleted;
+  static constexpr size_t npos = ~size_t(0);
+  using Slot = std::pair<Key, Value>;
+
+  static unsigned match(const int8_t *c, int8_t b) {
+    return swiss::match(c, b);
+  }
+  static unsigned matchFree(const int8_t *c) { return swiss::matchFree(c); }
+
+  size_t lookup(Key k) const {
+    auto h = hash(k);
+    int8_t h2 = h & 0x7f;
+    size_t g = (h >> 7) & groups;
+    for (size_t step = 1;; ++step) {
+      auto *c = &ctrl[g * Group];
+      for (auto m = match(c, h2); m; m &= m - 1) {
+        auto i = g * Group + __builtin_ctz(m);
+        if (slots[i].first == k)
+          return i;
+      }
+      if (match(c, Empty))
+        return npos;
+      g = (g + step) & groups;
+    }
+  }
+
+  size_t freeSlot(uint64_t h) const {
+    size_t g = (h >> 7) & groups;
+    for (size_t step = 1;; ++step) {
+      if (auto m = matchFree(&ctrl[g * Group]))
+        return g * Group + __builtin_ctz(m);
+      g = (g + step) & groups;
+    }
+  }
+
+  std::vector<int8_t> ctrl;
+  std::vector<Slot> slots;
+  size_t groups = 0; // number of groups - 1
+  size_t used = 0, deleted = 0;
+};
+
+#endif
@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <endian.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "popl.h" // https://github.com/badaix/popl
+#include "server_utils.h"
+
+// Request rate of the server: GETs for the keys of data.txt, sent in
+// batches with sendmmsg while at most --window per thread are in flight,
+// replies collected with recvmmsg. Reports answered requests per second,
+// in total and per server port, which is one server thread (and one core
+// when pinned, see start_servers.sh). Requests go straight to the server,
+// not through the device.
+//
+// With --value-sizes, one run per size instead: the bench first PUTs
+// --values keys with values of that size, then GETs those. Values longer
+// than 16 bytes come back in fragments (see server.cpp), a reply is
+// answered once its last fragment is in. The server must run without
+// --log, which does not take long values.
+
+const unsigned PACKET_SIZE = 38; // ncp_h + cache_h, see server.cpp
+const unsigned VALUE_HEADER_SIZE = 12;
+const unsigned FRAGMENT_SIZE = 1024;
+const unsigned MAX_VALUE_SIZE = 8 * FRAGMENT_SIZE;
+const unsigned SMALL_VALUE_SIZE = 16;
+const uint32_t VALUE_FRAGMENT = 1u << 31;
+const unsigned RX_SIZE = PACKET_SIZE + VALUE_HEADER_SIZE + FRAGMENT_SIZE;
+const uint8_t GET_RQ = 1, GET_RS = 2, PUT_RQ = 3, PUT_RS = 4;
+
+// ncp_h and cache_h of a request for `key`, without a value
+static void request(char *p, uint64_t key, uint8_t op, uint32_t mask = 0) {
+  std::memset(p, 0, PACKET_SIZE);
+  p[0] = 1; // ncp: h_src
+  p[1] = 4; // h_dst
+  p[4] = 1; // cid
+  key = htobe64(key);
+  std::memcpy(p + 8, &key, sizeof(key));
+  p[8 + 24] = op;
+  mask = htonl(mask);
+  std::memcpy(p + 8 + 25, &mask, sizeof(mask));
+}
+
+template <typename T> static T field(const char *p, unsigned off) {
+  T v;
+  std::memcpy(&v, p + off, sizeof(v));
+  return v;
+}
+
+static std::vector<uint64_t> loadKeys(const char *f) {
+  std::vector<uint64_t> keys;
+  std::ifstream file(f);
+  std::string line;
+  while (std::getline(file, line)) {
+    auto pos = line.find_first_of('=');
+    if (pos == std::string::npos)
+      continue;
+    uint64_t key = 0;
+    std::strncpy((char *)&key, line.c_str(), std::min<size_t>(pos, 8));
+    keys.push_back(key);
+  }
+  return keys;
+}
+
+// PUTs `count` keys with values of `size` bytes from port `port`, one at a
+// time, and returns the keys
+static std::vector<uint64_t> putValues(std::string const &ip, uint16_t port,
+                                       sockaddr_in const &server,
+                                       uint32_t size, uint32_t count) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(ip.c_str());
+  addr.sin_port = htons(port);
+  auto soc = socket(AF_INET, SOCK_DGRAM, 0);
+  if (soc < 0 || bind(soc, (sockaddr *)&addr, sizeof(addr)) < 0)
+    exitWithErrorMessage("bind socket to " + ip + "." + std::to_string(port));
+  timeval timeout = {0, 200000};
+  setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  std::vector<uint64_t> keys;
+  std::vector<char> pkt(RX_SIZE), value(size);
+  for (uint32_t i = 0; i < count; ++i) {
+    // 'v', the size and the index: distinct across sizes
+    uint64_t key = 'v' | uint64_t(size) << 8 | uint64_t(i) << 32;
+    for (uint32_t b = 0; b < size; ++b)
+      value[b] = 'a' + (i + b) % 26;
+    bool done = false;
+    for (int attempt = 0; attempt < 3 && !done; ++attempt) {
+      uint32_t frags = (size + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+      if (size <= SMALL_VALUE_SIZE) {
+        request(pkt.data(), key, PUT_RQ);
+        for (uint32_t w = 0; w < 4; ++w) { // host order words, as the client
+          uint32_t word = 0;
+          if (size > 4 * w)
+            std::memcpy(&word, value.data() + 4 * w,
+                        std::min(4u, size - 4 * w));
+          word = htonl(word);
+          std::memcpy(pkt.data() + 16 + 4 * w, &word, sizeof(word));
+        }
+        sendto(soc, pkt.data(), PACKET_SIZE, 0, (sockaddr *)&server,
+               sizeof(server));
+      } else {
+        for (uint32_t f = 0; f < frags; ++f) {
+          uint32_t off = f * FRAGMENT_SIZE;
+          uint32_t bytes = std::min(FRAGMENT_SIZE, size - off);
+          request(pkt.data(), key, PUT_RQ, VALUE_FRAGMENT);
+          uint32_t vh[2] = {htonl(size), htonl(off)};
+          uint16_t vh2[2] = {htons(bytes), htons(frags)};
+          std::memcpy(pkt.data() + PACKET_SIZE, vh, sizeof(vh));
+          std::memcpy(pkt.data() + PACKET_SIZE + 8, vh2, sizeof(vh2));
+          std::memcpy(pkt.data() + PACKET_SIZE + VALUE_HEADER_SIZE,
+                      value.data() + off, bytes);
+          sendto(soc, pkt.data(), PACKET_SIZE + VALUE_HEADER_SIZE + bytes, 0,
+                 (sockaddr *)&server, sizeof(server));
+        }
+      }
+      while (recv(soc, pkt.data(), RX_SIZE, 0) >= int(PACKET_SIZE))
+        if (be64toh(field<uint64_t>(pkt.data(), 8)) == key) {
+          done = pkt[8 + 24] == PUT_RS;
+          if (!done)
+            exitWithErrorMessage("PUT of a " + std::to_string(size) +
+                                 " byte value failed (store full or --log)");
+          break;
+        }
+    }
+    if (!done)
+      exitWithErrorMessage("no reply to PUT from the server");
+    keys.push_back(key);
+  }
+  close(soc);
+  return keys;
+}
+
+int main(int argc, char **argv) {
+  bool help;
+  std::string ip, serverIp, data, valueSizes;
+  uint16_t port, serverPort, serverPorts;
+  uint32_t threads, batch, window, seconds, values;
+
+  popl::OptionParser parser;
+  parser.add<popl::Switch>("h", "help", "print this help message", &help);
+  parser.add<popl::Value<std::string>>("I", "ip", "the client's ip",
+                                       "42.0.0.2", &ip);
+  parser.add<popl::Value<uint16_t>>("P", "port", "base udp port", 4242, &port);
+  parser.add<popl::Value<uint32_t>>("j", "threads", "number of threads", 1,
+                                    &threads);
+  parser.add<popl::Value<std::string>>("", "server-ip", "server IPv4 address",
+                                       "42.0.0.4", &serverIp);
+  parser.add<popl::Value<uint16_t>>("", "server-port", "server UDP port", 4242,
+                                    &serverPort);
+  parser.add<popl::Value<uint16_t>>("", "server-ports",
+                                    "number of server ports (threads)", 1,
+                                    &serverPorts);
+  parser.add<popl::Value<uint32_t>>("b", "batch", "requests per sendmmsg", 32,
+                                    &batch);
+  parser.add<popl::Value<uint32_t>>("w", "window",
+                                    "requests in flight per thread", 256,
+                                    &window);
+  parser.add<popl::Value<uint32_t>>("d", "duration", "seconds to run", 5,
+                                    &seconds);
+  parser.add<popl::Value<std::string>>("", "data", "keys to ask for",
+                                       "data.txt", &data);
+  parser.add<popl::Value<std::string>>(
+      "", "value-sizes", "value sizes to run with, e.g. 16,256,4096", "",
+      &valueSizes);
+  parser.add<popl::Value<uint32_t>>("", "values",
+                                    "keys PUT per value size", 1000, &values);
+  parser.parse(argc, argv);
+  if (help) {
+    std::cout << parser;
+    return 0;
+  }
+  if (threads == 0 || serverPorts == 0)
+    exitWithErrorMessage("-j/--threads and --server-ports must be > 0");
+  if (batch == 0 || batch > window)
+    exitWithErrorMessage("-b/--batch must be in [1, window]");
+
+  std::vector<uint32_t> sizes;
+  for (size_t pos = 0; pos < valueSizes.size();) {
+    auto end = std::min(valueSizes.find(',', pos), valueSizes.size());
+    sizes.push_back(std::stoul(valueSizes.substr(pos, end - pos)));
+    if (sizes.back() == 0 || sizes.back() > MAX_VALUE_SIZE)
+      exitWithErrorMessage("--value-sizes must be in [1, " +
+                           std::to_string(MAX_VALUE_SIZE) + "]");
+    pos = end + 1;
+  }
+
+  std::vector<uint64_t> keys;
+  std::atomic<bool> stop{false};
+  std::vector<uint64_t> answered(threads), lost(threads), bytes(threads);
+
+  auto client = [&](uint32_t tid) {
+    sockaddr_in addr = {}, server = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip.c_str());
+    addr.sin_port = htons(port + tid);
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(serverIp.c_str());
+    server.sin_port = htons(serverPort + tid % serverPorts);
+
+    auto soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc < 0 || bind(soc, (sockaddr *)&addr, sizeof(addr)) < 0)
+      exitWithErrorMessage("bind socket to " + ip + "." +
+                           std::to_string(port + tid));
+    // room for the fragments of a window of long values (net.core.rmem_max
+    // caps it)
+    int rcvbuf = window * RX_SIZE * (MAX_VALUE_SIZE / FRAGMENT_SIZE);
+    setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    std::vector<char> tx(batch * PACKET_SIZE, 0), rx(batch * RX_SIZE, 0);
+    std::vector<iovec> txv(batch), rxv(batch);
+    std::vector<mmsghdr> txm(batch), rxm(batch);
+    for (uint32_t i = 0; i < batch; ++i) {
+      txv[i] = {&tx[i * PACKET_SIZE], PACKET_SIZE};
+      rxv[i] = {&rx[i * RX_SIZE], RX_SIZE};
+      txm[i].msg_hdr = {};
+      txm[i].msg_hdr.msg_name = &server;
+      txm[i].msg_hdr.msg_namelen = sizeof(server);
+      txm[i].msg_hdr.msg_iov = &txv[i];
+      txm[i].msg_hdr.msg_iovlen = 1;
+      rxm[i].msg_hdr = {};
+      rxm[i].msg_hdr.msg_iov = &rxv[i];
+      rxm[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint32_t rng = 42 + tid;
+    uint64_t inflight = 0;
+    auto quiet = std::chrono::steady_clock::now();
+    while (!stop.load(std::memory_order_relaxed)) {
+      if (inflight + batch <= window) {
+        for (uint32_t i = 0; i < batch; ++i)
+          request(&tx[i * PACKET_SIZE],
+                  keys[(rng = xorshift32(uint32_t(rng))) % keys.size()],
+                  GET_RQ);
+        int sent = sendmmsg(soc, txm.data(), batch, 0);
+        inflight += std::max(sent, 0);
+      }
+      int recvd = recvmmsg(soc, rxm.data(), batch, MSG_DONTWAIT, nullptr);
+      auto now = std::chrono::steady_clock::now();
+      if (recvd > 0) {
+        // A long value is answered by its last fragment
+        int replies = 0;
+        for (int i = 0; i < recvd; ++i) {
+          auto *p = &rx[i * RX_SIZE];
+          uint32_t mask = ntohl(field<uint32_t>(p, 8 + 25));
+          if (!(mask & VALUE_FRAGMENT) ||
+              rxm[i].msg_len < PACKET_SIZE + VALUE_HEADER_SIZE) {
+            bytes[tid] += p[8 + 24] == GET_RS ? SMALL_VALUE_SIZE : 0;
+            ++replies;
+            continue;
+          }
+          uint32_t len = ntohl(field<uint32_t>(p, PACKET_SIZE));
+          uint32_t off = ntohl(field<uint32_t>(p, PACKET_SIZE + 4));
+          uint16_t n = ntohs(field<uint16_t>(p, PACKET_SIZE + 8));
+          bytes[tid] += n;
+          replies += off + n == len;
+        }
+        answered[tid] += replies;
+        inflight -= std::min<uint64_t>(replies, inflight);
+        quiet = now;
+      } else if (now - quiet > std::chrono::milliseconds(10)) {
+        // nothing for a while, what is in flight was dropped
+        lost[tid] += inflight;
+        inflight = 0;
+        quiet = now;
+      }
+    }
+    close(soc);
+  };
+
+  auto run = [&](std::string const &what) {
+    stop = false;
+    std::fill(answered.begin(), answered.end(), 0);
+    std::fill(lost.begin(), lost.end(), 0);
+    std::fill(bytes.begin(), bytes.end(), 0);
+    std::vector<std::thread> clients;
+    for (uint32_t tid = 0; tid < threads; ++tid)
+      clients.emplace_back(client, tid);
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+    for (auto &t : clients)
+      t.join();
+
+    uint64_t total = 0, drops = 0, volume = 0;
+    for (uint32_t tid = 0; tid < threads; ++tid) {
+      total += answered[tid];
+      drops += lost[tid];
+      volume += bytes[tid];
+    }
+    double rate = double(total) / seconds;
+    auto ports = std::min<uint32_t>(serverPorts, threads);
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << "[bench] " << what << "threads " << threads << " | batch "
+              << batch << " | window " << window << " | " << rate
+              << " req/s, " << rate / ports << " per server port (" << ports
+              << ") | " << std::setprecision(1)
+              << volume / 1048576.0 / seconds << " MB/s of values | lost "
+              << drops << '\n';
+  };
+
+  if (sizes.empty()) {
+    keys = loadKeys(data.c_str());
+    if (keys.empty())
+      exitWithErrorMessage("no keys in " + data);
+    run("");
+    return 0;
+  }
+
+  sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = inet_addr(serverIp.c_str());
+  server.sin_port = htons(serverPort);
+  for (auto size : sizes) {
+    keys = putValues(ip, port, server, size, std::max(1u, values));
+    run("value " + std::to_string(size) + "B | ");
+  }
+}
@@ -1,19 +1,30 @@
 #include <algorithm>
 #include <arpa/inet.h>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <endian.h>
+#include <functional>
 #include <future>
 #include <iomanip>
 #include <iostream>
 #include <istream>
+#include <map>
+#include <memory>
 #include <netinet/in.h>
 #include <ostream>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <thread>
 
+#include "kv_blobs.h"
+#include "kv_log.h"
+#include "kv_store.h"
+#include "kv_table.h"
 #include "server_utils.h"
-#include <unordered_map>
 
 enum cache_op : uint8_t {
   GET_RQ = 1,
@@ -22,8 +33,12 @@ enum cache_op : uint8_t {
   PUT_RS,
   DEL_RQ,
   DEL_RS,
-  UDP_RQ,
-  UDP_RS
+  UPD_RQ,
+  UPD_RS,
+  // Between the server and the controller only, never for the device
+  HOT_RQ, // a key the device reported hot
+  POP_RQ, // send the device an UPD_RQ for a key
+  POP_RS
 };
 
 const unsigned NCP_HEADER_SIZE = 8;
@@ -54,8 +69,39 @@ struct __attribute__((packed)) ncl_h {
   char __pad[CACHELINE - NCL_HEADER_SIZE];
 };
 
+// Values longer than cache_h.v, up to MAX_VALUE_SIZE, go in fragments:
+// with VALUE_FRAGMENT set in the mask, a value_h and FRAGMENT_SIZE bytes
+// of the value (fewer in the last one) follow cache_h, cache_h.v unused.
+// Fragments pass the device as any request or reply does; it only caches
+// values that fit its CACHELINE_WORDS, the server sends it UPD_RQs for
+// those only.
+const unsigned CACHELINE_WORDS = 4; // see cache.cpp
+const unsigned VALUE_SIZE = CACHELINE_WORDS * sizeof(uint32_t);
+const unsigned FRAGMENT_SIZE = 1024;
+const unsigned MAX_FRAGMENTS = 8;
+const unsigned MAX_VALUE_SIZE = FRAGMENT_SIZE * MAX_FRAGMENTS;
+const uint32_t VALUE_FRAGMENT = 1u << 31;
+// Set in a PUT_RQ answered unchanged because the store is full
+const uint32_t STORE_FULL = 1u << 30;
+
+const unsigned VALUE_HEADER_SIZE = 12;
+struct __attribute__((packed)) value_h {
+  uint32_t len;   // of the whole value
+  uint32_t off;   // of this fragment in it
+  uint16_t bytes; // in this fragment
+  uint16_t frags; // of the whole value
+};
+
+// What follows ncl_h in a fragment
+struct __attribute__((packed)) fragment {
+  value_h value;
+  char data[FRAGMENT_SIZE];
+};
+
 inline bool isset(uint32_t value, int i) { return (value & (1 << i)) != 0; }
 
+const uint32_t VALUE_MASK = (1 << CACHELINE_WORDS) - 1; // all words of a value
+
 // void createCachePacket(cache_h &c, uint64_t key, uint32_t *val, cache_op op,
 //                        uint32_t mask = 0) {
 //   c.key = key;
@@ -91,8 +137,246 @@ uint64_t stringToUInt64(const std::string &str) {
   return result;
 }
 
-void server(uint32_t tid,
-            std::unordered_map<uint64_t, std::array<uint32_t, 4>> const &kvs,
+// Revalidates the device's copy of `key` after a PUT. The device
+// invalidated the line when the PUT went through it and only serves GETs
+// for the key again once an UPD_RQ rewrites it. Sent without waiting, the
+// device reflects an UPD_RS that the server drops. Keys the device does
+// not cache come back as the UPD_RQ and are dropped too.
+void createUpdate(ncl_h &u, uint64_t key, KvStore::Value const &v) {
+  u = {};
+  u.ncp.h_src = opt.NclID;
+  u.ncp.h_dst = opt.NclID;
+  u.ncp.d_dst = 1;
+  u.ncp.cid = 1;
+  u.cache.key = htobe64(key);
+  for (auto i = 0; i < 4; ++i)
+    u.cache.v[i] = htonl(v[i]);
+  u.cache.op = cache_op::UPD_RQ;
+  u.cache.mask = htonl(VALUE_MASK);
+}
+
+// With --log, PUTs and DELs are answered once they are on disk
+static std::unique_ptr<KvLog> kvlog;
+
+// Where the replies of a thread go
+struct endpoint {
+  int soc;
+  sockaddr_in device;
+};
+
+// What a batch found out about a request before handle()
+struct request {
+  KvStore::Value const *got = nullptr; // GET, POP: the value, or nullptr
+  KvBlobs::Blob blob;                  // GET: the value if it is long
+  std::string value;                   // PUT: a long value, reassembled
+};
+
+// Turns request `p` from `from` into its reply, false if there is none.
+// Fills `u` with an UPD_RQ for the device and sets `update` after a PUT.
+// GETs were looked up beforehand, for a batch at once, see `request`. A
+// reply with VALUE_FRAGMENT set is the header of the fragments of
+// `rq.blob`, which the caller sends. A POP_RQ (from the controller, which
+// just made the device cache the key) gets an UPD_RQ with the value, so
+// the device has the latest one. With --log, a PUT or DEL that
+// succeeds returns false, its reply (and UPD_RQ) is sent by the log's
+// commit thread once the write is durable. The reply's key is left in
+// host order, the caller puts it back in network order.
+bool handle(uint32_t tid, KvStore &kvs, KvBlobs &blobs, endpoint const &ep,
+            sockaddr_in const &from, ncl_h &p, ncl_h &u, bool &update,
+            request const &rq) {
+  // Device replies to our own UPD_RQs
+  if (p.cache.op == cache_op::UPD_RQ || p.cache.op == cache_op::UPD_RS)
+    return false;
+
+  p.cache.key = be64toh(p.cache.key);
+
+  p.ncp.d_dst = 0; // we don't want the device to do anything
+  p.ncp.h_dst = 2; // p.ncp.h_src;
+  p.ncp.d_src = 0;
+  p.ncp.h_src = 4;
+
+  // std::cout << "NCP: hsrc: " << (uint32_t) p.ncp.h_src << ", hdst: " << (uint32_t) p.ncp.h_dst
+  //           << " d_src: " << (uint32_t)  p.ncp.d_src << " d_dst: " << (uint32_t) p.ncp.d_dst
+  //           << " cid: " << (uint32_t) p.ncp.cid << '\n';
+
+  // A request that fails is answered unchanged, with the op of the request
+  // (and STORE_FULL set for a PUT the store has no room for)
+  KvStore::Value v;
+  update = false;
+  bool fragmented = ntohl(p.cache.mask) & VALUE_FRAGMENT;
+  switch (p.cache.op) {
+  case cache_op::GET_RQ:
+    if (rq.got) {
+#ifdef DEBUG
+      log(tid) << "key found\n";
+#endif
+      p.cache.op = cache_op::GET_RS;
+      p.cache.mask = htonl(VALUE_MASK);
+      p.cache.v[0] = htonl((*rq.got)[0]);
+      p.cache.v[1] = htonl((*rq.got)[1]);
+      p.cache.v[2] = htonl((*rq.got)[2]);
+      p.cache.v[3] = htonl((*rq.got)[3]);
+    } else if (rq.blob) {
+      p.cache.op = cache_op::GET_RS;
+      p.cache.mask = htonl(VALUE_FRAGMENT);
+    }
+#ifdef DEBUG
+    else {
+      log(tid) << "key not found\n";
+    }
+#endif
+    return true;
+  case cache_op::PUT_RQ:
+    // The log holds values that fit cache_h.v only: with it, keys of long
+    // values (loaded from data.txt) are read-only
+    if (kvlog &&
+        (fragmented || (blobs.size() > 0 && blobs.get(p.cache.key))))
+      return true;
+    if (fragmented) {
+      // Nothing for the device: the PUT_RQ fragments invalidated its copy
+      // of the key, if it had one, and it stays invalid
+      std::lock_guard<std::mutex> guard(blobs.writer(p.cache.key));
+      blobs.put(p.cache.key, rq.value);
+      kvs.erase(p.cache.key);
+      p.cache.op = cache_op::PUT_RS;
+      p.cache.mask = 0;
+      return true;
+    }
+    for (auto i = 0; i < 4; ++i)
+      v[i] = ntohl(p.cache.v[i]);
+    if (kvlog) {
+      ncl_h rs = p;
+      rs.cache.key = htobe64(p.cache.key);
+      rs.cache.op = cache_op::PUT_RS;
+      auto r = kvlog->put(p.cache.key, v, [ep, from, rs, k = p.cache.key, v] {
+        ncl_h u;
+        createUpdate(u, k, v);
+        sendto(ep.soc, &rs, NCL_HEADER_SIZE, 0, (sockaddr *)&from,
+               sizeof(from));
+        sendto(ep.soc, &u, NCL_HEADER_SIZE, 0, (sockaddr *)&ep.device,
+               sizeof(ep.device));
+      });
+      if (r != KvStore::Full)
+        return false;
+      log(tid) << "warning: store full, PUT dropped\n";
+      p.cache.mask = htonl(STORE_FULL);
+      return true;
+    }
+    {
+      std::lock_guard<std::mutex> guard(blobs.writer(p.cache.key));
+      if (kvs.put(p.cache.key, v) != KvStore::Full) {
+        blobs.erase(p.cache.key);
+        p.cache.op = cache_op::PUT_RS;
+        createUpdate(u, p.cache.key, v);
+        update = true;
+      } else {
+        log(tid) << "warning: store full, PUT dropped\n";
+        p.cache.mask = htonl(STORE_FULL);
+      }
+    }
+    return true;
+  case cache_op::POP_RQ:
+    // No value that fits the device: answered unchanged, the controller
+    // takes the key out again
+    if (rq.got) {
+      createUpdate(u, p.cache.key, *rq.got);
+      update = true;
+      p.cache.op = cache_op::POP_RS;
+    }
+    return true;
+  case cache_op::DEL_RQ:
+    if (kvlog) {
+      ncl_h rs = p;
+      rs.cache.key = htobe64(p.cache.key);
+      rs.cache.op = cache_op::DEL_RS;
+      if (kvlog->erase(p.cache.key, [ep, from, rs] {
+            sendto(ep.soc, &rs, NCL_HEADER_SIZE, 0, (sockaddr *)&from,
+                   sizeof(from));
+          }))
+        return false;
+    } else {
+      std::lock_guard<std::mutex> guard(blobs.writer(p.cache.key));
+      if (kvs.erase(p.cache.key) | blobs.erase(p.cache.key))
+        p.cache.op = cache_op::DEL_RS;
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Sends the first `count` UPD_RQs of `upds` (through `utx`) with their
+// keys' values as they are now, not as the requests left them, under the
+// keys' writer locks: of two UPD_RQs for a key, from any threads, the one
+// sent last has the newer value. Keys no longer in the store (deleted, or
+// moved to the blobs) get none, the device's copy stays invalid.
+void sendUpdates(KvStore &kvs, KvBlobs &blobs, int soc,
+                 std::vector<ncl_h> &upds, std::vector<mmsghdr> &utx,
+                 int count, std::vector<std::mutex *> &writers) {
+  for (int i = 0; i < count; ++i)
+    writers[i] = &blobs.writer(be64toh(upds[i].cache.key));
+  // In address order, as no other thread holds more than one
+  std::sort(writers.begin(), writers.begin() + count);
+  auto last = std::unique(writers.begin(), writers.begin() + count);
+  for (auto w = writers.begin(); w != last; ++w)
+    (*w)->lock();
+  int kept = 0;
+  for (int i = 0; i < count; ++i) {
+    KvStore::Value v;
+    if (!kvs.get(be64toh(upds[i].cache.key), v))
+      continue;
+    createUpdate(upds[kept++], be64toh(upds[i].cache.key), v);
+  }
+  if (kept > 0)
+    sendmmsg(soc, utx.data(), kept, 0);
+  for (auto w = writers.begin(); w != last; ++w)
+    (*w)->unlock();
+}
+
+// PUT_RQ fragments of long values received so far, by client and key
+struct partial {
+  std::string value;
+  uint32_t have = 0; // fragments, a bit each
+};
+using partials = std::map<std::pair<uint64_t, uint64_t>, partial>;
+
+// Adds a PUT_RQ fragment of `recvd` bytes to the value it is part of, true
+// once that is complete, moved to `value`. False for a fragment that does
+// not fit the value_h of the others.
+bool reassemble(partials &ps, sockaddr_in const &from, ncl_h const &p,
+                fragment const &f, size_t recvd, std::string &value) {
+  uint32_t len = ntohl(f.value.len), off = ntohl(f.value.off);
+  uint16_t bytes = ntohs(f.value.bytes), frags = ntohs(f.value.frags);
+  if (len == 0 || len > MAX_VALUE_SIZE || off % FRAGMENT_SIZE ||
+      off >= len || bytes != std::min(FRAGMENT_SIZE, len - off) ||
+      frags != (len + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE ||
+      recvd < NCL_HEADER_SIZE + VALUE_HEADER_SIZE + bytes)
+    return false;
+
+  // Fragments of PUTs that were lost halfway never complete
+  if (ps.size() > 4096)
+    ps.clear();
+  auto &q = ps[{uint64_t(from.sin_addr.s_addr) << 16 | from.sin_port,
+                p.cache.key}];
+  if (q.value.size() != len) // a new value
+    q = {std::string(len, 0), 0};
+  std::memcpy(&q.value[off], f.data, bytes);
+  q.have |= 1u << (off / FRAGMENT_SIZE);
+  if (q.have != (1u << frags) - 1)
+    return false;
+  value = std::move(q.value);
+  ps.erase({uint64_t(from.sin_addr.s_addr) << 16 | from.sin_port,
+            p.cache.key});
+  return true;
+}
+
+// Requests answered by each thread, read by the --stats printer
+struct alignas(CACHELINE) counter {
+  std::atomic<uint64_t> requests{0};
+};
+static std::vector<counter> counters;
+
+void server(uint32_t tid, KvStore &kvs, KvBlobs &blobs,
             std::shared_future<void> sigstart) {
   sigstart.wait();
 
@@ -114,55 +398,164 @@ void server(uint32_t tid,
     return;
   }
 
-  log(tid) << "Listening on " << opt.IP << '.' << opt.Port + tid << '\n';
+  sockaddr_in device;
+  device.sin_family = AF_INET;
+  device.sin_addr.s_addr = inet_addr(opt.DeviceIp.c_str());
+  device.sin_port = htons(opt.DevicePort);
+  endpoint ep = {soc, device};
+
+  sockaddr_in controller;
+  controller.sin_family = AF_INET;
+  controller.sin_addr.s_addr = inet_addr(opt.ControllerIp.c_str());
+  controller.sin_port = htons(opt.ControllerPort);
+
+  log(tid) << "Listening on " << opt.IP << '.' << opt.Port + tid
+           << " | batch: " << opt.Batch << (opt.Poll ? ", polling" : "")
+           << '\n';
+
+  // One receive of up to Batch requests, then one send for their replies
+  // and one for the UPD_RQs of the PUTs among them. Replies are written
+  // over the requests, in place. Long values go in a send of their own,
+  // their fragments straight from the blobs, and so do the HOT_RQs for
+  // the controller.
+  auto n = opt.Batch;
+  std::vector<ncl_h> pkts(n), upds(n), hots(n);
+  std::vector<fragment> frags(n);
+  std::vector<sockaddr_in> from(n);
+  std::vector<iovec> iov(2 * n), uiov(n), hiov(n);
+  std::vector<mmsghdr> rx(n), tx(n), utx(n), htx(n);
+  std::vector<KvStore::Key> keys(n);
+  std::vector<KvStore::Value> vals(n);
+  std::unique_ptr<bool[]> hits(new bool[n]);
+  std::vector<std::mutex *> writers(n);
+  std::vector<request> rqs(n);
+  for (uint32_t i = 0; i < n; ++i) {
+    iov[2 * i] = {&pkts[i], NCL_HEADER_SIZE};
+    iov[2 * i + 1] = {&frags[i], sizeof(fragment)};
+    uiov[i] = {&upds[i], NCL_HEADER_SIZE};
+    rx[i].msg_hdr = {};
+    rx[i].msg_hdr.msg_name = &from[i];
+    rx[i].msg_hdr.msg_iov = &iov[2 * i];
+    rx[i].msg_hdr.msg_iovlen = 2;
+    utx[i].msg_hdr = {};
+    utx[i].msg_hdr.msg_name = &device;
+    utx[i].msg_hdr.msg_namelen = sizeof(device);
+    utx[i].msg_hdr.msg_iov = &uiov[i];
+    utx[i].msg_hdr.msg_iovlen = 1;
+    hiov[i] = {&hots[i], NCL_HEADER_SIZE};
+    htx[i].msg_hdr = {};
+    htx[i].msg_hdr.msg_name = &controller;
+    htx[i].msg_hdr.msg_namelen = sizeof(controller);
+    htx[i].msg_hdr.msg_iov = &hiov[i];
+    htx[i].msg_hdr.msg_iovlen = 1;
+  }
+  std::vector<value_h> fvh(n * MAX_FRAGMENTS);
+  std::vector<iovec> fiov(3 * n * MAX_FRAGMENTS);
+  std::vector<mmsghdr> ftx(n * MAX_FRAGMENTS);
+  partials puts;
+
+  // Blocking waits for the first request only, polling does not wait
+  int flags = opt.Poll ? MSG_DONTWAIT : MSG_WAITFORONE;
 
   while (true) {
-    sockaddr_in inaddr;
-    socklen_t inlen = sizeof(sockaddr_in);
+    for (uint32_t i = 0; i < n; ++i)
+      rx[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
 
-    ncl_h p = {};
-    int recvd =
-        recvfrom(soc, &p, NCL_HEADER_SIZE, 0, (sockaddr *)&inaddr, &inlen);
+    int recvd = recvmmsg(soc, rx.data(), n, flags, nullptr);
     if (recvd < 0) {
-      log(tid) << "recv error\n";
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        log(tid) << "recv error: " << strerror(errno) << '\n';
       continue;
     }
 
-    p.cache.key = be64toh(p.cache.key);
-
-    p.ncp.d_dst = 0; // we don't want the device to do anything
-    p.ncp.h_dst = 2; // p.ncp.h_src;
-    p.ncp.d_src = 0;
-    p.ncp.h_src = 4;
-
-    // std::cout << "NCP: hsrc: " << (uint32_t) p.ncp.h_src << ", hdst: " << (uint32_t) p.ncp.h_dst
-    //           << " d_src: " << (uint32_t)  p.ncp.d_src << " d_dst: " << (uint32_t) p.ncp.d_dst
-    //           << " cid: " << (uint32_t) p.ncp.cid << '\n';
-
-    if (auto It = kvs.find(p.cache.key); It != kvs.end()) {
-
-#ifdef DEBUG
-      log(tid) << "key found\n";
-#endif
-      p.cache.op = cache_op::GET_RS;
-      p.cache.mask = htonl((0xffffffff << 4) - 1); // just set all ones for now
-      p.cache.v[0] = htonl(It->second.at(0));
-      p.cache.v[1] = htonl(It->second.at(1));
-      p.cache.v[2] = htonl(It->second.at(2));
-      p.cache.v[3] = htonl(It->second.at(3));
+    // Look up the keys of all GETs (and POPs) first, their cache misses
+    // overlap
+    auto lookup = [](uint8_t op) {
+      return op == cache_op::GET_RQ || op == cache_op::POP_RQ;
+    };
+    int gets = 0;
+    for (int i = 0; i < recvd; ++i)
+      if (lookup(pkts[i].cache.op))
+        keys[gets++] = be64toh(pkts[i].cache.key);
+    kvs.multiGet(keys.data(), gets, vals.data(), hits.get());
+
+    int replies = 0, updates = 0, longs = 0, sends = 0, reports = 0;
+    for (int i = 0, g = 0; i < recvd; ++i) {
+      auto &rq = rqs[i];
+      rq.got = nullptr;
+      rq.blob = nullptr;
+      if (lookup(pkts[i].cache.op)) {
+        if (hits[g]) {
+          rq.got = &vals[g];
+        } else {
+          if (blobs.size() > 0 && pkts[i].cache.op == cache_op::GET_RQ)
+            rq.blob = blobs.get(keys[g]);
+          // A PUT that shortened the value may have moved the key from the
+          // blobs to the store since multiGet()
+          if (!rq.blob && kvs.get(keys[g], vals[g]))
+            rq.got = &vals[g];
+        }
+        ++g;
+      } else if (pkts[i].cache.op == cache_op::PUT_RQ &&
+                 (ntohl(pkts[i].cache.mask) & VALUE_FRAGMENT) &&
+                 !reassemble(puts, from[i], pkts[i], frags[i], rx[i].msg_len,
+                             rq.value)) {
+        continue;
+      }
+      bool update;
+      if (!handle(tid, kvs, blobs, ep, from[i], pkts[i], upds[updates],
+                  update, rq))
+        continue;
+      updates += update;
+      pkts[i].cache.key = htobe64(pkts[i].cache.key);
+      // The device counts the GETs it misses and flags the first for a key
+      // past its threshold. Only keys with values it can hold are worth
+      // reporting.
+      if (pkts[i].cache.hot && rq.got && opt.ControllerPort &&
+          pkts[i].cache.op == cache_op::GET_RS) {
+        hots[reports] = pkts[i];
+        hots[reports++].cache.op = cache_op::HOT_RQ;
+      }
+      if (!rq.blob || pkts[i].cache.op != cache_op::GET_RS) {
+        tx[replies].msg_hdr = rx[i].msg_hdr;
+        tx[replies++].msg_hdr.msg_iovlen = 1;
+        continue;
+      }
+      // The reply header, then a value_h and the value's bytes per fragment
+      uint32_t len = rq.blob->size();
+      uint32_t count = (len + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+      for (uint32_t f = 0; f < count; ++f, ++sends) {
+        uint32_t off = f * FRAGMENT_SIZE;
+        uint32_t bytes = std::min(FRAGMENT_SIZE, len - off);
+        fvh[sends] = {htonl(len), htonl(off), uint16_t(htons(bytes)),
+                      uint16_t(htons(count))};
+        fiov[3 * sends] = {&pkts[i], NCL_HEADER_SIZE};
+        fiov[3 * sends + 1] = {&fvh[sends], VALUE_HEADER_SIZE};
+        fiov[3 * sends + 2] = {const_cast<char *>(rq.blob->data()) + off,
+                               bytes};
+        ftx[sends].msg_hdr = rx[i].msg_hdr;
+        ftx[sends].msg_hdr.msg_iov = &fiov[3 * sends];
+        ftx[sends].msg_hdr.msg_iovlen = 3;
+      }
+      ++longs;
     }
 
-#ifdef DEBUG
-    else {
-      log(tid) << "key not found\n";
-    }
-#endif
-    sendto(soc, &p, NCL_HEADER_SIZE, 0, (sockaddr *)&inaddr, inlen);
+    if (replies > 0)
+      sendmmsg(soc, tx.data(), replies, 0);
+    if (updates > 0)
+      sendUpdates(kvs, blobs, soc, upds, utx, updates, writers);
+    if (reports > 0)
+      sendmmsg(soc, htx.data(), reports, 0);
+    for (int sent = 0, k; sent < sends; sent += k)
+      if ((k = sendmmsg(soc, ftx.data() + sent, sends - sent, 0)) <= 0)
+        break;
+    counters[tid].requests.fetch_add(replies + longs,
+                                     std::memory_order_relaxed);
   }
 }
 
-void loadKvs(const char *f,
-             std::unordered_map<uint64_t, std::array<uint32_t, 4>> &kvs) {
+// Values that fit cache_h.v go to `kvs`, longer ones to `blobs`
+void loadKvs(const char *f, KvTable &kvs, KvBlobs &blobs) {
   std::ifstream file(f);
 
   if (!file) {
@@ -184,10 +577,22 @@ void loadKvs(const char *f,
     uint64_t key = 0;
     std::array<uint32_t, 4> value = {0, 0, 0, 0};
 
-    std::strncpy((char *)&key, keyStr.c_str(), keyStr.size());
+    std::strncpy((char *)&key, keyStr.c_str(),
+                 std::min<size_t>(keyStr.size(), 8));
+    if (valueStr.size() > VALUE_SIZE) {
+      if (valueStr.size() > MAX_VALUE_SIZE) {
+        log() << "warning: value of " << keyStr << " longer than "
+              << MAX_VALUE_SIZE << " bytes, skipped\n";
+        continue;
+      }
+      blobs.put(key, std::move(valueStr));
+      kvs.erase(key);
+      continue;
+    }
     std::strncpy((char *)value.data(), valueStr.c_str(), valueStr.size());
 
-    kvs[key] = std::move(value);
+    kvs.insert(key, value);
+    blobs.erase(key);
   }
 
   file.close();
@@ -198,28 +603,115 @@ int main(int argc, char **argv) {
   if (opt.Help)
     return opt.help(std::cout);
 
-  std::unordered_map<uint64_t, std::array<uint32_t, 4>> kvs;
-  loadKvs("data.txt", kvs);
+  // Blocked before any thread starts (the log's commit thread included),
+  // so only the --dump thread takes SIGUSR1, see below
+  sigset_t usr1;
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &usr1, nullptr);
+
+  // One store for all threads, mapped from a snapshot (see kv-snapshot) or
+  // loaded from data.txt. Values longer than VALUE_SIZE are kept apart, in
+  // memory only: snapshots and the log hold the others.
+  std::unique_ptr<KvStore> store;
+  KvBlobs blobs;
+  if (!opt.Snapshot.empty()) {
+    std::string error;
+    if (!(store = KvStore::open(opt.Snapshot, error)))
+      exitWithErrorMessage(error);
+  } else {
+    KvTable data;
+    loadKvs("data.txt", data, blobs);
+    store.reset(new KvStore(std::max<size_t>(opt.Capacity, data.size() * 2)));
+    data.forEach(
+        [&](uint64_t k, const KvTable::Value &v) { store->put(k, v); });
+  }
+  auto &kvs = *store;
+
+  if (!opt.Log.empty()) {
+    auto t0 = std::chrono::steady_clock::now();
+    std::string error;
+    if (!(kvlog = KvLog::open(opt.Log, kvs, opt.LogCompact, error)))
+      exitWithErrorMessage(error);
+    auto t1 = std::chrono::steady_clock::now();
+    std::cout << "info: replayed " << kvlog->records() << " writes from "
+              << opt.Log << " in "
+              << std::chrono::duration<double>(t1 - t0).count() << "s"
+              << (kvlog->direct() ? "" : " (no O_DIRECT)") << '\n';
+    // Writes were acknowledged as durable up to a failure of the log,
+    // the server cannot go on without it
+    std::thread([] {
+      std::string error;
+      if (kvlog->wait(error))
+        exitWithErrorMessage("log " + opt.Log + ": " + error);
+    }).detach();
+  }
 
-  std::cout << "### kv-store ###\n";
-  uint32_t i = 0;
-  for (auto const &e : kvs) {
-    char key[9] = {0};
-    memccpy(&key, (char *)&e.first, 1, 8);
-    std::cout << std::setw(8) << key << " :";
-    std::cout << " " << std::string((char *)&e.second) << '\n';
+  if (kvs.size() <= 32) {
+    std::cout << "### kv-store ###\n";
+    kvs.forEach([](uint64_t k, const KvStore::Value &v) {
+      char key[9] = {0};
+      memccpy(&key, (char *)&k, 1, 8);
+      std::cout << std::setw(8) << key << " :";
+      std::cout << " " << std::string((char *)&v, 16).c_str() << '\n';
+    });
+    std::cout << "################\n\n";
   }
-  std::cout << "################\n\n";
+
+  // SIGUSR1 writes the live store to --dump, handled by a thread of its
+  // own (blocked above)
+  if (!opt.Dump.empty())
+    std::thread([&kvs, &blobs, usr1] {
+      for (int sig; sigwait(&usr1, &sig) == 0;) {
+        auto t0 = std::chrono::steady_clock::now();
+        std::string error;
+        if (!kvs.save(opt.Dump, opt.Threads, error)) {
+          log() << "error: dump: " << error << '\n';
+          continue;
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        log() << "info: wrote " << kvs.size() << " keys to " << opt.Dump
+              << " in " << std::chrono::duration<double>(t1 - t0).count()
+              << "s\n";
+        if (blobs.size() > 0)
+          log() << "warning: dump: " << blobs.size()
+                << " keys with values longer than " << VALUE_SIZE
+                << " bytes not in the snapshot\n";
+      }
+    }).detach();
+
+  counters = std::vector<counter>(opt.Threads);
 
   std::vector<std::thread> threads;
   std::promise<void> start;
   std::shared_future<void> sigstart = start.get_future().share();
 
   for (auto tid = 0; tid < opt.Threads; ++tid)
-    threads.emplace_back(server, tid, kvs, sigstart);
-
+    threads.emplace_back(server, tid, std::ref(kvs), std::ref(blobs),
+                         sigstart);
+
+  std::cout << "info: store of " << kvs.size() << " keys, room for "
+            << kvs.capacity() * 7 / 8 << ", " << kvs.bytes() / 1048576.0
+            << " MB\n";
+  if (blobs.size() > 0)
+    std::cout << "info: " << blobs.size() << " longer values, "
+              << blobs.bytes() / 1048576.0 << " MB\n";
   std::cout << "info: starting " << opt.Threads << " server threads\n";
   start.set_value();
+
+  // Requests per second, in total and per thread (one core each when
+  // pinned, see start_servers.sh)
+  for (uint64_t last = 0; opt.Stats;) {
+    std::this_thread::sleep_for(std::chrono::seconds(opt.Stats));
+    uint64_t total = 0;
+    for (auto &c : counters)
+      total += c.requests.load(std::memory_order_relaxed);
+    double rate = double(total - last) / opt.Stats;
+    log() << std::fixed << std::setprecision(0) << rate << " req/s, "
+          << rate / opt.Threads << " per thread\n";
+    last = total;
+  }
+
   for (auto &t : threads)
     if (t.joinable())
       t.join();
@@ -7,6 +7,7 @@
 #include <mutex>
 #include <ostream>
 #include <string>
+#include <sys/uio.h>
 
 inline void exitWithErrorMessage(const std::string &msg) {
   std::cout << "error: " << msg << '\n';
@@ -52,6 +53,16 @@ public:
   std::string DeviceIp;
   uint16_t DevicePort;
   uint8_t NclID;
+  size_t Capacity;
+  uint32_t Batch;
+  bool Poll;
+  uint32_t Stats;
+  std::string Snapshot;
+  std::string Dump;
+  std::string Log;
+  uint32_t LogCompact;
+  std::string ControllerIp;
+  uint16_t ControllerPort;
 
 #if defined(__AVX2__)
   bool AVX2Available = true;
@@ -77,6 +88,30 @@ public:
     parser.add<popl::Value<uint8_t>>("", "id", "the NetCL id of this host", 4,
                                       &NclID);
     parser.add<popl::Switch>("", "perf", "run in performance mode", &Perf);
+    parser.add<popl::Value<size_t>>(
+        "", "capacity",
+        "keys the store has room for (at least twice the loaded)", 1 << 20,
+        &Capacity);
+    parser.add<popl::Value<uint32_t>>(
+        "b", "batch", "requests received and answered per system call", 32,
+        &Batch);
+    parser.add<popl::Switch>("", "poll", "busy poll the socket instead of blocking",
+                             &Poll);
+    parser.add<popl::Value<uint32_t>>(
+        "", "stats", "print requests per second every N seconds (0 = off)", 0,
+        &Stats);
+    parser.add<popl::Value<std::string>>(
+        "", "snapshot", "map the store from this snapshot instead of data.txt",
+        "", &Snapshot);
+    parser.add<popl::Value<std::string>>(
+        "", "dump", "write the store to this snapshot on SIGUSR1", "", &Dump);
+    parser.add<popl::Value<std::string>>(
+        "", "log", "make PUTs and DELs durable in this log, replayed at start",
+        "", &Log);
+    parser.add<popl::Value<uint32_t>>(
+        "", "log-compact",
+        "rewrite the log once it holds N times the live keys (0 = never)", 4,
+        &LogCompact);
 
     parser.add<popl::Value<std::string>>("", "device-mac", "device MAC address",
                                          "42:00:00:00:00:00", &DeviceMac);
@@ -84,6 +119,13 @@ public:
                                          "42.0.0.0", &DeviceIp);
     parser.add<popl::Value<uint16_t>>("", "device-port", "device UDP port",
                                       4242, &DevicePort);
+    parser.add<popl::Value<std::string>>(
+        "", "controller-ip", "controller IPv4 address", "127.0.0.1",
+        &ControllerIp);
+    parser.add<popl::Value<uint16_t>>(
+        "", "controller-port",
+        "send the keys the device reports hot to this port (0 = none)", 0,
+        &ControllerPort);
   }
 
   void parse(int argc, char **argv) {
@@ -91,6 +133,9 @@ public:
 
     if (Threads == 0)
       exitWithErrorMessage("-j/--threads must be > 0");
+    if (Batch == 0 || Batch > UIO_MAXIOV)
+      exitWithErrorMessage("-b/--batch must be in [1, " +
+                           std::to_string(UIO_MAXIOV) + "]");
   }
 
   int help(std::ostream &o = std::cout) {
@@ -0,0 +1,170 @@
+#ifndef _SWITCH_TABLES_H_
+#define _SWITCH_TABLES_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// The device's cache state the controller manages, see cache.cpp: the
+// Index and Bitmap lookup tables, which place a key in a cache line and
+// pick its words, the per line hit counters Stats0/Stats1 and the heavy
+// hitter sketch (c0-c3, b0-b2). On the switch these are the bfrt tables
+// and registers of the same names.
+class SwitchTables {
+public:
+  using Key = uint64_t;
+  using bitmap_t = uint32_t;
+
+  static constexpr unsigned CachelineWords = 4; // CACHELINE_WORDS
+  static constexpr unsigned CacheLines = 4096;  // CACHE_LINES
+  static constexpr uint32_t HotThreshold = CacheLines; // HH_THRESH
+
+  virtual ~SwitchTables() = default;
+
+  // Index and Bitmap entries of `key`. The entry starts invalid, until an
+  // UPD_RQ writes its value.
+  virtual void install(Key key, uint16_t line, bitmap_t bitmap) = 0;
+  virtual void remove(Key key) = 0;
+
+  // Stats0/Stats1 of every line, hits of the entry whose bitmap has word 0
+  // and of the other one, zeroed once read
+  virtual void takeStats(std::vector<uint32_t> &stats0,
+                         std::vector<uint32_t> &stats1) = 0;
+
+  // Zeroes the sketch: keys are counted, and reported hot, anew
+  virtual void resetSketch() = 0;
+};
+
+// Stand-in for the switch: the same state in memory, and query(), what
+// the kernel does with a packet, to run the cache without a device.
+class LocalTables : public SwitchTables {
+public:
+  enum Op : uint8_t {
+    GET_RQ = 1,
+    GET_RS,
+    PUT_RQ,
+    PUT_RS,
+    DEL_RQ,
+    DEL_RS,
+    UPD_RQ,
+    UPD_RS
+  };
+  enum Action { Forward, Reflect, Drop };
+
+  // Misses after which a key is hot, HH_THRESH on the device
+  explicit LocalTables(uint32_t hotThreshold = HotThreshold)
+      : hotThreshold(hotThreshold),
+        cache(CachelineWords, std::vector<uint32_t>(CacheLines)),
+        valid0(CacheLines), valid1(CacheLines), stats0(CacheLines),
+        stats1(CacheLines), cms(4, std::vector<uint32_t>(CmsSize)),
+        bloom(3, std::vector<bool>(BloomSize)) {}
+
+  void install(Key key, uint16_t line, bitmap_t bitmap) override {
+    index[key] = line;
+    bitmaps[key] = bitmap;
+    validity(line, bitmap, false);
+  }
+
+  void remove(Key key) override {
+    index.erase(key);
+    bitmaps.erase(key);
+  }
+
+  void takeStats(std::vector<uint32_t> &s0,
+                 std::vector<uint32_t> &s1) override {
+    s0.swap(stats0);
+    s1.swap(stats1);
+    stats0.assign(CacheLines, 0);
+    stats1.assign(CacheLines, 0);
+  }
+
+  void resetSketch() override {
+    for (auto &c : cms)
+      std::fill(c.begin(), c.end(), 0);
+    for (auto &b : bloom)
+      std::fill(b.begin(), b.end(), false);
+  }
+
+  // The kernel, query() in cache.cpp
+  Action query(Key key, uint32_t *val, uint8_t &op, bitmap_t &mask,
+               bool &hot) {
+    auto i = index.find(key);
+    auto b = bitmaps.find(key);
+    if (i == index.end() || b == bitmaps.end()) {
+      if (op == GET_RQ)
+        heavyHitter(key, hot);
+      return Forward;
+    }
+    uint16_t line = i->second;
+    bitmap_t bitmap = b->second;
+    switch (op) {
+    default:
+      return Drop;
+    case PUT_RQ:
+    case DEL_RQ:
+      validity(line, bitmap, false);
+      return Forward;
+    case GET_RQ:
+      if (!(bitmap & 1 ? valid0[line] : valid1[line]))
+        return Forward;
+      for (unsigned w = 0; w < CachelineWords; ++w)
+        val[w] = bitmap & (1u << w) ? cache[w][line] : 0;
+      ++(bitmap & 1 ? stats0 : stats1)[line];
+      op = GET_RS;
+      mask = bitmap;
+      return Reflect;
+    case UPD_RQ:
+      op = UPD_RS;
+      validity(line, bitmap, true);
+      for (unsigned w = 0; w < CachelineWords; ++w)
+        if (bitmap & (1u << w))
+          cache[w][line] = val[w];
+      return Reflect;
+    }
+  }
+
+private:
+  static constexpr unsigned CmsBits = 14;   // CMS_BITS
+  static constexpr unsigned BloomBits = 15; // BLF_BITS
+  static constexpr size_t CmsSize = size_t(1) << CmsBits;
+  static constexpr size_t BloomSize = size_t(1) << BloomBits;
+
+  // The device's hashes are crc16/32/64 and xor; any independent ones do
+  static uint32_t hash(Key key, unsigned i, unsigned bits) {
+    uint64_t x = key + 0x9e3779b97f4a7c15ULL * (i + 1);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (x ^ (x >> 31)) & ((1u << bits) - 1);
+  }
+
+  void heavyHitter(Key key, bool &hot) {
+    uint32_t min = UINT32_MAX;
+    for (unsigned i = 0; i < cms.size(); ++i)
+      min = std::min(min, ++cms[i][hash(key, i, CmsBits)]);
+    if (min <= hotThreshold)
+      return;
+    bool seen = true;
+    for (unsigned i = 0; i < bloom.size(); ++i) {
+      auto h = hash(key, 4 + i, BloomBits);
+      seen &= bloom[i][h];
+      bloom[i][h] = true;
+    }
+    hot = !seen; // not recently reported
+  }
+
+  void validity(uint16_t line, bitmap_t bitmap, bool v) {
+    (bitmap & 1 ? valid0 : valid1)[line] = v;
+  }
+
+  uint32_t hotThreshold;
+  std::unordered_map<Key, uint16_t> index;
+  std::unordered_map<Key, bitmap_t> bitmaps;
+  std::vector<std::vector<uint32_t>> cache;
+  std::vector<bool> valid0, valid1;
+  std::vector<uint32_t> stats0, stats1;
+  std::vector<std::vector<uint32_t>> cms;
+  std::vector<std::vector<bool>> bloom;
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <cstring>
 #include <endian.h>
+#include <functional>
 #include <future>
 #include <iomanip>
 #include <iostream>
@@ -12,8 +13,9 @@
 #include <ostream>
 #include <sys/socket.h>
 
+#include "../ncl/kv_store.h"
+#include "../ncl/kv_table.h"
 #include "server_utils.h"
-#include <unordered_map>
 
 enum cache_op : uint8_t {
   GET_RQ = 1,
@@ -83,8 +85,7 @@ uint64_t stringToUInt64(const std::string &str) {
   return result;
 }
 
-void server(uint32_t tid,
-            std::unordered_map<uint64_t, std::array<uint32_t, 4>> const &kvs,
+void server(uint32_t tid, KvStore const &kvs,
             std::shared_future<void> sigstart) {
   if (opt.Threads > 1)
     sigstart.wait();
@@ -128,17 +129,17 @@ void server(uint32_t tid,
     log(tid) << "received op:" << (uint16_t)p.op << " key: " << p.key << " : "
              << (char *)&p.key << " from " << inip << "-" << inport << '\n';
 #endif
-    if (auto It = kvs.find(p.key); It != kvs.end()) {
+    if (KvStore::Value v; kvs.get(p.key, v)) {
 
 #ifdef DEBUG
       log(tid) << "key found\n";
 #endif
       p.op = cache_op::GET_RS;
       p.mask = htonl((0xffffffff << 4) - 1); // just set all ones for now
-      p.v[0] = htonl(It->second.at(0));
-      p.v[1] = htonl(It->second.at(1));
-      p.v[2] = htonl(It->second.at(2));
-      p.v[3] = htonl(It->second.at(3));
+      p.v[0] = htonl(v[0]);
+      p.v[1] = htonl(v[1]);
+      p.v[2] = htonl(v[2]);
+      p.v[3] = htonl(v[3]);
     }
 
 #ifdef DEBUG
@@ -150,8 +151,7 @@ void server(uint32_t tid,
   }
 }
 
-void loadKvs(const char *f,
-              std::unordered_map<uint64_t, std::array<uint32_t, 4>> &kvs) {
+void loadKvs(const char *f, KvTable &kvs) {
   std::ifstream file(f);
 
   if (!file) {
@@ -176,7 +176,7 @@ void loadKvs(const char *f,
     std::strncpy((char *)&key, keyStr.c_str(), keyStr.size());
     std::strncpy((char *)value.data(), valueStr.c_str(), valueStr.size());
 
-    kvs[key] = std::move(value);
+    kvs.insert(key, value);
   }
 
   file.close();
@@ -187,18 +187,25 @@ int main(int argc, char **argv) {
   if (opt.Help)
     return opt.help(std::cout);
 
-  std::unordered_map<uint64_t, std::array<uint32_t, 4>> kvs;
-  loadKvs("data.txt", kvs);
+  KvTable data;
+  loadKvs("data.txt", data);
+
+  // One store for all threads
+  KvStore kvs(std::max<size_t>(opt.Capacity, data.size() * 2));
+  data.forEach([&](uint64_t k, const KvTable::Value &v) { kvs.put(k, v); });
+  data = KvTable();
 
   std::cout << "### kv-store ###\n";
-  uint32_t i = 0;
-  for (auto const &e : kvs) {
+  kvs.forEach([](uint64_t k, const KvStore::Value &v) {
     char key[9] = {0};
-    memccpy(&key, (char *)&e.first, 1, 8);
+    memccpy(&key, (char *)&k, 1, 8);
     std::cout << std::setw(8) << key << " :";
-    std::cout << " " << std::string((char *)&e.second) << '\n';
-  }
+    std::cout << " " << std::string((char *)&v) << '\n';
+  });
   std::cout << "################\n\n";
+  std::cout << "info: store of " << kvs.size() << " keys, room for "
+            << kvs.capacity() * 7 / 8 << ", " << kvs.bytes() / 1048576.0
+            << " MB\n";
 
   std::vector<std::thread> threads;
   std::vector<statistics> stats;
@@ -209,7 +216,7 @@ int main(int argc, char **argv) {
     server(0, kvs, sigstart);
   } else {
     for (auto tid = 0; tid < opt.Threads; ++tid)
-      threads.emplace_back(server, tid, kvs, sigstart);
+      threads.emplace_back(server, tid, std::cref(kvs), sigstart);
     std::cout << "info: starting " << opt.Threads << " server threads\n";
     start.set_value();
     for (auto &t : threads)
@@ -52,6 +52,7 @@ public:
   std::string DeviceIp;
   uint16_t DevicePort;
   uint32_t Multiplier;
+  size_t Capacity;
 
 #if defined(__AVX2__)
   bool AVX2Available = true;
@@ -75,6 +76,9 @@ public:
                                       &Threads);
 
     parser.add<popl::Switch>("", "perf", "run in performance mode", &Perf);
+    parser.add<popl::Value<size_t>>(
+        "", "capacity", "keys the store has room for (default twice the loaded)",
+        0, &Capacity);
 
     parser.add<popl::Value<std::string>>("", "device-mac", "device MAC address",
                                          "42:00:00:00:00:00", &DeviceMac);